@@ -8,6 +8,7 @@
 #include "dedoppler.h"
 #include "dedoppler_hit.h"
 #include "dedoppler_hit_group.h"
+#include "h5_write_queue.h"
 #include "h5_writer.h"
 #include "hit_file_writer.h"
 #include "hit_recorder.h"
@@ -22,6 +23,63 @@
 #include "stamp_extractor.h"
 #include "util.h"
 
+/*
+  The H5Staging copies each batch of beamformed data out to pinned host memory,
+  asynchronously, so that it can be appended to the h5 files while the GPU goes
+  on to the next batch. There are two slots, so one batch can be copying while
+  the previous one is handed to the write queue.
+ */
+class H5Staging {
+ public:
+  const long batch_size;
+  const int num_beams;
+
+  H5Staging(long batch_size, int num_beams)
+    : batch_size(batch_size), num_beams(num_beams) {
+    size_t bytes = sizeof(float) * batch_size * num_beams;
+    for (int slot = 0; slot < 2; ++slot) {
+      cudaMallocHost(&data[slot], bytes);
+      checkCudaMalloc("H5Staging", bytes);
+      cudaEventCreateWithFlags(&copied[slot], cudaEventDisableTiming);
+      checkCuda("H5Staging event init");
+    }
+  }
+
+  ~H5Staging() {
+    for (int slot = 0; slot < 2; ++slot) {
+      cudaEventDestroy(copied[slot]);
+      cudaFreeHost(data[slot]);
+    }
+  }
+
+  // Queues up copying the batch that starts at time_offset, once the beamformer
+  // has written it. The beamformer uses the default stream, so this does too.
+  void copyAsync(int slot, const MultibeamBuffer& multibeam, int time_offset) {
+    for (int beam = 0; beam < num_beams; ++beam) {
+      long offset = ((long) beam * multibeam.num_timesteps + time_offset) *
+        multibeam.num_channels;
+      cudaMemcpyAsync(data[slot] + beam * batch_size, multibeam.data + offset,
+                      sizeof(float) * batch_size, cudaMemcpyDefault, 0);
+    }
+    cudaEventRecord(copied[slot], 0);
+    checkCuda("H5Staging copyAsync");
+  }
+
+  // Waits for a copy to finish, then appends each beam to its file
+  void append(int slot, H5WriteQueue* h5_queue, const vector<int>& h5_files) {
+    cudaEventSynchronize(copied[slot]);
+    checkCuda("H5Staging append");
+    for (int beam = 0; beam < num_beams; ++beam) {
+      const float* begin = data[slot] + beam * batch_size;
+      h5_queue->append(h5_files[beam], vector<float>(begin, begin + batch_size));
+    }
+  }
+
+ private:
+  float* data[2];
+  cudaEvent_t copied[2];
+};
+
 // Construct metadata for the data created by a RawFileGroup and Beamformer.
 // This metadata should apply to the entire span of channels, not just one band.
 FilterbankMetadata combineMetadata(const RawFileGroup& file_group,
@@ -145,8 +203,26 @@ void BeamformingPipeline::findHits() {
   Dedopplerer dedopplerer(multibeam.num_timesteps,
                           fb_buffer.num_channels,
                           metadata.foff, metadata.tsamp, false);
+  dedopplerer.max_hits = max_hits;
   cout << "dedoppler memory: " << prettyBytes(dedopplerer.memoryUsage()) << endl;
 
+  // Beamformed data is copied out after each batch and appended to h5 files in
+  // the background, up to two batches at a time, so that writing overlaps with
+  // beamforming.
+  unique_ptr<H5WriteQueue> h5_queue;
+  unique_ptr<H5Staging> h5_staging;
+  long h5_batch_size = (long) beamformer.numOutputTimesteps() * multibeam.num_channels;
+  if (!h5_dir.empty()) {
+    h5_queue.reset(new H5WriteQueue(2 * multibeam.num_beams * h5_batch_size *
+                                    sizeof(float)));
+    h5_staging.reset(new H5Staging(h5_batch_size, multibeam.num_beams));
+    cout << "h5 output queue memory: " << prettyBytes(h5_queue->max_queued_bytes)
+         << endl;
+    cout << "h5 staging memory: "
+         << prettyBytes(2 * multibeam.num_beams * h5_batch_size * sizeof(float))
+         << endl;
+  }
+
   unique_ptr<HitFileWriter> hit_recorder;
   if (record_hits) {
     string output_filename = fmt::format("{}/{}.hits", output_dir,
@@ -174,6 +250,31 @@ void BeamformingPipeline::findHits() {
     // At the start of this loop, neither buffer is being used, because
     // dedoppler analysis for any previous loop synchronized cuda devices.
     cout << "beamforming band " << band << "...\n";
+
+    // Each beam of this band gets its own h5 file
+    vector<int> h5_files;
+    if (h5_queue) {
+      for (int beam = 0; beam < multibeam.num_beams; ++beam) {
+        string beam_name = metadata.isCoherentBeam(beam)
+          ? fmt::format("beam{}", zeroPad(beam, numDigits(beamformer.num_beams)))
+          : "incoherent";
+
+        string h5_filename =
+          fmt::format("{}/{}.band{}.{}.h5",
+                      h5_dir,
+                      file_group.prefix,
+                      zeroPad(band, numDigits(num_bands)),
+                      beam_name);
+        FilterbankMetadata band_metadata = metadata.getSubsetMetadata(beam, band,
+                                                                      num_bands);
+        H5WriterOptions options = compressedOptions(band_metadata, h5_deflate_level);
+        options.chunk_timesteps = min(options.chunk_timesteps,
+                                      beamformer.numOutputTimesteps());
+        options.extendible = true;
+        h5_files.push_back(h5_queue->openFile(h5_filename, band_metadata, options));
+      }
+    }
+
     for (int batch = 0; batch < num_batches; ++batch) {
     
       int block_after_mid = batch * beamformer.num_blocks + beamformer.num_blocks / 2;
@@ -196,6 +297,22 @@ void BeamformingPipeline::findHits() {
       // previous batch, but that's okay.
       multibeam.hintWritingTime(time_offset);
       beamformer.run(*device_raw_buffer, multibeam, time_offset);
+
+      if (h5_queue) {
+        // Copy out this batch, and append the previous one to the h5 files.
+        // Waiting one batch behind lets the GPU run ahead of the copy.
+        h5_staging->copyAsync(batch % 2, multibeam, time_offset);
+        if (batch > 0) {
+          h5_staging->append((batch - 1) % 2, h5_queue.get(), h5_files);
+        }
+      }
+    }
+
+    if (h5_queue) {
+      h5_staging->append((num_batches - 1) % 2, h5_queue.get(), h5_files);
+    }
+    for (int h5_file : h5_files) {
+      h5_queue->closeFile(h5_file);
     }
 
     // Organize the coherent hits by coarse channel
@@ -204,28 +321,7 @@ void BeamformingPipeline::findHits() {
     for (int beam = 0; beam < multibeam.num_beams; ++beam) {
       multibeam.hintReadingBeam(beam);
       bool coherent = metadata.isCoherentBeam(beam);
-      
-      if (!h5_dir.empty()) {
-        // Write out data for this band and beam to a file
-        cudaDeviceSynchronize();
-        string beam_name = coherent 
-          ? fmt::format("beam{}", zeroPad(beam, numDigits(beamformer.num_beams)))
-          : "incoherent";
 
-        string h5_filename =
-          fmt::format("{}/{}.band{}.{}.h5",
-                      h5_dir,
-                      file_group.prefix,
-                      zeroPad(band, numDigits(num_bands)),
-                      beam_name);
-        FilterbankMetadata band_metadata = metadata.getSubsetMetadata(beam, band,
-                                                                      num_bands);
-        FilterbankBuffer output(multibeam.getBeam(beam));
-        H5Writer writer(h5_filename, band_metadata);
-        writer.setData(output.data);
-        writer.close();
-      }
-      
       // local_coarse_channel is the index of the coarse channel within the band
       for (int local_coarse_channel = 0;
            local_coarse_channel < coarse_channels_per_band;
@@ -259,6 +355,10 @@ void BeamformingPipeline::findHits() {
       }
     }
   }
+
+  if (h5_queue) {
+    h5_queue->flush();
+  }
 }
 
 /*
@@ -50,6 +50,12 @@ public:
   // If set, save the beamformed filterbanks as h5 files
   string h5_dir;
 
+  // How much to compress the h5 files, from 0 for not at all, up to 9
+  int h5_deflate_level;
+
+  // If positive, only keep this many hits for each coarse channel of each beam
+  int max_hits;
+
   // recipe_filename can either be a file ending in .bfr5 or a directory
   // If _fft_size is -1 we calculate from num_fine_channels
   BeamformingPipeline(const vector<string>& raw_files,
@@ -65,7 +71,7 @@ public:
     : raw_files(raw_files), output_dir(stripAnyTrailingSlash(output_dir)),
       recipe_filename(recipe_filename), num_bands(num_bands), sti(sti), snr(snr),
       max_drift(max_drift), num_bands_to_process(num_bands), record_hits(true),
-      file_group(raw_files),
+      h5_deflate_level(0), max_hits(0), file_group(raw_files),
       telescope_id(_telescope_id == NO_TELESCOPE_ID
                    ? file_group.getTelescopeID() : _telescope_id),
       fft_size(_fft_size > 0 ? _fft_size
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <assert.h>
+#include <iostream>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "cpu_taylor.h"
+#include "dedoppler.h"
+#include "taylor.h"
+#include "util.h"
+
+/*
+  The host implementation of the parts of the Dedopplerer that run on the GPU
+  in dedoppler.cu. This is only built for a CPU-only build.
+ */
+
+// How many channels make up one region for pruning
+const int PRUNE_BLOCK_SIZE = 4096;
+
+/*
+  The host equivalent of the sumColumns kernel.
+  input is a (num_timesteps x num_freqs) array, stored in row-major order.
+  sums is an array of size num_freqs.
+ */
+static void cpuSumColumns(const float* input, float* sums, int num_timesteps,
+                          int num_freqs) {
+  memset(sums, 0, num_freqs * sizeof(float));
+  for (int time = 0; time < num_timesteps; ++time) {
+    const float* row = input + (long) num_freqs * time;
+    for (int freq = 0; freq < num_freqs; ++freq) {
+      sums[freq] += row[freq];
+    }
+  }
+}
+
+static void* hostMalloc(const string& tag, size_t bytes) {
+  void* answer = malloc(bytes);
+  if (answer == nullptr) {
+    fatal(tag + ": could not allocate " + prettyBytes(bytes));
+  }
+  return answer;
+}
+
+// buffer1 and buffer2 wait for the first search, when storage_format is known
+void Dedopplerer::allocateBuffers() {
+  buffer1 = nullptr;
+  buffer2 = nullptr;
+  buffer_floats = 0;
+  cpu_column_sums = (float*) hostMalloc("Dedopplerer column_sums",
+                                        num_channels * sizeof(float));
+  cpu_top_path_sums = (float*) hostMalloc("Dedopplerer top_path_sums",
+                                          num_channels * sizeof(float));
+  cpu_top_drift_blocks = (int*) hostMalloc("Dedopplerer top_drift_blocks",
+                                           num_channels * sizeof(int));
+  cpu_top_path_offsets = (int*) hostMalloc("Dedopplerer top_path_offsets",
+                                           num_channels * sizeof(int));
+}
+
+// Grows buffer1 and buffer2 to hold num_floats floats, if they're smaller
+void Dedopplerer::reserveBuffers(long num_floats) {
+  if (num_floats <= buffer_floats) {
+    return;
+  }
+  size_t buffer_bytes = num_floats * sizeof(float);
+  free(buffer1);
+  free(buffer2);
+  buffer1 = (float*) hostMalloc("Dedopplerer buffer1", buffer_bytes);
+  buffer2 = (float*) hostMalloc("Dedopplerer buffer2", buffer_bytes);
+  buffer_floats = num_floats;
+}
+
+/*
+  The host Taylor tree can skip the zero padding, as long as the sums are fp32.
+ */
+int Dedopplerer::inputNumTimesteps() const {
+  return (storage_format == STORAGE_FP32) ? num_timesteps : rounded_num_timesteps;
+}
+
+void Dedopplerer::freeBuffers() {
+  free(buffer1);
+  free(buffer2);
+  free(cpu_column_sums);
+  free(cpu_top_path_sums);
+  free(cpu_top_drift_blocks);
+  free(cpu_top_path_offsets);
+}
+
+/*
+  Takes a bunch of hits that we found for coherent beams, and adds information
+  about their incoherent beam
+
+  Input should be the incoherent sum. Like search, it can be padded or not.
+  This function re-sorts hits by drift, so be aware that it will change order.
+
+  Each hit only needs one path sum, so rather than running the whole Taylor
+  tree for its drift block, we add up just that path with taylorPathSum.
+ */
+void Dedopplerer::addIncoherentPower(const FilterbankBuffer& input,
+                                     vector<DedopplerHit>& hits) {
+  assert(input.num_timesteps == rounded_num_timesteps ||
+         input.num_timesteps == num_timesteps);
+  assert(input.num_channels == num_channels);
+
+  sort(hits.begin(), hits.end(), &driftStepsLessThan);
+  
+  int drift_shift = rounded_num_timesteps - 1;
+
+  for (DedopplerHit& hit : hits) {
+    // Figure out what drift block this hit belongs to
+    int drift_block = (int) floor((float) hit.drift_steps / drift_shift);
+    int path_offset = hit.drift_steps - drift_block * drift_shift;
+    assert(0 <= path_offset && path_offset < drift_shift);
+
+    hit.incoherent_power = taylorPathSum(input.data, input.num_timesteps, num_channels,
+                                         rounded_num_timesteps, drift_block,
+                                         path_offset, hit.index);
+  }
+}
+
+/*
+  Runs the Taylor tree on the host for each drift block, leaving the column sums
+  and top paths in the cpu_ arrays. The drift blocks are split among num_threads
+  threads.
+  The input can have either num_timesteps or rounded_num_timesteps rows. Either
+  way, the results are the same as for zero-padded input.
+  With prune set, this skips the parts of the search that can't produce a hit.
+*/
+void Dedopplerer::findTopPaths(const FilterbankBuffer& input, int min_drift_block,
+                               int max_drift_block, double snr_threshold) {
+  // Zero out the path sums in between each coarse channel because
+  // we pick the top hits separately for each coarse channel
+  memset(cpu_top_path_sums, 0, num_channels * sizeof(float));
+  memset(cpu_top_drift_blocks, 0, num_channels * sizeof(int));
+  memset(cpu_top_path_offsets, 0, num_channels * sizeof(int));
+
+  cpuSumColumns(input.data, cpu_column_sums, input.num_timesteps, num_channels);
+  if (estimate_noise) {
+    noise_estimator.estimate(cpu_column_sums, num_channels, &noise_median,
+                             &noise_std_dev);
+  }
+
+  // Do the Taylor tree algorithm for each drift block
+  reserveBuffers(cpuTaylorBufferFloats(input.num_timesteps, num_channels,
+                                       storage_format));
+  if (prune && estimate_noise && storage_format == STORAGE_FP32) {
+    // This is the same threshold that findHits uses
+    float path_sum_threshold = snr_threshold * noise_std_dev + noise_median;
+    prunedTopPaths(input, min_drift_block, max_drift_block, path_sum_threshold);
+    return;
+  }
+  parallelCpuTaylorTreeTopPaths(input.data, buffer1, buffer2, input.num_timesteps,
+                                num_channels, min_drift_block, max_drift_block,
+                                cpu_top_path_sums, cpu_top_drift_blocks,
+                                cpu_top_path_offsets, storage_format, num_threads,
+                                &cpu_scratch);
+}
+
+/*
+  Finds the top paths like findTopPaths does, but skips the Taylor tree for any
+  region whose path sums can't be more than path_sum_threshold.
+
+  Skipping a region can leave its top path sums lower than they would be, but
+  never above the threshold when they would have been above it. Since findHits
+  only picks hits above the threshold, the hits stay the same.
+
+  A drift block with nothing pruned runs as usual. Otherwise, each run of
+  unpruned regions is copied out, along with the channels its paths drift into,
+  and searched on its own. The paths that stay inside the copy are exactly the
+  valid paths from those regions, so their sums are the same.
+ */
+void Dedopplerer::prunedTopPaths(const FilterbankBuffer& input, int min_drift_block,
+                                 int max_drift_block, float path_sum_threshold) {
+  int num_blocks = (num_channels + PRUNE_BLOCK_SIZE - 1) / PRUNE_BLOCK_SIZE;
+  int num_drift_blocks = max_drift_block - min_drift_block + 1;
+  path_sum_bounds.resize((long) num_drift_blocks * num_blocks);
+  cpuPathSumUpperBounds(input.data, input.num_timesteps, num_channels,
+                        min_drift_block, max_drift_block, PRUNE_BLOCK_SIZE,
+                        &row_maxima, path_sum_bounds.data());
+
+  long skipped_regions = 0;
+  int drift_block = min_drift_block;
+  while (drift_block <= max_drift_block) {
+    const double* bounds = path_sum_bounds.data() +
+      (long) (drift_block - min_drift_block) * num_blocks;
+    int num_pruned = count_if(bounds, bounds + num_blocks, [&](double bound) {
+      return bound <= path_sum_threshold;
+    });
+
+    if (num_pruned == 0) {
+      // Search this drift block, and any following ones with nothing pruned,
+      // with all of our threads
+      int last_drift_block = drift_block;
+      while (last_drift_block < max_drift_block) {
+        const double* next = bounds + (long) (last_drift_block + 1 - drift_block) *
+          num_blocks;
+        if (any_of(next, next + num_blocks, [&](double bound) {
+              return bound <= path_sum_threshold;
+            })) {
+          break;
+        }
+        ++last_drift_block;
+      }
+      parallelCpuTaylorTreeTopPaths(input.data, buffer1, buffer2, input.num_timesteps,
+                                    num_channels, drift_block, last_drift_block,
+                                    cpu_top_path_sums, cpu_top_drift_blocks,
+                                    cpu_top_path_offsets, storage_format, num_threads,
+                                    &cpu_scratch);
+      drift_block = last_drift_block + 1;
+      continue;
+    }
+
+    skipped_regions += num_pruned;
+    int block = 0;
+    while (block < num_blocks) {
+      if (bounds[block] <= path_sum_threshold) {
+        ++block;
+        continue;
+      }
+      int end_block = block + 1;
+      while (end_block < num_blocks && bounds[end_block] > path_sum_threshold) {
+        ++end_block;
+      }
+
+      // The start channels to search, and the channels their paths can reach
+      int first_chan = block * PRUNE_BLOCK_SIZE;
+      int end_chan = min(num_channels, end_block * PRUNE_BLOCK_SIZE);
+      int first_copied = max(0, first_chan + min(0, drift_block * drift_timesteps));
+      int end_copied = min(num_channels,
+                           end_chan + max(0, (drift_block + 1) * drift_timesteps));
+      int width = end_copied - first_copied;
+
+      region_input.resize((long) input.num_timesteps * width);
+      for (int time = 0; time < input.num_timesteps; ++time) {
+        const float* row = input.data + (long) time * num_channels;
+        copy(row + first_copied, row + end_copied,
+             region_input.begin() + (long) time * width);
+      }
+      region_top_paths.top_path_sums.assign(width, 0.0);
+      region_top_paths.top_drift_blocks.resize(width);
+      region_top_paths.top_path_offsets.resize(width);
+      parallelCpuTaylorTreeTopPaths(region_input.data(), buffer1, buffer2,
+                                    input.num_timesteps, width, drift_block,
+                                    drift_block,
+                                    region_top_paths.top_path_sums.data(),
+                                    region_top_paths.top_drift_blocks.data(),
+                                    region_top_paths.top_path_offsets.data(),
+                                    storage_format, 1, &cpu_scratch);
+
+      // Merge in the results, the same way the drift block would have updated them
+      for (int chan = first_chan; chan < end_chan; ++chan) {
+        int i = chan - first_copied;
+        if (region_top_paths.top_path_sums[i] > cpu_top_path_sums[chan]) {
+          cpu_top_path_sums[chan] = region_top_paths.top_path_sums[i];
+          cpu_top_drift_blocks[chan] = region_top_paths.top_drift_blocks[i];
+          cpu_top_path_offsets[chan] = region_top_paths.top_path_offsets[i];
+        }
+      }
+      block = end_block;
+    }
+    ++drift_block;
+  }
+
+  pruning_stats.regions += (long) num_drift_blocks * num_blocks;
+  pruning_stats.skipped_regions += skipped_regions;
+  ++pruning_stats.coarse_channels;
+  if (skipped_regions == (long) num_drift_blocks * num_blocks) {
+    ++pruning_stats.skipped_coarse_channels;
+  }
+}
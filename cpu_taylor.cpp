@@ -0,0 +1,984 @@
+#include "cpu_taylor.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <float.h>
+#include <fmt/core.h>
+#include <math.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "simd.h"
+#include "taylor.h"
+#include "util.h"
+
+using namespace std;
+
+/*
+  Combines two adjacent Taylor trees of path_length / 2 timesteps each into one
+  tree of path_length timesteps. first_half holds path_length / 2 rows of path
+  sums, and target gets path_length rows.
+  Like any single time block of a Taylor tree round, this does not care where
+  the halves came from, so they can be cached subtrees of a longer input.
+
+  second_half holds second_half_rows rows, which is normally path_length / 2.
+  It can be fewer when the second half is a tree of fewer timesteps, followed by
+  zero padding. A Taylor tree of 2n timesteps whose last n are zero is just the
+  tree of the first n, with each row repeated twice, so we read every row of
+  the smaller tree as many times as it would have been repeated.
+
+  This calculates the same thing as running taylorOneStepOneChannel for every
+  channel, with the same bounds checking and the same buffer shapes. Instead of
+  going channel by channel, though, it handles a whole row of start frequencies
+  for one path offset at a time. Each row is the sum of two contiguous source
+  rows, one of them shifted over by chan_shift, so it vectorizes neatly and
+  streams through memory in order.
+
+  Target row path_offset only reads rows of first_half at or before path_offset,
+  so going through the path offsets from last to first, target can be the same
+  buffer as first_half.
+ */
+void cpuTaylorMergeStep(const float* first_half, const float* second_half,
+                        int second_half_rows, float* target, int num_source_channels,
+                        int num_target_channels, int path_length, int drift_block) {
+  int repeats = path_length / 2 / second_half_rows;
+  for (int path_offset = path_length - 1; path_offset >= 0; --path_offset) {
+    // See taylorOneStepOneChannel for an explanation of these quantities
+    int half_offset = path_offset / 2;
+    int chan_shift = (path_offset + 1) / 2 + drift_block * path_length / 2;
+
+    // The channels for which both the target and the shifted source are in range
+    int begin = max(0, -chan_shift);
+    int end = min(min(num_source_channels, num_target_channels),
+                  num_source_channels - chan_shift);
+    if (begin >= end) {
+      continue;
+    }
+
+    const float* first = first_half + (long) half_offset * num_source_channels;
+    const float* second = second_half +
+      (long) (half_offset / repeats) * num_source_channels + chan_shift;
+    float* target_row = target + (long) path_offset * num_target_channels;
+    addArrays(first + begin, second + begin, target_row + begin, end - begin);
+  }
+}
+
+/*
+  Runs one round of the Taylor tree algorithm, calculating the sums of paths of
+  length path_length from the sums of paths of length path_length / 2.
+  Each time block is merged from its two halves with cpuTaylorMergeStep.
+ */
+void cpuTaylorOneStep(const float* source_buffer, float* target_buffer,
+                      int num_timesteps, int num_source_channels,
+                      int num_target_channels, int path_length, int drift_block) {
+  int num_time_blocks = num_timesteps / path_length;
+  for (int time_block = 0; time_block < num_time_blocks; ++time_block) {
+    const float* first_half = source_buffer +
+      (long) time_block * path_length * num_source_channels;
+    const float* second_half = first_half + (long) path_length / 2 * num_source_channels;
+    float* target = target_buffer + (long) time_block * path_length * num_target_channels;
+    cpuTaylorMergeStep(first_half, second_half, path_length / 2, target,
+                       num_source_channels, num_target_channels, path_length,
+                       drift_block);
+  }
+}
+
+/*
+  Run all rounds of the Taylor tree algorithm on the CPU, one channel at a time.
+  This is the host version of basicTaylorTree, using the same helper for each step,
+  so its output matches the GPU exactly.
+
+  buffer1 and buffer2 are two host buffers provided to do work.
+  Returns the buffer that the eventual output is in.
+ */
+const float* basicCpuTaylorTree(const float* input, float* buffer1, float* buffer2,
+                                int num_timesteps, int num_channels, int drift_block) {
+  // The dataflow among the buffers looks like:
+  // input -> buffer1 -> buffer2 -> buffer1 -> buffer2 -> ...
+  const float* source_buffer = input;
+  float* target_buffer = buffer1;
+
+  for (int path_length = 2; path_length <= num_timesteps; path_length *= 2) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      taylorOneStepOneChannel(source_buffer, target_buffer,
+                              chan, num_timesteps, num_channels, num_channels,
+                              path_length, drift_block);
+    }
+
+    // Swap buffer aliases to make the old target the new source
+    source_buffer = target_buffer;
+    target_buffer = (target_buffer == buffer1) ? buffer2 : buffer1;
+  }
+
+  return source_buffer;
+}
+
+/*
+  Run all rounds of the Taylor tree algorithm on the CPU, a row at a time, using
+  whichever vector instructions this machine has.
+  The output is identical to basicCpuTaylorTree.
+ */
+const float* simdTaylorTree(const float* input, float* buffer1, float* buffer2,
+                            int num_timesteps, int num_channels, int drift_block) {
+  const float* source_buffer = input;
+  float* target_buffer = buffer1;
+
+  for (int path_length = 2; path_length <= num_timesteps; path_length *= 2) {
+    cpuTaylorOneStep(source_buffer, target_buffer, num_timesteps,
+                     num_channels, num_channels, path_length, drift_block);
+
+    source_buffer = target_buffer;
+    target_buffer = (target_buffer == buffer1) ? buffer2 : buffer1;
+  }
+
+  return source_buffer;
+}
+
+/*
+  The number of bytes of cache that each core can keep a tile in.
+  We use the L2 size where the OS reports it, and a conservative guess otherwise.
+ */
+static long detectTileCacheBytes() {
+  long reported = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  reported = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  return (reported > 0) ? reported : 256 * 1024;
+}
+
+// Several search threads can ask at once, and a function-local static is
+// initialized only once, threadsafely
+static long cpuTileCacheBytes() {
+  static const long cache_bytes = detectTileCacheBytes();
+  return cache_bytes;
+}
+
+/*
+  Picks the tile shape for tiledCpuTaylorTree, based on the cache size.
+
+  Half the cache goes to the two tile buffers, leaving the rest for the input and
+  output rows streaming through. Within that budget we make the tile as tall as
+  we can, since every round done inside the tile is a pass over main memory that
+  we save. But each tile only produces output for tile_width - tile_height
+  channels, so we keep the tile at least four times as wide as it is tall, to
+  bound the wasted work.
+ */
+void cpuTileShape(int num_timesteps, int* tile_height, int* tile_width) {
+  long tile_cells = cpuTileCacheBytes() / 2 / (2 * sizeof(float));
+  int height = 2;
+  while (height * 2 <= num_timesteps && 4L * (height * 2) * (height * 2) <= tile_cells) {
+    height *= 2;
+  }
+  // Round down to a multiple of the widest vector, to keep rows aligned
+  int width = max((long) (4 * height), tile_cells / height / 16 * 16);
+  *tile_height = min(height, num_timesteps);
+  *tile_width = width;
+}
+
+// Atomic, since search threads read it while a test may be setting it
+static atomic<bool> use_specialized_kernels(true);
+
+void setSpecializedTaylorKernels(bool enabled) {
+  use_specialized_kernels.store(enabled, memory_order_relaxed);
+}
+
+/*
+  Sets target[i] = a(i) + b(i + shift) for i in [0, n), where a(i) is
+  input[a_start + i] for i in [a_begin, a_end) and zero otherwise, and the same
+  for b. This is one row of the first round of a tile, read straight from the
+  input rather than from a sheared, zero-filled copy of it. The zeros are added
+  the same way, so the sums come out the same.
+ */
+static void addShearedRows(const float* input, long a_start, int a_begin, int a_end,
+                           long b_start, int b_begin, int b_end, int shift,
+                           float* target, int n) {
+  // Where both are in range, this is a plain addArrays
+  int begin = min(n, max(max(a_begin, b_begin - shift), 0));
+  int end = max(begin, min(min(a_end, b_end - shift), n));
+  auto sheared = [&](long start, int row_begin, int row_end, int i) {
+    return (row_begin <= i && i < row_end) ? input[start + i] : 0.0f;
+  };
+  for (int i = 0; i < begin; ++i) {
+    target[i] = sheared(a_start, a_begin, a_end, i) +
+      sheared(b_start, b_begin, b_end, i + shift);
+  }
+  if (begin < end) {
+    addArrays(input + a_start + begin, input + b_start + begin + shift, target + begin,
+              end - begin);
+  }
+  for (int i = end; i < n; ++i) {
+    target[i] = sheared(a_start, a_begin, a_end, i) +
+      sheared(b_start, b_begin, b_end, i + shift);
+  }
+}
+
+/*
+  One row of a round of the Taylor tree within a tile, for the first
+  num_columns columns. In a tile the drift block is zero, so this is one row of
+  cpuTaylorMergeStep, with the shift and row offsets all constants.
+  The target can be a different width from the source.
+ */
+template <int PATH_LENGTH, int PATH_OFFSET>
+static inline void tileMergeRow(const float* first_half, int width, float* target,
+                                int target_width, int num_columns) {
+  const int half_offset = PATH_OFFSET / 2;
+  const int chan_shift = (PATH_OFFSET + 1) / 2;
+  const float* first = first_half + (long) half_offset * width;
+  const float* second = first_half + (long) (PATH_LENGTH / 2 + half_offset) * width +
+    chan_shift;
+  addArrays(first, second, target + (long) PATH_OFFSET * target_width,
+            min(num_columns, width - chan_shift));
+}
+
+// Every row of one time block, unrolled
+template <int PATH_LENGTH, int... PATH_OFFSETS>
+static inline void tileMergeStep(const float* first_half, int width, float* target,
+                                 int target_width, int num_columns,
+                                 integer_sequence<int, PATH_OFFSETS...>) {
+  int unused[] = {
+    (tileMergeRow<PATH_LENGTH, PATH_OFFSETS>(first_half, width, target, target_width,
+                                             num_columns), 0)...
+  };
+  (void) unused;
+}
+
+/*
+  The middle rounds of the Taylor tree within a tile of TILE_HEIGHT rows, from
+  paths of PATH_LENGTH up to TILE_HEIGHT / 2, each one recursing on the next.
+  The last round is done separately, so the rounds end at PATH_LENGTH = 0.
+  Returns whichever buffer holds the output.
+ */
+template <int TILE_HEIGHT, int PATH_LENGTH>
+struct TileRounds {
+  static float* run(float* source, float* target, int width) {
+    for (int time_block = 0; time_block < TILE_HEIGHT / PATH_LENGTH; ++time_block) {
+      long offset = (long) time_block * PATH_LENGTH * width;
+      tileMergeStep<PATH_LENGTH>(source + offset, width, target + offset, width, width,
+                                 make_integer_sequence<int, PATH_LENGTH>());
+    }
+    const int next_length = (2 * PATH_LENGTH < TILE_HEIGHT) ? 2 * PATH_LENGTH : 0;
+    return TileRounds<TILE_HEIGHT, next_length>::run(target, source, width);
+  }
+};
+
+template <int TILE_HEIGHT>
+struct TileRounds<TILE_HEIGHT, 0> {
+  static float* run(float* source, float* target, int width) {
+    return source;
+  }
+};
+
+/*
+  Does the work of one tile of cpuTaylorTiles, for a tile height known at compile
+  time, with fp32 output. Most of the cost of a tile is moving data in and out
+  of it, rather than the rounds themselves, so this skips the two copies. The
+  first round reads the input where the sheared tile would have it, and the last
+  round writes its sums straight to the output.
+  The rounds in between have every row offset and shift as a constant.
+ */
+template <int TILE_HEIGHT>
+static void specializedTaylorTile(const float* input, float* output, int num_channels,
+                                  int drift_block, int time_offset, int block_start,
+                                  int tile_width, int output_width, float* tile1,
+                                  float* tile2) {
+  for (int time = 0; time < TILE_HEIGHT; time += 2) {
+    // Where each of the two input rows starts in the tile, and which of its
+    // columns are in range
+    long starts[2];
+    int begins[2], ends[2];
+    for (int i = 0; i < 2; ++i) {
+      int source_start = block_start + (time + i) * drift_block;
+      starts[i] = (long) (time_offset + time + i) * num_channels + source_start;
+      begins[i] = max(0, -source_start);
+      ends[i] = min(tile_width, num_channels - source_start);
+    }
+    for (int path_offset = 0; path_offset < 2; ++path_offset) {
+      addShearedRows(input, starts[0], begins[0], ends[0], starts[1], begins[1],
+                     ends[1], path_offset, tile1 + (long) (time + path_offset) * tile_width,
+                     tile_width - path_offset);
+    }
+  }
+
+  float* source = TileRounds<TILE_HEIGHT, 4>::run(tile1, tile2, tile_width);
+
+  tileMergeStep<TILE_HEIGHT>(source, tile_width,
+                             output + (long) time_offset * num_channels + block_start,
+                             num_channels, output_width,
+                             make_integer_sequence<int, TILE_HEIGHT>());
+}
+
+typedef void (*TaylorTileKernel)(const float*, float*, int, int, int, int, int, int,
+                                 float*, float*);
+
+/*
+  The specialized kernel for a tile height, or nullptr if there isn't one.
+ */
+static TaylorTileKernel specializedTaylorTileKernel(int tile_height) {
+  if (!use_specialized_kernels.load(memory_order_relaxed)) {
+    return nullptr;
+  }
+  switch (tile_height) {
+  case 8:
+    return specializedTaylorTile<8>;
+  case 16:
+    return specializedTaylorTile<16>;
+  case 32:
+    return specializedTaylorTile<32>;
+  case 64:
+    return specializedTaylorTile<64>;
+  case 128:
+    return specializedTaylorTile<128>;
+  case 256:
+    return specializedTaylorTile<256>;
+  default:
+    return nullptr;
+  }
+}
+
+/*
+  Runs the first log2(tile_height) rounds of the Taylor tree algorithm on the CPU,
+  in cache-sized tiles. This is the host version of tiledTaylorKernel.
+
+  Each tile is tile_height timesteps by tile_width channels. Like tiledTaylorKernel,
+  it uses unmapDrift's trick of shearing the input so that drift_block becomes
+  zero. That way, every path in the tile stays within the tile, and we can do
+  all of these rounds without going back to main memory. The tile's drift-zero
+  paths are then the drift_block paths of the whole input, added up in exactly
+  the same order, so the output is identical to basicCpuTaylorTree.
+
+  The output is written in output_format, so for the 16-bit formats, the tiles
+  are only rounded once, on the way out.
+  With fp32 output, the common tile heights use specializedTaylorTile instead.
+  tile_height must be a power of two, at least 2, and less than tile_width.
+ */
+static void cpuTaylorTiles(const float* input, void* output,
+                           StorageFormat output_format, int num_timesteps,
+                           int num_channels, int drift_block, int tile_height,
+                           int tile_width) {
+  assert(isPowerOfTwo(tile_height));
+  assert(2 <= tile_height && tile_height <= num_timesteps);
+  assert(tile_height < tile_width);
+
+  vector<float> tile1((long) tile_height * tile_width);
+  vector<float> tile2((long) tile_height * tile_width);
+
+  // Each tile produces output for the channels whose paths fit in the tile
+  int tile_block_width = tile_width - tile_height;
+
+  TaylorTileKernel kernel = (output_format == STORAGE_FP32)
+    ? specializedTaylorTileKernel(tile_height) : nullptr;
+
+  for (int time_offset = 0; time_offset < num_timesteps; time_offset += tile_height) {
+    for (int block_start = 0; block_start < num_channels;
+         block_start += tile_block_width) {
+      int output_width = min(tile_block_width, num_channels - block_start);
+      if (kernel != nullptr) {
+        kernel(input, (float*) output, num_channels, drift_block, time_offset,
+               block_start, tile_width, output_width, tile1.data(), tile2.data());
+        continue;
+      }
+
+      // Shear the input into the tile, zero-filling anything out of range.
+      // This does the same thing as unmapDrift, a row at a time.
+      for (int time = 0; time < tile_height; ++time) {
+        int source_start = block_start + time * drift_block;
+        int begin = max(0, -source_start);
+        int end = min(tile_width, num_channels - source_start);
+        float* row = tile1.data() + (long) time * tile_width;
+        if (begin >= end) {
+          fill(row, row + tile_width, 0.0);
+          continue;
+        }
+        fill(row, row + begin, 0.0);
+        copy(input + (long) (time_offset + time) * num_channels + source_start + begin,
+             input + (long) (time_offset + time) * num_channels + source_start + end,
+             row + begin);
+        fill(row + end, row + tile_width, 0.0);
+      }
+
+      float* source = tile1.data();
+      float* target = tile2.data();
+      for (int path_length = 2; path_length <= tile_height; path_length *= 2) {
+        cpuTaylorOneStep(source, target, tile_height, tile_width, tile_width,
+                         path_length, 0);
+        swap(source, target);
+      }
+
+      // Copy the finished part of the tile out
+      for (int row = 0; row < tile_height; ++row) {
+        const float* tile_row = source + (long) row * tile_width;
+        long output_index = (long) (time_offset + row) * num_channels + block_start;
+        if (output_format == STORAGE_FP32) {
+          copy(tile_row, tile_row + output_width, (float*) output + output_index);
+        } else {
+          floatsToHalves(tile_row, (uint16_t*) output + output_index, output_width,
+                         output_format);
+        }
+      }
+    }
+  }
+}
+
+/*
+  Runs the Taylor tree algorithm on the CPU up to paths of length max_path_length,
+  doing the first rounds in tiles with cpuTaylorTiles. This is the host version
+  of twoStageTaylorTree.
+  The remaining rounds are done a row at a time, as in simdTaylorTree.
+ */
+static const float* tiledCpuTaylorRounds(const float* input, float* buffer1,
+                                         float* buffer2, int num_timesteps,
+                                         int num_channels, int drift_block,
+                                         int tile_height, int tile_width,
+                                         int max_path_length) {
+  assert(tile_height <= max_path_length);
+  assert(max_path_length <= num_timesteps);
+  cpuTaylorTiles(input, buffer1, STORAGE_FP32, num_timesteps, num_channels,
+                 drift_block, tile_height, tile_width);
+
+  const float* source_buffer = buffer1;
+  float* target_buffer = buffer2;
+  for (int path_length = tile_height * 2; path_length <= max_path_length;
+       path_length *= 2) {
+    cpuTaylorOneStep(source_buffer, target_buffer, num_timesteps,
+                     num_channels, num_channels, path_length, drift_block);
+
+    source_buffer = target_buffer;
+    target_buffer = (target_buffer == buffer1) ? buffer2 : buffer1;
+  }
+
+  return source_buffer;
+}
+
+/*
+  Run all rounds of the Taylor tree algorithm on the CPU, using tiles of the
+  given shape for the early rounds. See tiledCpuTaylorRounds.
+ */
+const float* tiledCpuTaylorTree(const float* input, float* buffer1, float* buffer2,
+                                int num_timesteps, int num_channels, int drift_block,
+                                int tile_height, int tile_width) {
+  return tiledCpuTaylorRounds(input, buffer1, buffer2, num_timesteps, num_channels,
+                              drift_block, tile_height, tile_width, num_timesteps);
+}
+
+/*
+  Run the rounds of the Taylor tree algorithm on the CPU up to paths of length
+  max_path_length, picking the best algorithm for the data size.
+  The output has num_timesteps / max_path_length time blocks, so with
+  max_path_length = 1 it is just the input.
+ */
+const float* partialCpuTaylorTree(const float* input, float* buffer1, float* buffer2,
+                                  int num_timesteps, int num_channels, int drift_block,
+                                  int max_path_length) {
+  if (max_path_length < 2) {
+    return input;
+  }
+  if (max_path_length == 2) {
+    // A single round has nothing to gain from tiling
+    cpuTaylorOneStep(input, buffer1, num_timesteps, num_channels, num_channels, 2,
+                     drift_block);
+    return buffer1;
+  }
+
+  int tile_height, tile_width;
+  cpuTileShape(num_timesteps, &tile_height, &tile_width);
+  tile_height = min(tile_height, max_path_length);
+  return tiledCpuTaylorRounds(input, buffer1, buffer2, num_timesteps, num_channels,
+                              drift_block, tile_height, tile_width, max_path_length);
+}
+
+/*
+  Run a Taylor tree algorithm on the CPU, picking the best algorithm for the
+  data size.
+ */
+const float* optimizedCpuTaylorTree(const float* input, float* buffer1, float* buffer2,
+                                    int num_timesteps, int num_channels, int drift_block) {
+  return partialCpuTaylorTree(input, buffer1, buffer2, num_timesteps, num_channels,
+                              drift_block, num_timesteps);
+}
+
+/*
+  The host equivalent of the findTopPathSums kernel.
+
+  For every frequency freq, we update top_path_sums[freq] and friends with the
+  largest path sum that starts at freq in this drift block.
+
+  To keep memory access contiguous, we loop over path offsets on the outside and
+  process a whole row of frequencies at a time. The order in which path offsets
+  are considered for any single frequency is the same as on the GPU, so ties are
+  broken the same way.
+
+  The GPU kernel stops looking at a frequency as soon as it finds an invalid path,
+  starting from path offset zero. So a frequency whose zero-offset path ends below
+  zero gets no paths at all, and otherwise it gets the path offsets whose last
+  frequency is below num_freqs. We match that exactly.
+*/
+void cpuFindTopPathSums(const float* path_sums, int num_timesteps, int num_freqs,
+                        int drift_block, float* top_path_sums,
+                        int* top_drift_blocks, int* top_path_offsets) {
+  int drift_shift = (num_timesteps - 1) * drift_block;
+  int begin = max(0, -drift_shift);
+  for (int path_offset = 0; path_offset < num_timesteps; ++path_offset) {
+    int end = min(num_freqs, num_freqs - drift_shift - path_offset);
+    const float* row = path_sums + (long) num_freqs * path_offset;
+    for (int freq = begin; freq < end; ++freq) {
+      if (row[freq] > top_path_sums[freq]) {
+        top_path_sums[freq] = row[freq];
+        top_drift_blocks[freq] = drift_block;
+        top_path_offsets[freq] = path_offset;
+      }
+    }
+  }
+}
+
+/*
+  Runs the Taylor tree for one drift block and updates top_path_sums and friends,
+  with the same results as optimizedCpuTaylorTree followed by cpuFindTopPathSums.
+
+  The difference is that the last round never writes out its path sums. Each one
+  is compared against the top path sum for its frequency as soon as it's added up.
+  That saves writing the full num_timesteps x num_channels output and reading it
+  back again, which is the largest chunk of memory traffic in the last round.
+ */
+void cpuTaylorTreeTopPaths(const float* input, float* buffer1, float* buffer2,
+                           int num_timesteps, int num_channels, int drift_block,
+                           float* top_path_sums, int* top_drift_blocks,
+                           int* top_path_offsets) {
+  assert(num_timesteps >= 2);
+  int half_length = num_timesteps / 2;
+
+  // Two half-length path sums for every start frequency, like the source of
+  // the last cpuTaylorOneStep
+  const float* halves = partialCpuTaylorTree(input, buffer1, buffer2, num_timesteps,
+                                             num_channels, drift_block, half_length);
+
+  cpuMergeTopPaths(halves, halves + (long) half_length * num_channels, half_length,
+                   num_timesteps, num_channels, drift_block, top_path_sums,
+                   top_drift_blocks, top_path_offsets);
+}
+
+/*
+  Merges two adjacent Taylor trees of num_timesteps / 2 timesteps each, like
+  cpuTaylorMergeStep, but instead of writing out the merged path sums, updates
+  top_path_sums and friends with them, like cpuFindTopPathSums.
+  As in cpuTaylorMergeStep, second_half can have fewer rows when it stands for
+  a shorter tree followed by zero padding.
+
+  We go through the frequencies in chunks, so that the top path arrays for a chunk
+  stay in cache while we check every path offset.
+ */
+void cpuMergeTopPaths(const float* first_half, const float* second_half,
+                      int second_half_rows, int num_timesteps, int num_channels,
+                      int drift_block, float* top_path_sums, int* top_drift_blocks,
+                      int* top_path_offsets) {
+  int half_length = num_timesteps / 2;
+  int repeats = half_length / second_half_rows;
+
+  // The valid paths are the same as in cpuFindTopPathSums
+  int drift_shift = (num_timesteps - 1) * drift_block;
+  int begin = max(0, -drift_shift);
+
+  const int chunk_size = 4096;
+  for (int chunk_start = begin; chunk_start < num_channels;
+       chunk_start += chunk_size) {
+    int chunk_end = min(num_channels, chunk_start + chunk_size);
+    for (int path_offset = 0; path_offset < num_timesteps; ++path_offset) {
+      int end = min(chunk_end, num_channels - drift_shift - path_offset);
+      if (chunk_start >= end) {
+        // Later path offsets will end even further to the right
+        break;
+      }
+
+      // See taylorOneStepOneChannel for an explanation of these quantities
+      int half_offset = path_offset / 2;
+      int chan_shift = (path_offset + 1) / 2 + drift_block * half_length;
+      const float* first = first_half + (long) half_offset * num_channels;
+      const float* second = second_half +
+        (long) (half_offset / repeats) * num_channels + chan_shift;
+      addArraysUpdateMax(first + chunk_start, second + chunk_start,
+                         top_path_sums + chunk_start, top_drift_blocks + chunk_start,
+                         top_path_offsets + chunk_start, drift_block, path_offset,
+                         end - chunk_start);
+    }
+  }
+}
+
+/*
+  How many timesteps of path sums each buffer needs for unpaddedCpuTaylorTreeTopPaths.
+  This is num_timesteps for a power of two, and otherwise, the largest power of
+  two below num_timesteps plus the smallest power of two covering the rest.
+ */
+int cpuTaylorBufferTimesteps(int num_timesteps) {
+  if (isPowerOfTwo(num_timesteps)) {
+    return num_timesteps;
+  }
+  int half_length = roundUpToPowerOfTwo(num_timesteps) / 2;
+  return half_length + roundUpToPowerOfTwo(num_timesteps - half_length);
+}
+
+long cpuTaylorBufferFloats(int num_timesteps, int num_channels, StorageFormat format) {
+  long num_sums = (long) cpuTaylorBufferTimesteps(num_timesteps) * num_channels;
+  return (format == STORAGE_FP32) ? num_sums : (num_sums + 1) / 2;
+}
+
+/*
+  Updates top_path_sums and friends for one drift block, with the same results
+  as zero-padding the input up to a power of two and running cpuTaylorTreeTopPaths.
+  The input only has num_timesteps rows, though, and we never add up the padding.
+  buffer1 and buffer2 need cpuTaylorBufferTimesteps(num_timesteps) rows each.
+
+  We split the timesteps into power-of-two segments, like the binary digits of
+  num_timesteps, with the largest segment first. Each segment gets a regular
+  Taylor tree. Then, from the right, each segment is merged with the tree of
+  everything after it, which stands for a zero-padded tree as large as the
+  segment. See cpuTaylorMergeStep. The largest segment is the first half of
+  the padded tree, so its merge is fused with the top path search.
+ */
+void unpaddedCpuTaylorTreeTopPaths(const float* input, float* buffer1, float* buffer2,
+                                   int num_timesteps, int num_channels,
+                                   int drift_block, float* top_path_sums,
+                                   int* top_drift_blocks, int* top_path_offsets) {
+  if (isPowerOfTwo(num_timesteps)) {
+    cpuTaylorTreeTopPaths(input, buffer1, buffer2, num_timesteps, num_channels,
+                          drift_block, top_path_sums, top_drift_blocks,
+                          top_path_offsets);
+    return;
+  }
+  int num_paths = roundUpToPowerOfTwo(num_timesteps);
+  int half_length = num_paths / 2;
+
+  // The tree of all the timesteps after the current segment
+  const float* tail = nullptr;
+  int tail_rows = 0;
+
+  for (int size = 1; size < half_length; size *= 2) {
+    if ((num_timesteps & size) == 0) {
+      continue;
+    }
+    // The segment starts after all the larger segments
+    int start = num_timesteps & ~(2 * size - 1);
+    long offset = (long) start * num_channels;
+    const float* segment = partialCpuTaylorTree(input + offset, buffer1 + offset,
+                                                buffer2 + offset, size, num_channels,
+                                                drift_block, size);
+    if (tail == nullptr) {
+      tail = segment;
+      tail_rows = size;
+      continue;
+    }
+
+    // The merged tree goes where it won't overwrite the tail as we read it.
+    // The segment is at least two rows, so it's in one of the buffers.
+    float* segment_buffer = (segment == buffer1 + offset) ? buffer1 : buffer2;
+    float* other_buffer = (segment_buffer == buffer1) ? buffer2 : buffer1;
+    bool tail_in_other = (tail == other_buffer + offset + (long) size * num_channels);
+    float* target = (tail_in_other ? segment_buffer : other_buffer) + offset;
+    cpuTaylorMergeStep(segment, tail, tail_rows, target, num_channels, num_channels,
+                       2 * size, drift_block);
+    tail = target;
+    tail_rows = 2 * size;
+  }
+
+  const float* first_half = partialCpuTaylorTree(input, buffer1, buffer2, half_length,
+                                                  num_channels, drift_block,
+                                                  half_length);
+  cpuMergeTopPaths(first_half, tail, tail_rows, num_paths, num_channels, drift_block,
+                   top_path_sums, top_drift_blocks, top_path_offsets);
+}
+
+/*
+  The reduced-precision engine stores intermediate path sums in a 16-bit format,
+  but does all of its arithmetic in fp32. Rows of different formats are handled
+  through these helpers, a chunk at a time, so that the fp32 copies stay in L1.
+ */
+static const int HALF_CHUNK_SIZE = 1024;
+
+static long formatBytes(StorageFormat format) {
+  return (format == STORAGE_FP32) ? sizeof(float) : sizeof(uint16_t);
+}
+
+// Returns a pointer to n floats starting at row, converting into scratch if needed
+static const float* rowAsFloats(const void* row, StorageFormat format, float* scratch,
+                                long n) {
+  if (format == STORAGE_FP32) {
+    return (const float*) row;
+  }
+  halvesToFloats((const uint16_t*) row, scratch, n, format);
+  return scratch;
+}
+
+/*
+  Runs one round of the Taylor tree algorithm like cpuTaylorOneStep, where the
+  source and target can be stored in different formats. Each element of the
+  buffers is formatBytes(format) wide.
+ */
+static void mixedTaylorOneStep(const void* source_buffer, StorageFormat source_format,
+                               void* target_buffer, StorageFormat target_format,
+                               int num_timesteps, int num_channels, int path_length,
+                               int drift_block) {
+  long source_bytes = formatBytes(source_format);
+  long target_bytes = formatBytes(target_format);
+  float first_chunk[HALF_CHUNK_SIZE];
+  float second_chunk[HALF_CHUNK_SIZE];
+  float sum_chunk[HALF_CHUNK_SIZE];
+
+  int num_time_blocks = num_timesteps / path_length;
+  for (int time_block = 0; time_block < num_time_blocks; ++time_block) {
+    for (int path_offset = 0; path_offset < path_length; ++path_offset) {
+      // See taylorOneStepOneChannel for an explanation of these quantities
+      int half_offset = path_offset / 2;
+      int chan_shift = (path_offset + 1) / 2 + drift_block * path_length / 2;
+      int begin = max(0, -chan_shift);
+      int end = min(num_channels, num_channels - chan_shift);
+
+      const char* first = (const char*) source_buffer + source_bytes *
+        ((long) (time_block * path_length + half_offset) * num_channels);
+      const char* second = (const char*) source_buffer + source_bytes *
+        ((long) (time_block * path_length + half_offset + path_length / 2) *
+         num_channels + chan_shift);
+      char* target = (char*) target_buffer + target_bytes *
+        ((long) (time_block * path_length + path_offset) * num_channels);
+
+      for (int chunk_start = begin; chunk_start < end; chunk_start += HALF_CHUNK_SIZE) {
+        int n = min(HALF_CHUNK_SIZE, end - chunk_start);
+        const float* a = rowAsFloats(first + source_bytes * chunk_start,
+                                     source_format, first_chunk, n);
+        const float* b = rowAsFloats(second + source_bytes * chunk_start,
+                                     source_format, second_chunk, n);
+        if (target_format == STORAGE_FP32) {
+          addArrays(a, b, (float*) target + chunk_start, n);
+        } else {
+          addArrays(a, b, sum_chunk, n);
+          floatsToHalves(sum_chunk, (uint16_t*) target + chunk_start, n,
+                         target_format);
+        }
+      }
+    }
+  }
+}
+
+/*
+  The same as cpuTaylorTreeTopPaths, except that the intermediate path sums are
+  stored in buffer1 and buffer2 in a 16-bit format. Each of these buffers only needs
+  num_timesteps * num_channels 16-bit values, half the usual size.
+
+  Every sum is still calculated in fp32, and the final path sums are never
+  rounded to 16 bits. The loss of precision comes from rounding the partial sums
+  of each round, so it grows with the number of rounds. fp16 keeps more mantissa
+  bits than bf16, but can overflow above 65504.
+ */
+void halfTaylorTreeTopPaths(const float* input, uint16_t* buffer1, uint16_t* buffer2,
+                            int num_timesteps, int num_channels, int drift_block,
+                            StorageFormat format, float* top_path_sums,
+                            int* top_drift_blocks, int* top_path_offsets) {
+  assert(num_timesteps >= 2);
+  assert(format == STORAGE_FP16 || format == STORAGE_BF16);
+  int half_length = num_timesteps / 2;
+
+  // The dataflow is input -> buffer1 -> buffer2 -> buffer1 -> ...
+  // as in tiledCpuTaylorRounds, but stopping at half-length paths.
+  const void* halves = input;
+  StorageFormat halves_format = STORAGE_FP32;
+  uint16_t* target = buffer1;
+  int path_length = 2;
+  if (half_length >= 2) {
+    int tile_height, tile_width;
+    cpuTileShape(num_timesteps, &tile_height, &tile_width);
+    tile_height = min(tile_height, half_length);
+    cpuTaylorTiles(input, buffer1, format, num_timesteps, num_channels, drift_block,
+                   tile_height, tile_width);
+    halves = buffer1;
+    halves_format = format;
+    target = buffer2;
+    path_length = tile_height * 2;
+  }
+  for (; path_length <= half_length; path_length *= 2) {
+    mixedTaylorOneStep(halves, halves_format, target, format, num_timesteps,
+                       num_channels, path_length, drift_block);
+    halves = target;
+    halves_format = format;
+    target = (target == buffer1) ? buffer2 : buffer1;
+  }
+
+  // The last round is fused with the top path search, as in cpuTaylorTreeTopPaths
+  long halves_bytes = formatBytes(halves_format);
+  float first_chunk[HALF_CHUNK_SIZE];
+  float second_chunk[HALF_CHUNK_SIZE];
+  int drift_shift = (num_timesteps - 1) * drift_block;
+  int begin = max(0, -drift_shift);
+  for (int chunk_start = begin; chunk_start < num_channels;
+       chunk_start += HALF_CHUNK_SIZE) {
+    int chunk_end = min(num_channels, chunk_start + HALF_CHUNK_SIZE);
+    for (int path_offset = 0; path_offset < num_timesteps; ++path_offset) {
+      int end = min(chunk_end, num_channels - drift_shift - path_offset);
+      if (chunk_start >= end) {
+        break;
+      }
+      int half_offset = path_offset / 2;
+      int chan_shift = (path_offset + 1) / 2 + drift_block * half_length;
+      const char* first = (const char*) halves + halves_bytes *
+        ((long) half_offset * num_channels + chunk_start);
+      const char* second = (const char*) halves + halves_bytes *
+        ((long) (half_offset + half_length) * num_channels + chan_shift + chunk_start);
+      int n = end - chunk_start;
+      addArraysUpdateMax(rowAsFloats(first, halves_format, first_chunk, n),
+                         rowAsFloats(second, halves_format, second_chunk, n),
+                         top_path_sums + chunk_start, top_drift_blocks + chunk_start,
+                         top_path_offsets + chunk_start, drift_block, path_offset, n);
+    }
+  }
+}
+
+/*
+  Runs unpaddedCpuTaylorTreeTopPaths for every drift block in
+  [min_drift_block, max_drift_block], splitting the drift blocks among num_threads
+  threads. With a 16-bit format, it runs halfTaylorTreeTopPaths instead, which
+  needs num_timesteps to be a power of two.
+  buffer1 and buffer2 need cpuTaylorBufferFloats floats each.
+
+  The calling thread handles the first range of drift blocks, using buffer1, buffer2,
+  and the output arrays directly. Each other thread gets a contiguous range of
+  later drift blocks, and its own buffers and top paths from scratch, which is
+  resized as needed. Afterwards we merge the per-thread top paths into the output
+  in drift block order, only replacing a path sum with a strictly larger one. So
+  ties still go to the lowest drift block and path offset, and the output is the
+  same as running cpuTaylorTreeTopPaths on one drift block at a time.
+ */
+void parallelCpuTaylorTreeTopPaths(const float* input, float* buffer1, float* buffer2,
+                                   int num_timesteps, int num_channels,
+                                   int min_drift_block, int max_drift_block,
+                                   float* top_path_sums, int* top_drift_blocks,
+                                   int* top_path_offsets, StorageFormat format,
+                                   int num_threads, vector<TopPathScratch>* scratch) {
+  int num_drift_blocks = max_drift_block - min_drift_block + 1;
+  num_threads = max(1, min(num_threads, num_drift_blocks));
+
+  if (format != STORAGE_FP32 && !isPowerOfTwo(num_timesteps)) {
+    fatal(fmt::format("{} Taylor sums need power-of-two timesteps, not {}",
+                      storageFormatName(format), num_timesteps));
+  }
+
+  long buffer_size = cpuTaylorBufferFloats(num_timesteps, num_channels, format);
+  if ((int) scratch->size() < num_threads - 1) {
+    scratch->resize(num_threads - 1);
+  }
+  for (int i = 0; i < num_threads - 1; ++i) {
+    TopPathScratch& s = (*scratch)[i];
+    s.buffer1.resize(buffer_size);
+    s.buffer2.resize(buffer_size);
+    s.top_path_sums.assign(num_channels, 0.0);
+    s.top_drift_blocks.assign(num_channels, 0);
+    s.top_path_offsets.assign(num_channels, 0);
+  }
+
+  auto search = [&](int drift_block, float* b1, float* b2, float* sums,
+                    int* drift_blocks, int* path_offsets) {
+    if (format == STORAGE_FP32) {
+      unpaddedCpuTaylorTreeTopPaths(input, b1, b2, num_timesteps, num_channels,
+                                    drift_block, sums, drift_blocks, path_offsets);
+    } else {
+      halfTaylorTreeTopPaths(input, (uint16_t*) b1, (uint16_t*) b2, num_timesteps,
+                             num_channels, drift_block, format, sums, drift_blocks,
+                             path_offsets);
+    }
+  };
+
+  // Thread i handles drift blocks starting at first_drift_block(i)
+  auto first_drift_block = [&](int i) {
+    return min_drift_block + (int) ((long) num_drift_blocks * i / num_threads);
+  };
+
+  vector<thread> threads;
+  for (int i = 1; i < num_threads; ++i) {
+    TopPathScratch& s = (*scratch)[i - 1];
+    threads.emplace_back([&, i]() {
+      for (int drift_block = first_drift_block(i);
+           drift_block < first_drift_block(i + 1); ++drift_block) {
+        search(drift_block, s.buffer1.data(), s.buffer2.data(),
+               s.top_path_sums.data(), s.top_drift_blocks.data(),
+               s.top_path_offsets.data());
+      }
+    });
+  }
+
+  for (int drift_block = first_drift_block(0); drift_block < first_drift_block(1);
+       ++drift_block) {
+    search(drift_block, buffer1, buffer2, top_path_sums, top_drift_blocks,
+           top_path_offsets);
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (int i = 0; i < num_threads - 1; ++i) {
+    const TopPathScratch& s = (*scratch)[i];
+    for (int freq = 0; freq < num_channels; ++freq) {
+      if (s.top_path_sums[freq] > top_path_sums[freq]) {
+        top_path_sums[freq] = s.top_path_sums[freq];
+        top_drift_blocks[freq] = s.top_drift_blocks[freq];
+        top_path_offsets[freq] = s.top_path_offsets[freq];
+      }
+    }
+  }
+}
+
+/*
+  Calculates an upper bound on the Taylor path sums that start in each block of
+  block_size channels, for each drift block in [min_drift_block, max_drift_block].
+  bounds is indexed by [drift_block - min_drift_block][channel block].
+
+  In drift block d, the path starting at channel f is at some channel in
+    [f + d * t, f + d * t + t]
+  at timestep t, so it can't add up to more than the sum, over the timesteps, of
+  the largest value in that range. We use the maxima of whole blocks of each row
+  for that, so this is only a few operations per timestep per block.
+  The bound leaves room for the float rounding of the Taylor sums, assuming the
+  input is nonnegative, as power is. A block with no valid paths has a bound of
+  -infinity.
+
+  row_maxima is scratch space.
+ */
+void cpuPathSumUpperBounds(const float* input, int num_timesteps, int num_channels,
+                           int min_drift_block, int max_drift_block, int block_size,
+                           vector<float>* row_maxima, double* bounds) {
+  int num_blocks = (num_channels + block_size - 1) / block_size;
+  row_maxima->resize((long) num_timesteps * num_blocks);
+  for (int time = 0; time < num_timesteps; ++time) {
+    blockMaxima(input + (long) time * num_channels, num_channels, block_size,
+                row_maxima->data() + (long) time * num_blocks);
+  }
+
+  for (int drift_block = min_drift_block; drift_block <= max_drift_block;
+       ++drift_block) {
+    double* drift_block_bounds = bounds + (long) (drift_block - min_drift_block) *
+      num_blocks;
+    for (int block = 0; block < num_blocks; ++block) {
+      int first_chan = block * block_size;
+      int last_chan = min(num_channels, first_chan + block_size) - 1;
+      double sum = 0.0;
+      double abs_sum = 0.0;
+      bool valid = true;
+      for (int time = 0; time < num_timesteps; ++time) {
+        int low = max(0, first_chan + drift_block * time);
+        int high = min(num_channels - 1, last_chan + drift_block * time + time);
+        if (low > high) {
+          // Every path from this block leaves the data
+          valid = false;
+          break;
+        }
+        const float* maxima = row_maxima->data() + (long) time * num_blocks;
+        float row_max = maxima[low / block_size];
+        for (int i = low / block_size + 1; i <= high / block_size; ++i) {
+          row_max = max(row_max, maxima[i]);
+        }
+        sum += row_max;
+        abs_sum += fabs(row_max);
+      }
+      drift_block_bounds[block] = valid ?
+        sum + num_timesteps * FLT_EPSILON * abs_sum : -INFINITY;
+    }
+  }
+}
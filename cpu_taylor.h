@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "simd.h"
+
+using namespace std;
+
+/*
+  Host implementations of the Taylor tree algorithm.
+
+  These have the same contract as their GPU equivalents in taylor.h. All buffers
+  are regular host memory, row-major, with the
+    buffer[time_block][path_offset][start_frequency]
+  layout described in taylor.cu.
+ */
+
+void cpuTaylorMergeStep(const float* first_half, const float* second_half,
+                        int second_half_rows, float* target, int num_source_channels,
+                        int num_target_channels, int path_length, int drift_block);
+
+void cpuTaylorOneStep(const float* source_buffer, float* target_buffer,
+                      int num_timesteps, int num_source_channels,
+                      int num_target_channels, int path_length, int drift_block);
+
+const float* basicCpuTaylorTree(const float* input, float* buffer1, float* buffer2,
+                                int num_timesteps, int num_channels, int drift_block);
+
+const float* simdTaylorTree(const float* input, float* buffer1, float* buffer2,
+                            int num_timesteps, int num_channels, int drift_block);
+
+void cpuTileShape(int num_timesteps, int* tile_height, int* tile_width);
+
+// Sets whether the tiled Taylor tree uses the kernels compiled for a fixed tile
+// height, for the common heights from 8 to 256. This defaults to true, and is only
+// turned off for testing and benchmarking.
+// Threads that are already running may not see the change right away, so call
+// it before starting any worker threads.
+void setSpecializedTaylorKernels(bool enabled);
+
+const float* tiledCpuTaylorTree(const float* input, float* buffer1, float* buffer2,
+                                int num_timesteps, int num_channels, int drift_block,
+                                int tile_height, int tile_width);
+
+const float* partialCpuTaylorTree(const float* input, float* buffer1, float* buffer2,
+                                  int num_timesteps, int num_channels, int drift_block,
+                                  int max_path_length);
+
+const float* optimizedCpuTaylorTree(const float* input, float* buffer1, float* buffer2,
+                                    int num_timesteps, int num_channels, int drift_block);
+
+void cpuFindTopPathSums(const float* path_sums, int num_timesteps, int num_freqs,
+                        int drift_block, float* top_path_sums,
+                        int* top_drift_blocks, int* top_path_offsets);
+
+void cpuTaylorTreeTopPaths(const float* input, float* buffer1, float* buffer2,
+                           int num_timesteps, int num_channels, int drift_block,
+                           float* top_path_sums, int* top_drift_blocks,
+                           int* top_path_offsets);
+
+void cpuMergeTopPaths(const float* first_half, const float* second_half,
+                      int second_half_rows, int num_timesteps, int num_channels,
+                      int drift_block, float* top_path_sums, int* top_drift_blocks,
+                      int* top_path_offsets);
+
+int cpuTaylorBufferTimesteps(int num_timesteps);
+
+// How many floats each of the two Taylor buffers needs, for an input with this
+// shape. The 16-bit formats pack two sums into each float.
+long cpuTaylorBufferFloats(int num_timesteps, int num_channels, StorageFormat format);
+
+void unpaddedCpuTaylorTreeTopPaths(const float* input, float* buffer1, float* buffer2,
+                                   int num_timesteps, int num_channels,
+                                   int drift_block, float* top_path_sums,
+                                   int* top_drift_blocks, int* top_path_offsets);
+
+void halfTaylorTreeTopPaths(const float* input, uint16_t* buffer1, uint16_t* buffer2,
+                            int num_timesteps, int num_channels, int drift_block,
+                            StorageFormat format, float* top_path_sums,
+                            int* top_drift_blocks, int* top_path_offsets);
+
+/*
+  The working memory that each extra thread needs for parallelCpuTaylorTreeTopPaths.
+  This is kept around between searches, since the buffers are large.
+ */
+struct TopPathScratch {
+  vector<float> buffer1, buffer2;
+  vector<float> top_path_sums;
+  vector<int> top_drift_blocks;
+  vector<int> top_path_offsets;
+};
+
+void parallelCpuTaylorTreeTopPaths(const float* input, float* buffer1, float* buffer2,
+                                   int num_timesteps, int num_channels,
+                                   int min_drift_block, int max_drift_block,
+                                   float* top_path_sums, int* top_drift_blocks,
+                                   int* top_path_offsets, StorageFormat format,
+                                   int num_threads, vector<TopPathScratch>* scratch);
+
+void cpuPathSumUpperBounds(const float* input, int num_timesteps, int num_channels,
+                           int min_drift_block, int max_drift_block, int block_size,
+                           vector<float>* row_maxima, double* bounds);
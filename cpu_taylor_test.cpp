@@ -0,0 +1,330 @@
+#include "catch/catch.hpp"
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+#include "cpu_taylor.h"
+#include "simd.h"
+#include "taylor.h"
+#include "util.h"
+
+using namespace std;
+
+// Deterministic input where float addition order would show up in the low bits
+static vector<float> makeTaylorInput(int num_timesteps, int num_channels) {
+  vector<float> input(num_timesteps * num_channels);
+  for (int time = 0; time < num_timesteps; ++time) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      input[time * num_channels + chan] = 1.0 / (1 + (time * 7 + chan * 13) % 101);
+    }
+  }
+  return input;
+}
+
+// Checks that two Taylor outputs are bit-for-bit identical over the valid paths
+static void requireSameValidPaths(const float* expected, const float* actual,
+                                  int num_timesteps, int num_channels,
+                                  int drift_block) {
+  int mismatches = 0;
+  for (int path_offset = 0; path_offset < num_timesteps; ++path_offset) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      int last_chan = chan + (num_timesteps - 1) * drift_block + path_offset;
+      if (last_chan < 0 || last_chan >= num_channels) {
+        continue;
+      }
+      int index = path_offset * num_channels + chan;
+      if (expected[index] != actual[index]) {
+        ++mismatches;
+      }
+    }
+  }
+  REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("simd taylor outputs match basic algorithm", "[cpu_taylor]") {
+  SimdLevel original_level = simdLevel();
+  for (int level = SIMD_SCALAR; level <= detectSimdLevel(); ++level) {
+    setSimdLevel((SimdLevel) level);
+    for (int num_timesteps = 2; num_timesteps <= 256; num_timesteps *= 2) {
+      // Not a multiple of any vector width, to exercise the tails
+      int num_channels = 1003;
+      vector<float> input = makeTaylorInput(num_timesteps, num_channels);
+      vector<float> basic1(input.size()), basic2(input.size());
+      vector<float> simd1(input.size()), simd2(input.size());
+
+      for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+        const float* basic = basicCpuTaylorTree(input.data(), basic1.data(),
+                                                basic2.data(), num_timesteps,
+                                                num_channels, drift_block);
+        const float* simd = simdTaylorTree(input.data(), simd1.data(), simd2.data(),
+                                           num_timesteps, num_channels, drift_block);
+        requireSameValidPaths(basic, simd, num_timesteps, num_channels, drift_block);
+      }
+    }
+  }
+  setSimdLevel(original_level);
+}
+
+TEST_CASE("tiled cpu taylor outputs match basic algorithm", "[cpu_taylor]") {
+  for (int num_timesteps = 2; num_timesteps <= 256; num_timesteps *= 2) {
+    int num_channels = 1003;
+    vector<float> input = makeTaylorInput(num_timesteps, num_channels);
+    vector<float> basic1(input.size()), basic2(input.size());
+    vector<float> tiled1(input.size()), tiled2(input.size());
+
+    // Small tiles, so that there are many tiles in both directions, with and
+    // without the kernels specialized for the tile height
+    for (bool specialized : {true, false}) {
+      setSpecializedTaylorKernels(specialized);
+      for (int tile_height = 2; tile_height <= num_timesteps; tile_height *= 2) {
+        int tile_width = 3 * tile_height + 5;
+        for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+          const float* basic = basicCpuTaylorTree(input.data(), basic1.data(),
+                                                  basic2.data(), num_timesteps,
+                                                  num_channels, drift_block);
+          const float* tiled = tiledCpuTaylorTree(input.data(), tiled1.data(),
+                                                  tiled2.data(), num_timesteps,
+                                                  num_channels, drift_block,
+                                                  tile_height, tile_width);
+          requireSameValidPaths(basic, tiled, num_timesteps, num_channels,
+                                drift_block);
+        }
+      }
+    }
+    setSpecializedTaylorKernels(true);
+
+    for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+      const float* basic = basicCpuTaylorTree(input.data(), basic1.data(),
+                                              basic2.data(), num_timesteps,
+                                              num_channels, drift_block);
+      const float* optimized = optimizedCpuTaylorTree(input.data(), tiled1.data(),
+                                                      tiled2.data(), num_timesteps,
+                                                      num_channels, drift_block);
+      requireSameValidPaths(basic, optimized, num_timesteps, num_channels,
+                            drift_block);
+    }
+  }
+}
+
+TEST_CASE("fused cpu top paths match two-pass search", "[cpu_taylor]") {
+  SimdLevel original_level = simdLevel();
+  for (int level = SIMD_SCALAR; level <= detectSimdLevel(); ++level) {
+    setSimdLevel((SimdLevel) level);
+    for (int num_timesteps = 2; num_timesteps <= 256; num_timesteps *= 2) {
+      // Bigger than one chunk of the fused search
+      int num_channels = 5003;
+      vector<float> input = makeTaylorInput(num_timesteps, num_channels);
+      vector<float> buffer1(input.size()), buffer2(input.size());
+
+      vector<float> expected_sums(num_channels, 0.0);
+      vector<int> expected_drift_blocks(num_channels, 0);
+      vector<int> expected_path_offsets(num_channels, 0);
+      vector<float> fused_sums(num_channels, 0.0);
+      vector<int> fused_drift_blocks(num_channels, 0);
+      vector<int> fused_path_offsets(num_channels, 0);
+
+      for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+        const float* path_sums = basicCpuTaylorTree(input.data(), buffer1.data(),
+                                                    buffer2.data(), num_timesteps,
+                                                    num_channels, drift_block);
+        cpuFindTopPathSums(path_sums, num_timesteps, num_channels, drift_block,
+                           expected_sums.data(), expected_drift_blocks.data(),
+                           expected_path_offsets.data());
+
+        cpuTaylorTreeTopPaths(input.data(), buffer1.data(), buffer2.data(),
+                              num_timesteps, num_channels, drift_block,
+                              fused_sums.data(), fused_drift_blocks.data(),
+                              fused_path_offsets.data());
+      }
+
+      REQUIRE(expected_sums == fused_sums);
+      REQUIRE(expected_drift_blocks == fused_drift_blocks);
+      REQUIRE(expected_path_offsets == fused_path_offsets);
+    }
+  }
+  setSimdLevel(original_level);
+}
+
+TEST_CASE("unpadded top paths match zero-padded search", "[cpu_taylor]") {
+  for (int num_timesteps : {3, 5, 6, 7, 11, 12, 23, 100, 279}) {
+    int num_channels = 1003;
+    int num_paths = roundUpToPowerOfTwo(num_timesteps);
+    vector<float> input = makeTaylorInput(num_timesteps, num_channels);
+    vector<float> padded(input);
+    padded.resize(num_paths * num_channels, 0.0);
+    vector<float> padded1(padded.size()), padded2(padded.size());
+
+    // Stale buffer contents should never make it into a valid path
+    int buffer_size = cpuTaylorBufferTimesteps(num_timesteps) * num_channels;
+    REQUIRE(buffer_size <= (int) padded.size());
+    vector<float> buffer1(buffer_size, 1000.0), buffer2(buffer_size, 1000.0);
+
+    vector<float> expected_sums(num_channels, 0.0);
+    vector<int> expected_drift_blocks(num_channels, 0);
+    vector<int> expected_path_offsets(num_channels, 0);
+    vector<float> sums(num_channels, 0.0);
+    vector<int> drift_blocks(num_channels, 0);
+    vector<int> path_offsets(num_channels, 0);
+
+    for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+      cpuTaylorTreeTopPaths(padded.data(), padded1.data(), padded2.data(), num_paths,
+                            num_channels, drift_block, expected_sums.data(),
+                            expected_drift_blocks.data(),
+                            expected_path_offsets.data());
+      unpaddedCpuTaylorTreeTopPaths(input.data(), buffer1.data(), buffer2.data(),
+                                    num_timesteps, num_channels, drift_block,
+                                    sums.data(), drift_blocks.data(),
+                                    path_offsets.data());
+    }
+
+    REQUIRE(expected_sums == sums);
+    REQUIRE(expected_drift_blocks == drift_blocks);
+    REQUIRE(expected_path_offsets == path_offsets);
+  }
+}
+
+TEST_CASE("single path sums match the taylor tree", "[cpu_taylor]") {
+  for (int num_timesteps : {2, 3, 4, 7, 8, 12, 16, 23, 32, 64}) {
+    int num_channels = 503;
+    int num_paths = roundUpToPowerOfTwo(num_timesteps);
+    vector<float> input = makeTaylorInput(num_timesteps, num_channels);
+    vector<float> padded(input);
+    padded.resize(num_paths * num_channels, 0.0);
+    vector<float> buffer1(padded.size()), buffer2(padded.size());
+
+    for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+      const float* tree = basicCpuTaylorTree(padded.data(), buffer1.data(),
+                                             buffer2.data(), num_paths, num_channels,
+                                             drift_block);
+      int mismatches = 0;
+      for (int path_offset = 0; path_offset < num_paths; ++path_offset) {
+        for (int chan = 0; chan < num_channels; ++chan) {
+          int last_chan = chan + (num_paths - 1) * drift_block + path_offset;
+          if (last_chan < 0 || last_chan >= num_channels) {
+            continue;
+          }
+          float expected = tree[path_offset * num_channels + chan];
+          float padded_sum = taylorPathSum(padded.data(), num_paths, num_channels,
+                                           num_paths, drift_block, path_offset, chan);
+          float unpadded_sum = taylorPathSum(input.data(), num_timesteps,
+                                             num_channels, num_paths, drift_block,
+                                             path_offset, chan);
+          if (padded_sum != expected || unpadded_sum != expected) {
+            ++mismatches;
+          }
+        }
+      }
+      REQUIRE(mismatches == 0);
+    }
+  }
+}
+
+TEST_CASE("path sum bounds are above every path sum", "[cpu_taylor]") {
+  for (int num_timesteps : {4, 7, 16}) {
+    int num_channels = 1003;
+    int block_size = 64;
+    int num_blocks = (num_channels + block_size - 1) / block_size;
+    int num_paths = roundUpToPowerOfTwo(num_timesteps);
+    vector<float> input = makeTaylorInput(num_timesteps, num_channels);
+    vector<float> padded(input);
+    padded.resize(num_paths * num_channels, 0.0);
+    vector<float> buffer1(padded.size()), buffer2(padded.size());
+
+    vector<float> row_maxima;
+    vector<double> bounds(5 * num_blocks);
+    cpuPathSumUpperBounds(input.data(), num_timesteps, num_channels, -2, 2, block_size,
+                          &row_maxima, bounds.data());
+
+    for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+      const float* tree = basicCpuTaylorTree(padded.data(), buffer1.data(),
+                                             buffer2.data(), num_paths, num_channels,
+                                             drift_block);
+      int violations = 0;
+      for (int path_offset = 0; path_offset < num_paths; ++path_offset) {
+        for (int chan = 0; chan < num_channels; ++chan) {
+          int last_chan = chan + (num_paths - 1) * drift_block + path_offset;
+          if (last_chan < 0 || last_chan >= num_channels) {
+            continue;
+          }
+          double bound = bounds[(drift_block + 2) * num_blocks + chan / block_size];
+          if (tree[path_offset * num_channels + chan] > bound) {
+            ++violations;
+          }
+        }
+      }
+      REQUIRE(violations == 0);
+    }
+  }
+}
+
+TEST_CASE("parallel drift block search matches serial search", "[cpu_taylor]") {
+  int num_timesteps = 32;
+  int num_channels = 2003;
+  // Integer data, so that different paths often tie
+  vector<float> input(num_timesteps * num_channels);
+  for (int i = 0; i < (int) input.size(); ++i) {
+    input[i] = (i * 7) % 5;
+  }
+  vector<float> buffer1(input.size()), buffer2(input.size());
+
+  vector<float> serial_sums(num_channels, 0.0);
+  vector<int> serial_drift_blocks(num_channels, 0);
+  vector<int> serial_path_offsets(num_channels, 0);
+  for (int drift_block = -3; drift_block <= 3; ++drift_block) {
+    cpuTaylorTreeTopPaths(input.data(), buffer1.data(), buffer2.data(), num_timesteps,
+                          num_channels, drift_block, serial_sums.data(),
+                          serial_drift_blocks.data(), serial_path_offsets.data());
+  }
+
+  vector<TopPathScratch> scratch;
+  for (int num_threads = 1; num_threads <= 8; ++num_threads) {
+    vector<float> sums(num_channels, 0.0);
+    vector<int> drift_blocks(num_channels, 0);
+    vector<int> path_offsets(num_channels, 0);
+    parallelCpuTaylorTreeTopPaths(input.data(), buffer1.data(), buffer2.data(),
+                                  num_timesteps, num_channels, -3, 3, sums.data(),
+                                  drift_blocks.data(), path_offsets.data(),
+                                  STORAGE_FP32, num_threads, &scratch);
+    REQUIRE(sums == serial_sums);
+    REQUIRE(drift_blocks == serial_drift_blocks);
+    REQUIRE(path_offsets == serial_path_offsets);
+  }
+}
+
+TEST_CASE("half precision top paths stay close to fp32", "[cpu_taylor]") {
+  int num_timesteps = 64;
+  int num_channels = 3001;
+  vector<float> input = makeTaylorInput(num_timesteps, num_channels);
+  vector<float> buffer1(input.size()), buffer2(input.size());
+  vector<uint16_t> half1(input.size()), half2(input.size());
+
+  vector<float> expected_sums(num_channels, 0.0);
+  vector<int> expected_drift_blocks(num_channels, 0);
+  vector<int> expected_path_offsets(num_channels, 0);
+  for (int drift_block = -1; drift_block <= 1; ++drift_block) {
+    cpuTaylorTreeTopPaths(input.data(), buffer1.data(), buffer2.data(), num_timesteps,
+                          num_channels, drift_block, expected_sums.data(),
+                          expected_drift_blocks.data(), expected_path_offsets.data());
+  }
+
+  // Each of the four intermediate rounds can add one rounding error
+  for (StorageFormat format : {STORAGE_FP16, STORAGE_BF16}) {
+    double tolerance = (format == STORAGE_FP16) ? 5.0 / 2048 : 5.0 / 256;
+    vector<float> sums(num_channels, 0.0);
+    vector<int> drift_blocks(num_channels, 0);
+    vector<int> path_offsets(num_channels, 0);
+    for (int drift_block = -1; drift_block <= 1; ++drift_block) {
+      halfTaylorTreeTopPaths(input.data(), half1.data(), half2.data(), num_timesteps,
+                             num_channels, drift_block, format, sums.data(),
+                             drift_blocks.data(), path_offsets.data());
+    }
+
+    double max_error = 0.0;
+    for (int chan = 0; chan < num_channels; ++chan) {
+      double error = abs(sums[chan] - expected_sums[chan]) / expected_sums[chan];
+      max_error = max(max_error, error);
+    }
+    REQUIRE(max_error > 0.0);
+    REQUIRE(max_error < tolerance);
+  }
+}
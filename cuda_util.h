@@ -1,12 +1,23 @@
 #pragma once
 
+#ifdef SETICORE_CPU_ONLY
+// Without the CUDA toolkit, helpers written for both host and device are
+// just regular host functions.
+#define __host__
+#define __device__
+#else
 #include <cuda.h>
+#include <cuda_runtime.h>
+#endif
+
 #include <iostream>
 
 using namespace std;
 
 static_assert(sizeof(float) == 4, "require 32-bit floats");
 
+#ifndef SETICORE_CPU_ONLY
+
 const int CUDA_MAX_THREADS = 1024;
 
 // Helpers to nicely display cuda errors
@@ -21,6 +32,8 @@ public:
   ~Stream();
 };
 
+#endif
+
 // Helper to calculate a 2d row-major index, ie for:
 //   arr[a][b]
 __host__ __device__ inline long index2d(long a, long b, long b_end) {
@@ -0,0 +1,530 @@
+#include <algorithm>
+#include <assert.h>
+#include <iostream>
+#include <math.h>
+#include <vector>
+
+#include "cuda_util.h"
+#include "dedoppler.h"
+#include "simd.h"
+#include "taylor.h"
+#include "util.h"
+
+/*
+  The Dedopplerer encapsulates the logic of dedoppler search. In particular it manages
+  the needed GPU memory so that we can reuse the same memory allocation for different searches.
+  In a CPU-only build, the same memory lives on the host.
+ */
+Dedopplerer::Dedopplerer(int num_timesteps, int num_channels, double foff, double tsamp,
+                         bool has_dc_spike)
+    : num_timesteps(num_timesteps), num_channels(num_channels), foff(foff), tsamp(tsamp),
+      has_dc_spike(has_dc_spike), print_hits(false), num_threads(1),
+      storage_format(STORAGE_FP32), prune(false), max_hits(0),
+      hierarchical(false), estimate_noise(true) {
+  assert(num_timesteps > 1);
+  rounded_num_timesteps = roundUpToPowerOfTwo(num_timesteps);
+  drift_timesteps = rounded_num_timesteps - 1;
+
+  drift_rate_resolution = 1e6 * foff / (drift_timesteps * tsamp);
+
+  allocateBuffers();
+}
+
+Dedopplerer::~Dedopplerer() {
+  freeBuffers();
+}
+
+// This implementation is an ugly hack
+size_t Dedopplerer::memoryUsage() const {
+  size_t usage = num_channels * (2 * sizeof(float) + 2 * sizeof(int));
+#ifdef SETICORE_CPU_ONLY
+  // buffer1 and buffer2, and for each extra search thread, its own copies of them
+  // and of the top path arrays
+  size_t taylor_bytes = cpuTaylorBufferFloats(inputNumTimesteps(), num_channels,
+                                              storage_format) * sizeof(float);
+  usage += 2 * taylor_bytes +
+    (num_threads - 1) * (2 * taylor_bytes + num_channels * (sizeof(float) +
+                                                            2 * sizeof(int)));
+#else
+  usage += num_channels * rounded_num_timesteps * sizeof(float) * 2;
+#endif
+  if (batch_dedopplerer) {
+    usage += batch_dedopplerer->memoryUsage() + batch_input->bytes;
+  }
+  for (int i = 0; i < (int) scrunched_dedopplerers.size(); ++i) {
+    usage += scrunched_dedopplerers[i]->memoryUsage() + scrunched_inputs[i]->bytes;
+  }
+  return usage;
+}
+
+/*
+  Runs dedoppler search on the input buffer.
+  Output is appended to the output vector.
+  
+  The Taylor tree runs on the GPU, or on the CPU for a CPU-only build. Once
+  findTopPaths has gathered the top path for each frequency, we pick out the
+  hits on the host.
+*/
+void Dedopplerer::search(const FilterbankBuffer& input,
+                         const FilterbankMetadata& metadata,
+                         int beam, int coarse_channel,
+                         double max_drift, double min_drift, double snr_threshold,
+                         vector<DedopplerHit>* output) {
+  assert(input.num_timesteps == rounded_num_timesteps ||
+         input.num_timesteps == inputNumTimesteps());
+  assert(input.num_channels == num_channels);
+
+  int min_drift_block, max_drift_block;
+  driftBlockRange(drift_rate_resolution, drift_timesteps, max_drift,
+                  &min_drift_block, &max_drift_block);
+
+  if (hierarchical && (min_drift_block < -2 || max_drift_block > 1)) {
+    findTopPaths(input, max(min_drift_block, -2), min(max_drift_block, 1),
+                 snr_threshold);
+    searchScrunched(input, min_drift_block, max_drift_block, snr_threshold);
+  } else {
+    findTopPaths(input, min_drift_block, max_drift_block, snr_threshold);
+  }
+
+  findHits(metadata, beam, coarse_channel, num_timesteps, drift_rate_resolution,
+           max_drift, min_drift, snr_threshold, num_channels, noise_median,
+           noise_std_dev, cpu_top_path_sums, cpu_top_drift_blocks,
+           cpu_top_path_offsets, max_hits, print_hits, output);
+}
+
+void Dedopplerer::topPaths(TopPaths* output) const {
+  output->median = noise_median;
+  output->std_dev = noise_std_dev;
+  output->path_sums.assign(cpu_top_path_sums, cpu_top_path_sums + num_channels);
+  output->drift_blocks.assign(cpu_top_drift_blocks,
+                              cpu_top_drift_blocks + num_channels);
+  output->path_offsets.assign(cpu_top_path_offsets,
+                              cpu_top_path_offsets + num_channels);
+}
+
+// The most candidates that searchScrunched refines for each scrunched drift block
+const int MAX_SCRUNCHED_CANDIDATES = 256;
+
+// The full-resolution paths near a candidate of searchScrunched: the paths that
+// start in [start_begin, start_end) and drift from drift_begin to drift_end,
+// inclusive.
+struct RefineRegion {
+  int start_begin, start_end;
+  int drift_begin, drift_end;
+};
+
+/*
+  The hierarchical part of search. The drift blocks from -2 to 1 are searched at
+  full resolution as usual. Past that, a signal moves at least two channels per
+  timestep, so we can add together adjacent channels and still follow it.
+
+  Level k of the search scrunches 2^k adjacent channels into one, which turns
+  the full-resolution drift blocks from 2^k to 2^(k+1) - 1 into drift block 1 of
+  the scrunched input, and the drift blocks from -2^(k+1) to -2^k - 1 into
+  drift block -2. So each level only runs two drift blocks of the Taylor tree,
+  on an input half the size of the level before, and the whole search costs
+  about as much as four full-resolution drift blocks, no matter how large the
+  max drift is.
+
+  Any scrunched path whose SNR, against the noise of its own scrunched input, is
+  above the threshold is a candidate. We refine each candidate by calculating
+  the full-resolution path sums of every path in its drift blocks that starts and
+  drifts within one scrunched channel of it, with taylorPathSum, and these join
+  the top paths. The regions of nearby candidates overlap, so they are merged,
+  and each path sum is only calculated once.
+
+  Each candidate costs about 3 * 2^k * (2^(k+1) + 1) path sums, so on noisy data
+  with a low threshold the refinement could cost more than the full search did.
+  So only the strongest MAX_SCRUNCHED_CANDIDATES candidates of each scrunched
+  drift block are refined.
+
+  This makes hierarchical search a fast approximation, whose hits usually match
+  the full search. The full search may find hits that this misses, and a path
+  that this picks as the top path of a channel may lose to a path it skipped.
+
+  The cost is sensitivity. Scrunching adds up the noise of 2^k channels but
+  only the one channel of signal, so a signal's SNR in the scrunched input is
+  about 2^(-k/2) times its full-resolution SNR, and a Taylor path in the
+  scrunched input may not follow it exactly. Signals that drift 2^k to 2^(k+1)
+  channels per timestep need to be around 2^(k/2) times brighter than the
+  threshold to be found reliably. The last few channels, past a multiple of
+  2^k, are also left out of level k.
+ */
+void Dedopplerer::searchScrunched(const FilterbankBuffer& input, int min_drift_block,
+                                  int max_drift_block, double snr_threshold) {
+  int level = 0;
+  for (int scrunch = 2; max_drift_block >= scrunch || min_drift_block < -scrunch;
+       scrunch *= 2, ++level) {
+    int scrunched_channels = num_channels / scrunch;
+    if (scrunched_channels < 2) {
+      break;
+    }
+
+    if ((int) scrunched_dedopplerers.size() <= level) {
+      scrunched_dedopplerers.emplace_back(new Dedopplerer(num_timesteps,
+                                                          scrunched_channels,
+                                                          foff * scrunch, tsamp,
+                                                          false));
+      scrunched_inputs.emplace_back(new FilterbankBuffer(input.num_timesteps,
+                                                         scrunched_channels));
+    }
+    Dedopplerer& scrunched = *scrunched_dedopplerers[level];
+    scrunched.num_threads = num_threads;
+    scrunched.storage_format = storage_format;
+    if (scrunched_inputs[level]->num_timesteps != input.num_timesteps) {
+      scrunched_inputs[level].reset(new FilterbankBuffer(input.num_timesteps,
+                                                         scrunched_channels));
+    }
+    FilterbankBuffer& scrunched_input = *scrunched_inputs[level];
+
+    // findTopPaths has already synchronized the input with the host
+    for (int time = 0; time < input.num_timesteps; ++time) {
+      const float* source = input.data + (long) time * num_channels;
+      float* target = scrunched_input.data + (long) time * scrunched_channels;
+      for (int chan = 0; chan < scrunched_channels; ++chan) {
+        float sum = 0.0;
+        for (int i = 0; i < scrunch; ++i) {
+          sum += source[chan * scrunch + i];
+        }
+        target[chan] = sum;
+      }
+    }
+
+    // The full-resolution drift blocks that scrunched drift blocks 1 and -2 stand
+    // for, limited to the range we're searching
+    int ranges[2][3] = {
+      {1, scrunch, min(2 * scrunch - 1, max_drift_block)},
+      {-2, max(-2 * scrunch, min_drift_block), -scrunch - 1},
+    };
+    for (auto& range : ranges) {
+      int scrunched_drift_block = range[0];
+      int first_drift_block = range[1];
+      int last_drift_block = range[2];
+      if (first_drift_block > last_drift_block) {
+        continue;
+      }
+      scrunched.findTopPaths(scrunched_input, scrunched_drift_block,
+                             scrunched_drift_block, snr_threshold);
+      float candidate_threshold = snr_threshold * scrunched.noise_std_dev +
+        scrunched.noise_median;
+
+      // Pick the strongest candidates, and the region of paths to refine for each
+      vector<pair<float, int> > strongest;
+      for (int candidate = 0; candidate < scrunched_channels; ++candidate) {
+        float path_sum = scrunched.cpu_top_path_sums[candidate];
+        if (path_sum > candidate_threshold) {
+          strongest.push_back(make_pair(-path_sum, candidate));
+        }
+      }
+      if ((int) strongest.size() > MAX_SCRUNCHED_CANDIDATES) {
+        partial_sort(strongest.begin(), strongest.begin() + MAX_SCRUNCHED_CANDIDATES,
+                     strongest.end());
+        strongest.resize(MAX_SCRUNCHED_CANDIDATES);
+      }
+      if (strongest.empty()) {
+        continue;
+      }
+
+      vector<RefineRegion> regions;
+      for (auto& p : strongest) {
+        int candidate = p.second;
+        int scrunched_drift = scrunched_drift_block * drift_timesteps +
+          scrunched.cpu_top_path_offsets[candidate];
+        RefineRegion region;
+        region.start_begin = max(0, (candidate - 1) * scrunch);
+        region.start_end = min(num_channels, (candidate + 2) * scrunch);
+        region.drift_begin = (scrunched_drift - 1) * scrunch;
+        region.drift_end = (scrunched_drift + 1) * scrunch;
+        regions.push_back(region);
+      }
+      sort(regions.begin(), regions.end(),
+           [](const RefineRegion& a, const RefineRegion& b) {
+             return a.start_begin < b.start_begin;
+           });
+      int min_drift = regions[0].drift_begin;
+      int max_drift = regions[0].drift_end;
+      for (auto& region : regions) {
+        min_drift = min(min_drift, region.drift_begin);
+        max_drift = max(max_drift, region.drift_end);
+      }
+
+      // Go through the paths in the same order as the Taylor tree would
+      for (int drift_block = first_drift_block; drift_block <= last_drift_block;
+           ++drift_block) {
+        for (int path_offset = 0; path_offset < rounded_num_timesteps; ++path_offset) {
+          int drift = drift_block * drift_timesteps + path_offset;
+          if (drift < min_drift || drift > max_drift) {
+            continue;
+          }
+
+          // The same valid paths as cpuFindTopPathSums
+          int valid_begin = max(0, -drift_block * drift_timesteps);
+          int valid_end = num_channels - drift;
+
+          // Merge the start channels of the regions that include this drift into
+          // disjoint ranges, and refine each range
+          int range_begin = 0;
+          int range_end = 0;
+          for (int i = 0; i <= (int) regions.size(); ++i) {
+            bool done = (i == (int) regions.size());
+            if (!done && (drift < regions[i].drift_begin ||
+                          drift > regions[i].drift_end)) {
+              continue;
+            }
+            if (!done && regions[i].start_begin <= range_end) {
+              range_end = max(range_end, regions[i].start_end);
+              continue;
+            }
+
+            int begin = max(range_begin, valid_begin);
+            int end = min(range_end, valid_end);
+            for (int chan = begin; chan < end; ++chan) {
+              float path_sum = taylorPathSum(input.data, input.num_timesteps,
+                                             num_channels, rounded_num_timesteps,
+                                             drift_block, path_offset, chan);
+              if (path_sum > cpu_top_path_sums[chan]) {
+                cpu_top_path_sums[chan] = path_sum;
+                cpu_top_drift_blocks[chan] = drift_block;
+                cpu_top_path_offsets[chan] = path_offset;
+              }
+            }
+            if (!done) {
+              range_begin = regions[i].start_begin;
+              range_end = regions[i].start_end;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/*
+  Searches a batch of adjacent coarse channels at once, to save the overhead of
+  searching many small coarse channels one at a time.
+
+  The coarse channels are copied into one wide input, with a gap of -infinity
+  between each pair of them. A Taylor path moves by d or d + 1 channels each
+  timestep in drift block d, so if the gap is at least that wide, any path that
+  starts in one coarse channel and doesn't end in it must land in the gap.
+  Its sum is then -infinity, so it never becomes a top path. The paths that
+  stay inside their coarse channel add up the same values they would on their
+  own, so the top paths of each coarse channel are the same. Then we find the
+  hits in each coarse channel separately, with its own noise level, estimated
+  from just the column sums of that coarse channel. The batch never estimates
+  the noise of its whole input, which would mix in the gaps.
+
+  Pruning is not used for batches, since it would need the noise level of each
+  coarse channel.
+*/
+void Dedopplerer::searchBatch(const FilterbankBuffer& input, int num_coarse_channels,
+                              const FilterbankMetadata& metadata, int beam,
+                              int first_coarse_channel, double max_drift,
+                              double min_drift, double snr_threshold,
+                              vector<DedopplerHit>* output) {
+  assert(input.num_timesteps == rounded_num_timesteps ||
+         input.num_timesteps == inputNumTimesteps());
+  assert(input.num_channels == num_coarse_channels * num_channels);
+
+  int min_drift_block, max_drift_block;
+  driftBlockRange(drift_rate_resolution, drift_timesteps, max_drift,
+                  &min_drift_block, &max_drift_block);
+  int gap = max(max_drift_block + 1, -min_drift_block);
+  int stride = num_channels + gap;
+  int batch_channels = num_coarse_channels * stride - gap;
+
+  if (!batch_dedopplerer || batch_dedopplerer->num_channels != batch_channels) {
+    batch_dedopplerer.reset(new Dedopplerer(num_timesteps, batch_channels, foff, tsamp,
+                                            has_dc_spike));
+    batch_dedopplerer->estimate_noise = false;
+  }
+  if (!batch_input || batch_input->num_channels != batch_channels) {
+    batch_input.reset(new FilterbankBuffer(rounded_num_timesteps, batch_channels));
+  }
+  batch_dedopplerer->num_threads = num_threads;
+  batch_dedopplerer->storage_format = storage_format;
+
+#ifndef SETICORE_CPU_ONLY
+  // The input may still have GPU processing pending
+  cudaDeviceSynchronize();
+  checkCuda("searchBatch input");
+#endif
+
+  // Whether a path is valid depends on where it would be in the last row of the
+  // zero-padded input, so the batch is always padded, and the gaps go all the way
+  // down through the padding.
+  for (int time = 0; time < rounded_num_timesteps; ++time) {
+    const float* source = input.data + (long) time * input.num_channels;
+    float* target = batch_input->data + (long) time * batch_channels;
+    for (int i = 0; i < num_coarse_channels; ++i) {
+      float* segment = target + (long) i * stride;
+      if (time < input.num_timesteps) {
+        copy(source + (long) i * num_channels,
+             source + (long) (i + 1) * num_channels, segment);
+      } else {
+        fill(segment, segment + num_channels, 0.0);
+      }
+      if (i + 1 < num_coarse_channels) {
+        fill(segment + num_channels, segment + stride, -INFINITY);
+      }
+    }
+  }
+
+  batch_dedopplerer->findTopPaths(*batch_input, min_drift_block, max_drift_block,
+                                  snr_threshold);
+
+  for (int i = 0; i < num_coarse_channels; ++i) {
+    long offset = (long) i * stride;
+    float median, std_dev;
+    noise_estimator.estimate(batch_dedopplerer->cpu_column_sums + offset,
+                             num_channels, &median, &std_dev);
+    findHits(metadata, beam, first_coarse_channel + i, num_timesteps,
+             drift_rate_resolution, max_drift, min_drift, snr_threshold, num_channels,
+             median, std_dev, batch_dedopplerer->cpu_top_path_sums + offset,
+             batch_dedopplerer->cpu_top_drift_blocks + offset,
+             batch_dedopplerer->cpu_top_path_offsets + offset, max_hits, print_hits,
+             output);
+  }
+}
+
+/*
+  Figures out which drift blocks we need to search to find all drift rates up
+  to max_drift, in either direction.
+ */
+void driftBlockRange(double drift_rate_resolution, int drift_timesteps,
+                     double max_drift, int* min_drift_block, int* max_drift_block) {
+  // Normalize the max drift in units of "horizontal steps per vertical step"
+  double diagonal_drift_rate = drift_rate_resolution * drift_timesteps;
+  double normalized_max_drift = max_drift / abs(diagonal_drift_rate);
+  *min_drift_block = floor(-normalized_max_drift);
+  *max_drift_block = floor(normalized_max_drift);
+}
+
+/*
+  Picks out the hits from the top path for each frequency, the way
+  Dedopplerer::search does once it has run the Taylor tree.
+  num_timesteps is the unrounded number of timesteps. median and std_dev are the
+  noise level, from the column sums.
+  Output is appended to the output vector, in order of frequency.
+
+  If max_hits is positive, only the max_hits hits with the largest path sums are
+  output, with ties going to the lower frequency. We keep the best ones so far in
+  a heap, and once it is full, a window also has to beat the worst of them to be
+  worth checking.
+ */
+static bool betterHit(const DedopplerHit& a, const DedopplerHit& b) {
+  if (a.power != b.power) {
+    return a.power > b.power;
+  }
+  return a.index < b.index;
+}
+
+void findHits(const FilterbankMetadata& metadata, int beam, int coarse_channel,
+              int num_timesteps, double drift_rate_resolution, double max_drift,
+              double min_drift, double snr_threshold, int num_channels,
+              float median, float std_dev, const float* top_path_sums,
+              const int* top_drift_blocks, const int* top_path_offsets,
+              int max_hits, bool print_hits, vector<DedopplerHit>* output) {
+  int drift_timesteps = roundUpToPowerOfTwo(num_timesteps) - 1;
+  double diagonal_drift_rate = drift_rate_resolution * drift_timesteps;
+  double normalized_max_drift = max_drift / abs(diagonal_drift_rate);
+
+  // We consider two hits to be duplicates if the distance in their
+  // frequency indexes is less than window_size. We only want to
+  // output the largest representative of any set of duplicates.
+  // window_size is chosen just large enough so that a single bright
+  // pixel cannot cause multiple hits.
+  // First we break up the data into a set of nonoverlapping
+  // windows. Any candidate hit must be the largest within this
+  // window.
+  float path_sum_threshold = snr_threshold * std_dev + median;
+  int window_size = 2 * ceil(normalized_max_drift * drift_timesteps);
+  assert(window_size > 0);
+  int num_windows = (num_channels + window_size - 1) / window_size;
+
+  // Most windows have nothing above the threshold, so we check the maximum of
+  // each window before looking at individual frequencies
+  vector<float> window_maxima(num_windows);
+  blockMaxima(top_path_sums, num_channels, window_size, window_maxima.data());
+
+  // With max_hits, the best hits so far, with the worst at the top of the heap
+  bool bounded = max_hits > 0;
+  vector<DedopplerHit> heap;
+
+  for (int i = 0; i < num_windows; ++i) {
+    if (!(window_maxima[i] > path_sum_threshold)) {
+      continue;
+    }
+    if (bounded && (int) heap.size() == max_hits &&
+        !(window_maxima[i] > heap.front().power)) {
+      // Windows come in order of frequency, so a tie can't beat the worst hit
+      continue;
+    }
+
+    // The candidate is the first frequency with the largest path sum
+    int candidate_freq = i * window_size;
+    while (top_path_sums[candidate_freq] != window_maxima[i]) {
+      ++candidate_freq;
+    }
+    float candidate_path_sum = top_path_sums[candidate_freq];
+
+    // Check every frequency closer than window_size if we have a candidate.
+    // Nothing in this window is larger, and the neighboring windows only need
+    // checking if their maximum is larger.
+    int window_end = min(num_channels, candidate_freq + window_size);
+    bool found_larger_path_sum = false;
+    if (i > 0 && window_maxima[i - 1] > candidate_path_sum) {
+      for (int freq = max(0, candidate_freq - window_size + 1); freq < i * window_size;
+           ++freq) {
+        if (top_path_sums[freq] > candidate_path_sum) {
+          found_larger_path_sum = true;
+          break;
+        }
+      }
+    }
+    if (!found_larger_path_sum && i + 1 < num_windows &&
+        window_maxima[i + 1] > candidate_path_sum) {
+      for (int freq = (i + 1) * window_size; freq < window_end; ++freq) {
+        if (top_path_sums[freq] > candidate_path_sum) {
+          found_larger_path_sum = true;
+          break;
+        }
+      }
+    }
+    if (!found_larger_path_sum) {
+      // The candidate frequency is the best within its window
+      int drift_bins = top_drift_blocks[candidate_freq] * drift_timesteps +
+        top_path_offsets[candidate_freq];
+      double drift_rate = drift_bins * drift_rate_resolution;
+      float snr = (candidate_path_sum - median) / std_dev;
+
+      if (abs(drift_rate) >= min_drift) {
+        DedopplerHit hit(metadata, candidate_freq, drift_bins, drift_rate,
+                         snr, beam, coarse_channel, num_timesteps, candidate_path_sum);
+        if (!bounded) {
+          if (print_hits) {
+            cout << "hit: " << hit.toString() << endl;
+          }
+          output->push_back(hit);
+        } else if ((int) heap.size() < max_hits) {
+          heap.push_back(hit);
+          push_heap(heap.begin(), heap.end(), &betterHit);
+        } else if (betterHit(hit, heap.front())) {
+          pop_heap(heap.begin(), heap.end(), &betterHit);
+          heap.back() = hit;
+          push_heap(heap.begin(), heap.end(), &betterHit);
+        }
+      }
+    }
+  }
+
+  sort(heap.begin(), heap.end(), [](const DedopplerHit& a, const DedopplerHit& b) {
+    return a.index < b.index;
+  });
+  for (const DedopplerHit& hit : heap) {
+    if (print_hits) {
+      cout << "hit: " << hit.toString() << endl;
+    }
+    output->push_back(hit);
+  }
+}
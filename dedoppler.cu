@@ -1,10 +1,8 @@
 #include <algorithm>
 #include <assert.h>
 #include <cuda.h>
-#include <functional>
 #include <iostream>
 #include <math.h>
-#include <numeric>
 #include <vector>
 
 #include "cuda_util.h"
@@ -12,49 +10,6 @@
 #include "taylor.h"
 #include "util.h"
 
-/*
-  Gather information about the top hits.
-
-  The eventual goal is for every frequency freq, we want:
-
-  top_path_sums[freq] to contain the largest path sum that starts at freq
-  top_drift_blocks[freq] to contain the drift block of that path
-  top_path_offsets[freq] to contain the path offset of that path
-
-  path_sums[path_offset][freq] contains one path sum.
-  (In row-major order.)
-  So we are just taking the max along a column and carrying some
-  metadata along as we find it. One thread per freq.
-
-  The function ignores data corresponding to invalid paths. See
-  comments in taylor.cu for details.
-*/
-__global__ void findTopPathSums(const float* path_sums, int num_timesteps, int num_freqs,
-                                int drift_block, float* top_path_sums,
-                                int* top_drift_blocks, int* top_path_offsets) {
-  int freq = blockIdx.x * blockDim.x + threadIdx.x;
-  if (freq < 0 || freq >= num_freqs) {
-    return;
-  }
-
-  for (int path_offset = 0; path_offset < num_timesteps; ++path_offset) {
-    // Check if the last frequency in this path is out of bounds
-    int last_freq = (num_timesteps - 1) * drift_block + path_offset + freq;
-    if (last_freq < 0 || last_freq >= num_freqs) {
-      // No more of these paths can be valid, either
-      return;
-    }
-
-    float path_sum = path_sums[num_freqs * path_offset + freq];
-    if (path_sum > top_path_sums[freq]) {
-      top_path_sums[freq] = path_sum;
-      top_drift_blocks[freq] = drift_block;
-      top_path_offsets[freq] = path_offset;
-    }
-  }
-}
-
-
 /*
   Sum the columns of a two-dimensional array.
   input is a (num_timesteps x num_freqs) array, stored in row-major order.
@@ -71,23 +26,29 @@ __global__ void sumColumns(const float* input, float* sums, int num_timesteps, i
   }
 }
 
-
 /*
-  The Dedopplerer encapsulates the logic of dedoppler search. In particular it manages
-  the needed GPU memory so that we can reuse the same memory allocation for different searches.
+  Calculates the incoherent power for each hit, one thread per hit, with
+  taylorPathSum.
+  hit_paths has three ints for each hit: its drift block, path offset, and
+  start channel.
  */
-Dedopplerer::Dedopplerer(int num_timesteps, int num_channels, double foff, double tsamp,
-                         bool has_dc_spike)
-    : num_timesteps(num_timesteps), num_channels(num_channels), foff(foff), tsamp(tsamp),
-      has_dc_spike(has_dc_spike), print_hits(false) {
-  assert(num_timesteps > 1);
-  rounded_num_timesteps = roundUpToPowerOfTwo(num_timesteps);
-  drift_timesteps = rounded_num_timesteps - 1;
-
-  drift_rate_resolution = 1e6 * foff / (drift_timesteps * tsamp);
-    
-  // Allocate everything we need for GPU processing 
+__global__ void incoherentPowerKernel(const float* input, int num_timesteps,
+                                      int num_channels, const int* hit_paths,
+                                      int num_hits, float* powers) {
+  int hit = blockIdx.x * blockDim.x + threadIdx.x;
+  if (hit >= num_hits) {
+    return;
+  }
+  powers[hit] = taylorPathSum(input, num_timesteps, num_channels, num_timesteps,
+                              hit_paths[3 * hit], hit_paths[3 * hit + 1],
+                              hit_paths[3 * hit + 2]);
+}
 
+/*
+  Allocates the GPU memory the Dedopplerer uses, so that we can reuse the same
+  memory allocation for different searches.
+ */
+void Dedopplerer::allocateBuffers() {
   cudaMalloc(&buffer1, num_channels * rounded_num_timesteps * sizeof(float));
   checkCuda("Dedopplerer buffer1 malloc");
 
@@ -111,7 +72,7 @@ Dedopplerer::Dedopplerer(int num_timesteps, int num_channels, double foff, doubl
   checkCuda("Dedopplerer top_path_offsets malloc");
 }
 
-Dedopplerer::~Dedopplerer() {
+void Dedopplerer::freeBuffers() {
   cudaFree(buffer1);
   cudaFree(buffer2);
   cudaFree(gpu_column_sums);
@@ -124,10 +85,9 @@ Dedopplerer::~Dedopplerer() {
   cudaFreeHost(cpu_top_path_offsets);
 }
 
-// This implementation is an ugly hack
-size_t Dedopplerer::memoryUsage() const {
-  return num_channels * rounded_num_timesteps * sizeof(float) * 2
-    + num_channels * (2 * sizeof(float) + 2 * sizeof(int));
+// The GPU Taylor tree only handles power-of-two timesteps
+int Dedopplerer::inputNumTimesteps() const {
+  return rounded_num_timesteps;
 }
 
 /*
@@ -136,6 +96,10 @@ size_t Dedopplerer::memoryUsage() const {
 
   Input should be the incoherent sum.
   This function re-sorts hits by drift, so be aware that it will change order.
+
+  Each hit only needs one path sum, so rather than running the whole Taylor
+  tree for its drift block, a kernel adds up just the paths of the hits. The
+  hits go to the GPU in one copy and their powers come back in one copy.
  */
 void Dedopplerer::addIncoherentPower(const FilterbankBuffer& input,
                                      vector<DedopplerHit>& hits) {
@@ -143,61 +107,62 @@ void Dedopplerer::addIncoherentPower(const FilterbankBuffer& input,
   assert(input.num_channels == num_channels);
 
   sort(hits.begin(), hits.end(), &driftStepsLessThan);
+  if (hits.empty()) {
+    return;
+  }
   
   int drift_shift = rounded_num_timesteps - 1;
-  
-  // The drift block we are currently analyzing
-  int current_drift_block = INT_MIN;
-
-  // A pointer for the currently-analyzed drift block
-  const float* taylor_sums = nullptr;
 
-  for (DedopplerHit& hit : hits) {
+  int num_hits = hits.size();
+  vector<int> hit_paths(3 * num_hits);
+  for (int i = 0; i < num_hits; ++i) {
     // Figure out what drift block this hit belongs to
-    int drift_block = (int) floor((float) hit.drift_steps / drift_shift);
-    int path_offset = hit.drift_steps - drift_block * drift_shift;
+    int drift_block = (int) floor((float) hits[i].drift_steps / drift_shift);
+    int path_offset = hits[i].drift_steps - drift_block * drift_shift;
     assert(0 <= path_offset && path_offset < drift_shift);
 
-    // We should not go backwards
-    assert(drift_block >= current_drift_block);
-
-    if (drift_block > current_drift_block) {
-      // We need to analyze a new drift block
-      taylor_sums = optimizedTaylorTree(input.data, buffer1, buffer2,
-                                        rounded_num_timesteps, num_channels,
-                                        drift_block);
-      current_drift_block = drift_block;
-    }
+    hit_paths[3 * i] = drift_block;
+    hit_paths[3 * i + 1] = path_offset;
+    hit_paths[3 * i + 2] = hits[i].index;
+  }
 
-    long power_index = index2d(path_offset, hit.index, num_channels);
-    assert(taylor_sums != nullptr);
-    cudaMemcpy(&hit.incoherent_power, taylor_sums + power_index,
-               sizeof(float), cudaMemcpyDeviceToHost);
+  int* gpu_hit_paths;
+  float* gpu_powers;
+  cudaMalloc(&gpu_hit_paths, hit_paths.size() * sizeof(int));
+  cudaMalloc(&gpu_powers, num_hits * sizeof(float));
+  checkCuda("addIncoherentPower malloc");
+
+  cudaMemcpy(gpu_hit_paths, hit_paths.data(), hit_paths.size() * sizeof(int),
+             cudaMemcpyHostToDevice);
+  int grid_size = (num_hits + CUDA_MAX_THREADS - 1) / CUDA_MAX_THREADS;
+  incoherentPowerKernel<<<grid_size, CUDA_MAX_THREADS>>>(input.data,
+                                                          rounded_num_timesteps,
+                                                          num_channels, gpu_hit_paths,
+                                                          num_hits, gpu_powers);
+  checkCuda("incoherentPowerKernel");
+
+  vector<float> powers(num_hits);
+  cudaMemcpy(powers.data(), gpu_powers, num_hits * sizeof(float),
+             cudaMemcpyDeviceToHost);
+  checkCuda("addIncoherentPower d->h memcpy");
+  for (int i = 0; i < num_hits; ++i) {
+    hits[i].incoherent_power = powers[i];
   }
+
+  cudaFree(gpu_hit_paths);
+  cudaFree(gpu_powers);
 }
 
 /*
-  Runs dedoppler search on the input buffer.
-  Output is appended to the output vector.
-  
-  All processing of the input buffer happens on the GPU, so it doesn't need to
-  start off with host and device synchronized when search is called, it can still
-  have GPU processing pending.
-*/
-void Dedopplerer::search(const FilterbankBuffer& input,
-                         const FilterbankMetadata& metadata,
-                         int beam, int coarse_channel,
-                         double max_drift, double min_drift, double snr_threshold,
-                         vector<DedopplerHit>* output) {
-  assert(input.num_timesteps == rounded_num_timesteps);
-  assert(input.num_channels == num_channels);
-
-  // Normalize the max drift in units of "horizontal steps per vertical step"
-  double diagonal_drift_rate = drift_rate_resolution * drift_timesteps;
-  double normalized_max_drift = max_drift / abs(diagonal_drift_rate);
-  int min_drift_block = floor(-normalized_max_drift);
-  int max_drift_block = floor(normalized_max_drift);
+  Runs the Taylor tree on the GPU for each drift block, and copies the
+  column sums and top paths back to the host.
+  The GPU doesn't prune, so it doesn't need the snr_threshold.
 
+  This doesn't need the input to start off with host and device synchronized,
+  it can still have GPU processing pending.
+*/
+void Dedopplerer::findTopPaths(const FilterbankBuffer& input, int min_drift_block,
+                               int max_drift_block, double snr_threshold) {
   // This will create one cuda thread per frequency bin
   int grid_size = (num_channels + CUDA_MAX_THREADS - 1) / CUDA_MAX_THREADS;
 
@@ -209,22 +174,12 @@ void Dedopplerer::search(const FilterbankBuffer& input,
                                               rounded_num_timesteps, num_channels);
   checkCuda("sumColumns");
   
-  int mid = num_channels / 2;
-
   // Do the Taylor tree algorithm for each drift block
   for (int drift_block = min_drift_block; drift_block <= max_drift_block; ++drift_block) {
-    // Calculate Taylor sums
-    const float* taylor_sums = optimizedTaylorTree(input.data, buffer1, buffer2,
-                                                   rounded_num_timesteps, num_channels,
-                                                   drift_block);
-
-    // Track the best sums
-    findTopPathSums<<<grid_size, CUDA_MAX_THREADS>>>(taylor_sums, rounded_num_timesteps,
-                                                     num_channels, drift_block,
-                                                     gpu_top_path_sums,
-                                                     gpu_top_drift_blocks,
-                                                     gpu_top_path_offsets);
-    checkCuda("findTopPathSums");
+    // Calculate Taylor sums and track the best ones in a single pass
+    taylorTreeTopPaths(input.data, buffer1, buffer2, rounded_num_timesteps,
+                       num_channels, drift_block, gpu_top_path_sums,
+                       gpu_top_drift_blocks, gpu_top_path_offsets);
   }
 
   // Now that we have done all the GPU processing for one coarse
@@ -239,83 +194,9 @@ void Dedopplerer::search(const FilterbankBuffer& input,
   cudaMemcpy(cpu_top_path_offsets, gpu_top_path_offsets,
              num_channels * sizeof(int), cudaMemcpyDeviceToHost);
   checkCuda("dedoppler d->h memcpy");
-  
-  // Use the central 90% of the column sums to calculate standard deviation.
-  // We don't need to do a full sort; we can just calculate the 5th,
-  // 50th, and 95th percentiles
-  auto column_sums_end = cpu_column_sums + num_channels;
-  std::nth_element(cpu_column_sums, cpu_column_sums + mid, column_sums_end);
-  int first = ceil(0.05 * num_channels);
-  int last = floor(0.95 * num_channels);
-  std::nth_element(cpu_column_sums, cpu_column_sums + first,
-                   cpu_column_sums + mid - 1);
-  std::nth_element(cpu_column_sums + mid + 1, cpu_column_sums + last,
-                   column_sums_end);
-  float median = cpu_column_sums[mid];
-    
-  float sum = std::accumulate(cpu_column_sums + first, cpu_column_sums + last + 1, 0.0);
-  float m = sum / (last + 1 - first);
-  float accum = 0.0;
-  std::for_each(cpu_column_sums + first, cpu_column_sums + last + 1,
-                [&](const float f) {
-                  accum += (f - m) * (f - m);
-                });
-  float std_dev = sqrt(accum / (last + 1 - first));
-
-    
-  // We consider two hits to be duplicates if the distance in their
-  // frequency indexes is less than window_size. We only want to
-  // output the largest representative of any set of duplicates.
-  // window_size is chosen just large enough so that a single bright
-  // pixel cannot cause multiple hits.
-  // First we break up the data into a set of nonoverlapping
-  // windows. Any candidate hit must be the largest within this
-  // window.
-  float path_sum_threshold = snr_threshold * std_dev + median;
-  int window_size = 2 * ceil(normalized_max_drift * drift_timesteps);
-  for (int i = 0; i * window_size < num_channels; ++i) {
-    int candidate_freq = -1;
-    float candidate_path_sum = path_sum_threshold;
-
-    for (int j = 0; j < window_size; ++j) {
-      int freq = i * window_size + j;
-      if (freq >= num_channels) {
-        break;
-      }
-      if (cpu_top_path_sums[freq] > candidate_path_sum) {
-        // This is the new best candidate of the window
-        candidate_freq = freq;
-        candidate_path_sum = cpu_top_path_sums[freq];
-      }
-    }
-    if (candidate_freq < 0) {
-      continue;
-    }
-
-    // Check every frequency closer than window_size if we have a candidate
-    int window_end = min(num_channels, candidate_freq + window_size);
-    bool found_larger_path_sum = false;
-    for (int freq = max(0, candidate_freq - window_size + 1); freq < window_end; ++freq) {
-      if (cpu_top_path_sums[freq] > candidate_path_sum) {
-        found_larger_path_sum = true;
-        break;
-      }
-    }
-    if (!found_larger_path_sum) {
-      // The candidate frequency is the best within its window
-      int drift_bins = cpu_top_drift_blocks[candidate_freq] * drift_timesteps +
-        cpu_top_path_offsets[candidate_freq];
-      double drift_rate = drift_bins * drift_rate_resolution;
-      float snr = (candidate_path_sum - median) / std_dev;
 
-      if (abs(drift_rate) >= min_drift) {
-        DedopplerHit hit(metadata, candidate_freq, drift_bins, drift_rate,
-                         snr, beam, coarse_channel, num_timesteps, candidate_path_sum);
-        if (print_hits) {
-          cout << "hit: " << hit.toString() << endl;
-        }
-        output->push_back(hit);
-      }
-    }
+  if (estimate_noise) {
+    noise_estimator.estimate(cpu_column_sums, num_channels, &noise_median,
+                             &noise_std_dev);
   }
 }
@@ -1,16 +1,29 @@
 #pragma once
 
-#include <cuda.h>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "cpu_taylor.h"
 #include "dedoppler_hit.h"
 #include "filterbank_buffer.h"
 #include "filterbank_metadata.h"
 #include "hit_recorder.h"
+#include "noise_estimator.h"
+#include "top_path_file.h"
 
 using namespace std;
 
+/*
+  How much of the search pruning was able to skip. A region is one drift block
+  over one block of frequencies.
+ */
+struct PruningStats {
+  long coarse_channels = 0;
+  long skipped_coarse_channels = 0;
+  long regions = 0;
+  long skipped_regions = 0;
+};
 
 class Dedopplerer {
 public:
@@ -31,12 +44,47 @@ public:
   const bool has_dc_spike;
 
   bool print_hits;
+
+  // How many threads a CPU-only build uses to search the drift blocks of one
+  // input. Each thread past the first needs its own Taylor buffers, so this
+  // multiplies memory usage. The GPU backend ignores this.
+  int num_threads;
+
+  // How a CPU-only build stores the intermediate Taylor sums. The 16-bit formats
+  // use less memory bandwidth but lose some precision. The GPU backend ignores this.
+  StorageFormat storage_format;
+
+  // Whether a CPU-only build skips the Taylor tree wherever an upper bound on the
+  // path sums shows they can't reach the SNR threshold. This doesn't change the
+  // hits. It only applies with fp32 storage, and the GPU backend ignores it.
+  bool prune;
+
+  // What pruning has skipped so far, over all searches
+  PruningStats pruning_stats;
+
+  // If positive, each search only reports this many hits for each coarse
+  // channel, the ones with the largest path sums. This bounds the output no
+  // matter how noisy the data is.
+  int max_hits;
+
+  // Whether to search the drift blocks past -2 and 1 on copies of the input with
+  // adjacent channels added together, and then only check the paths near what
+  // those find at full resolution. This is much faster for large max drifts, but
+  // less sensitive to fast-drifting signals. See searchScrunched.
+  bool hierarchical;
   
   // Do not round num_timesteps before creating the Dedopplerer
   Dedopplerer(int num_timesteps, int num_channels, double foff, double tsamp,
               bool has_dc_spike);
   ~Dedopplerer();
 
+  // How many timesteps the input to search should have. The GPU needs the input
+  // zero-padded up to a power of two, but a CPU-only build can search the
+  // num_timesteps rows directly, unless it uses a 16-bit storage_format.
+  // Either way, search also accepts padded input.
+  int inputNumTimesteps() const;
+
+  // On the GPU, the input to this must be padded to a power of two
   void addIncoherentPower(const FilterbankBuffer& input, vector<DedopplerHit>& hits);
   
   void search(const FilterbankBuffer& input, const FilterbankMetadata& metadata,
@@ -44,12 +92,27 @@ public:
               double max_drift, double min_drift, double snr_threshold,
               vector<DedopplerHit>* output);
 
+  // Searches num_coarse_channels adjacent coarse channels with one Taylor tree.
+  // The input has num_coarse_channels * num_channels columns, and the same rows
+  // that search takes. The hits are the same as searching each coarse channel on
+  // its own, numbered from first_coarse_channel.
+  void searchBatch(const FilterbankBuffer& input, int num_coarse_channels,
+                   const FilterbankMetadata& metadata, int beam,
+                   int first_coarse_channel, double max_drift, double min_drift,
+                   double snr_threshold, vector<DedopplerHit>* output);
+
+  // Copies out the top paths and the noise level that the most recent call to
+  // search found, before they were thresholded. findHits can turn them into the
+  // same hits that search reported.
+  void topPaths(TopPaths* output) const;
+
   size_t memoryUsage() const;
   
 private:
-  // For computing Taylor sums, we use three on-gpu arrays,
-  // each the size of one coarse channel. The input array is to read the source
-  // data, and these two buffers are to use for Taylor tree calculations.
+  // For computing Taylor sums, we use three arrays, each the size of one
+  // coarse channel, on the GPU or on the host for a CPU-only build.
+  // The input array is to read the source data, and these two buffers are
+  // to use for Taylor tree calculations.
   float *buffer1, *buffer2;
 
   // The size of the larger array that contains the number of timesteps,
@@ -57,20 +120,95 @@ private:
   int rounded_num_timesteps;
   
   // For normalization, we sum each column.
-  float *gpu_column_sums, *cpu_column_sums;
+  float *cpu_column_sums;
 
   // For aggregating top hits, we use three arrays, each the size of
   // one row of the coarse channel. One array to store the largest
   // path sum, one to store which drift block it came from, and one to
   // store its path offset.
-  float *gpu_top_path_sums, *cpu_top_path_sums;
-  int *gpu_top_drift_blocks, *cpu_top_drift_blocks;
-  int *gpu_top_path_offsets, *cpu_top_path_offsets;
+  float *cpu_top_path_sums;
+  int *cpu_top_drift_blocks;
+  int *cpu_top_path_offsets;
+
+#ifndef SETICORE_CPU_ONLY
+  // The GPU copies of the arrays above
+  float *gpu_column_sums;
+  float *gpu_top_path_sums;
+  int *gpu_top_drift_blocks;
+  int *gpu_top_path_offsets;
+#else
+  // How many floats buffer1 and buffer2 have room for. They are sized by the
+  // first search, for its input and storage_format, and grow if a later search
+  // needs more.
+  long buffer_floats;
+  void reserveBuffers(long num_floats);
+
+  // Scratch space for pruning
+  vector<float> row_maxima;
+  vector<double> path_sum_bounds;
+  vector<float> region_input;
+  TopPathScratch region_top_paths;
+  void prunedTopPaths(const FilterbankBuffer& input, int min_drift_block,
+                      int max_drift_block, float path_sum_threshold);
+#endif
+
+  // Buffers for the extra threads of a multithreaded CPU search
+  vector<TopPathScratch> cpu_scratch;
+
+  NoiseEstimator noise_estimator;
 
   // How many timesteps the signal drifts in our data
   int drift_timesteps;
 
+  // The noise level of the most recent input, from its column sums
+  float noise_median, noise_std_dev;
+
+  // Whether findTopPaths estimates the noise of the whole input. A batch
+  // Dedopplerer doesn't, since its input has gaps of -infinity between the
+  // coarse channels, and searchBatch estimates each coarse channel's noise from
+  // just its own columns.
+  bool estimate_noise;
+
+  // For searchBatch, a Dedopplerer wide enough for a whole batch of coarse
+  // channels, and its input. They are created on first use, and recreated
+  // when the shape of the batch changes.
+  unique_ptr<Dedopplerer> batch_dedopplerer;
+  unique_ptr<FilterbankBuffer> batch_input;
+
+  // For hierarchical search, a Dedopplerer and an input for each level of
+  // scrunching, created on first use
+  vector<unique_ptr<Dedopplerer>> scrunched_dedopplerers;
+  vector<unique_ptr<FilterbankBuffer>> scrunched_inputs;
+
+  // Adds the top paths of the drift blocks past -2 and 1, up to the given range,
+  // to the cpu_ arrays, using the scrunched inputs
+  void searchScrunched(const FilterbankBuffer& input, int min_drift_block,
+                       int max_drift_block, double snr_threshold);
+
   // The difference in adjacent drift rates that we look for, in Hz/s
   double drift_rate_resolution;  
+
+  // The parts that depend on the backend are implemented in dedoppler.cu for
+  // the GPU, and in cpu_dedoppler.cpp for a CPU-only build.
+  void allocateBuffers();
+  void freeBuffers();
+
+  // Sums the columns of the input, estimates the noise from them, and runs the
+  // Taylor tree for drift blocks in [min_drift_block, max_drift_block] to find
+  // the top path for each frequency.
+  // The results end up in the cpu_ arrays, and the noise_ members if
+  // estimate_noise is set.
+  // The snr_threshold is only needed for pruning.
+  void findTopPaths(const FilterbankBuffer& input, int min_drift_block,
+                    int max_drift_block, double snr_threshold);
 };
 
+void driftBlockRange(double drift_rate_resolution, int drift_timesteps,
+                     double max_drift, int* min_drift_block, int* max_drift_block);
+
+void findHits(const FilterbankMetadata& metadata, int beam, int coarse_channel,
+              int num_timesteps, double drift_rate_resolution, double max_drift,
+              double min_drift, double snr_threshold, int num_channels,
+              float median, float std_dev, const float* top_path_sums,
+              const int* top_drift_blocks, const int* top_path_offsets,
+              int max_hits, bool print_hits, vector<DedopplerHit>* output);
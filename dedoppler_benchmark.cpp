@@ -0,0 +1,309 @@
+#include <assert.h>
+#include <fmt/core.h>
+#include <iostream>
+#include <random>
+#include <string.h>
+#include <vector>
+
+#include "cpu_taylor.h"
+#include "dedoppler.h"
+#include "filterbank_buffer.h"
+#include "filterbank_metadata.h"
+#include "simd.h"
+#include "streaming_dedoppler.h"
+#include "taylor.h"
+#include "util.h"
+
+/*
+  Performance testing the search for the top path at each frequency.
+  This compares running the whole Taylor tree and then scanning its output,
+  against the fused search that never writes out the final path sums.
+  Then it compares padded and unpadded searches of an odd number of timesteps,
+  and searching a sliding window from scratch against the StreamingDedopplerer.
+  Then it compares finding the incoherent power of hits by running the Taylor tree
+  for their drift blocks, against adding up each hit's path directly.
+  Then it searches short noisy inputs with and without pruning, and with large max
+  drifts, in full and hierarchically.
+  Finally it searches many small coarse channels one at a time, and in one batch.
+ */
+int main(int argc, char* argv[]) {
+  const int num_timesteps = 256;
+  int num_channels = 1 << 20;
+  FilterbankBuffer input(makeNoisyBuffer(num_timesteps, num_channels));
+
+  FilterbankBuffer buffer1(num_timesteps, num_channels);
+  FilterbankBuffer buffer2(num_timesteps, num_channels);
+
+  vector<float> top_path_sums(num_channels);
+  vector<int> top_drift_blocks(num_channels);
+  vector<int> top_path_offsets(num_channels);
+
+#ifndef SETICORE_CPU_ONLY
+  float* gpu_top_path_sums;
+  int *gpu_top_drift_blocks, *gpu_top_path_offsets;
+  cudaMalloc(&gpu_top_path_sums, num_channels * sizeof(float));
+  cudaMalloc(&gpu_top_drift_blocks, num_channels * sizeof(int));
+  cudaMalloc(&gpu_top_path_offsets, num_channels * sizeof(int));
+  checkCuda("dedoppler_benchmark malloc");
+#endif
+
+  cout << "cpu simd level: " << simdLevelName(simdLevel()) << endl;
+
+  for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+    cout << "\ndrift block " << drift_block << endl;
+
+#ifndef SETICORE_CPU_ONLY
+    cudaMemset(gpu_top_path_sums, 0, num_channels * sizeof(float));
+    cudaDeviceSynchronize();
+    long start = timeInMS();
+    const float* path_sums = optimizedTaylorTree(input.data, buffer1.data,
+                                                 buffer2.data, num_timesteps,
+                                                 num_channels, drift_block);
+    findTopPathSums(path_sums, num_timesteps, num_channels, drift_block,
+                    gpu_top_path_sums, gpu_top_drift_blocks, gpu_top_path_offsets);
+    cudaDeviceSynchronize();
+    long end = timeInMS();
+    cout << fmt::format("gpu two-pass search: elapsed time {:.3f}s\n",
+                        (end - start) / 1000.0);
+
+    cudaMemset(gpu_top_path_sums, 0, num_channels * sizeof(float));
+    cudaDeviceSynchronize();
+    start = timeInMS();
+    taylorTreeTopPaths(input.data, buffer1.data, buffer2.data, num_timesteps,
+                       num_channels, drift_block, gpu_top_path_sums,
+                       gpu_top_drift_blocks, gpu_top_path_offsets);
+    cudaDeviceSynchronize();
+    end = timeInMS();
+    cout << fmt::format("gpu fused search: elapsed time {:.3f}s\n",
+                        (end - start) / 1000.0);
+#endif
+
+    memset(top_path_sums.data(), 0, num_channels * sizeof(float));
+    long cpu_start = timeInMS();
+    const float* cpu_path_sums = optimizedCpuTaylorTree(input.data, buffer1.data,
+                                                        buffer2.data, num_timesteps,
+                                                        num_channels, drift_block);
+    cpuFindTopPathSums(cpu_path_sums, num_timesteps, num_channels, drift_block,
+                       top_path_sums.data(), top_drift_blocks.data(),
+                       top_path_offsets.data());
+    long cpu_end = timeInMS();
+    cout << fmt::format("cpu two-pass search: elapsed time {:.3f}s\n",
+                        (cpu_end - cpu_start) / 1000.0);
+
+    memset(top_path_sums.data(), 0, num_channels * sizeof(float));
+    cpu_start = timeInMS();
+    cpuTaylorTreeTopPaths(input.data, buffer1.data, buffer2.data, num_timesteps,
+                          num_channels, drift_block, top_path_sums.data(),
+                          top_drift_blocks.data(), top_path_offsets.data());
+    cpu_end = timeInMS();
+    cout << fmt::format("cpu fused search: elapsed time {:.3f}s\n",
+                        (cpu_end - cpu_start) / 1000.0);
+
+    for (StorageFormat format : {STORAGE_FP16, STORAGE_BF16}) {
+      memset(top_path_sums.data(), 0, num_channels * sizeof(float));
+      cpu_start = timeInMS();
+      halfTaylorTreeTopPaths(input.data, (uint16_t*) buffer1.data,
+                             (uint16_t*) buffer2.data, num_timesteps, num_channels,
+                             drift_block, format, top_path_sums.data(),
+                             top_drift_blocks.data(), top_path_offsets.data());
+      cpu_end = timeInMS();
+      cout << fmt::format("cpu {} search: elapsed time {:.3f}s\n",
+                          storageFormatName(format), (cpu_end - cpu_start) / 1000.0);
+    }
+  }
+
+  // An odd-length observation, searched with and without zero padding.
+  // This reuses the buffers above with fewer channels, so they're big enough.
+  const int odd_timesteps = 279;
+  const int odd_channels = num_channels / 4;
+  int padded_timesteps = roundUpToPowerOfTwo(odd_timesteps);
+  memset(input.data + (long) odd_timesteps * odd_channels, 0,
+         (long) (padded_timesteps - odd_timesteps) * odd_channels * sizeof(float));
+  cout << endl;
+  memset(top_path_sums.data(), 0, num_channels * sizeof(float));
+  long odd_start = timeInMS();
+  for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+    cpuTaylorTreeTopPaths(input.data, buffer1.data, buffer2.data, padded_timesteps,
+                          odd_channels, drift_block, top_path_sums.data(),
+                          top_drift_blocks.data(), top_path_offsets.data());
+  }
+  long odd_end = timeInMS();
+  cout << fmt::format("cpu search of {} timesteps padded to {}: elapsed time {:.3f}s\n",
+                      odd_timesteps, padded_timesteps, (odd_end - odd_start) / 1000.0);
+
+  memset(top_path_sums.data(), 0, num_channels * sizeof(float));
+  odd_start = timeInMS();
+  for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+    unpaddedCpuTaylorTreeTopPaths(input.data, buffer1.data, buffer2.data,
+                                  odd_timesteps, odd_channels, drift_block,
+                                  top_path_sums.data(), top_drift_blocks.data(),
+                                  top_path_offsets.data());
+  }
+  odd_end = timeInMS();
+  cout << fmt::format("cpu search of {} timesteps unpadded, with {}-timestep buffers: "
+                      "elapsed time {:.3f}s\n", odd_timesteps,
+                      cpuTaylorBufferTimesteps(odd_timesteps),
+                      (odd_end - odd_start) / 1000.0);
+
+  // Treat the input as a stream of spectra, searching a window every hop spectra
+  const int window_size = 16;
+  const int hop = 4;
+  FilterbankMetadata metadata;
+  vector<DedopplerHit> hits;
+  Dedopplerer dedopplerer(window_size, num_channels, 1e-6, 1.0, false);
+  cout << endl;
+  long window_start = timeInMS();
+  int num_windows = 0;
+  for (int start = 0; start + window_size <= num_timesteps; start += hop) {
+    FilterbankBuffer window(window_size, num_channels,
+                            input.data + (long) start * num_channels);
+    dedopplerer.search(window, metadata, NO_BEAM, 0, 1.5, 0.0, 10.0, &hits);
+    ++num_windows;
+  }
+  long window_end = timeInMS();
+  cout << fmt::format("search each of {} windows: elapsed time {:.3f}s\n",
+                      num_windows, (window_end - window_start) / 1000.0);
+
+  StreamingDedopplerer streamer(window_size, hop, num_channels, 1e-6, 1.0, 1.5);
+  vector<StreamingWindowHits> streamed;
+  window_start = timeInMS();
+  num_windows = streamer.addSpectra(input.data, num_timesteps, metadata, NO_BEAM, 0,
+                                    0.0, 10.0, &streamed);
+  window_end = timeInMS();
+  cout << fmt::format("streaming search of {} windows: elapsed time {:.3f}s\n",
+                      num_windows, (window_end - window_start) / 1000.0);
+
+  // Incoherent power of a few thousand hits spread over the drift blocks.
+  // The input is in host memory, so this only runs the CPU version.
+#ifdef SETICORE_CPU_ONLY
+  int drift_shift = num_timesteps - 1;
+  vector<DedopplerHit> incoherent_hits;
+  for (int i = 0; i < 5000; ++i) {
+    int drift_steps = (i % 4 * drift_shift) - 2 * drift_shift + (i * 37) % drift_shift;
+    int index = 2 * drift_shift + (int) ((i * 7919L) % (num_channels - 4 * drift_shift));
+    incoherent_hits.push_back(DedopplerHit(metadata, index, drift_steps, 0.0, 10.0,
+                                           NO_BEAM, 0, num_timesteps, 0.0));
+  }
+  cout << endl;
+  long power_start = timeInMS();
+  for (int drift_block = -2; drift_block <= 1; ++drift_block) {
+    const float* path_sums = optimizedCpuTaylorTree(input.data, buffer1.data,
+                                                    buffer2.data, num_timesteps,
+                                                    num_channels, drift_block);
+    for (DedopplerHit& hit : incoherent_hits) {
+      if (hit.drift_steps >= drift_block * drift_shift &&
+          hit.drift_steps < (drift_block + 1) * drift_shift) {
+        int path_offset = hit.drift_steps - drift_block * drift_shift;
+        hit.incoherent_power = path_sums[(long) path_offset * num_channels + hit.index];
+      }
+    }
+  }
+  long power_end = timeInMS();
+  cout << fmt::format("incoherent power of {} hits from full trees: "
+                      "elapsed time {:.3f}s\n", incoherent_hits.size(),
+                      (power_end - power_start) / 1000.0);
+
+  vector<DedopplerHit> direct_hits(incoherent_hits);
+  Dedopplerer full_dedopplerer(num_timesteps, num_channels, 1e-6, 1.0, false);
+  power_start = timeInMS();
+  full_dedopplerer.addIncoherentPower(input, direct_hits);
+  power_end = timeInMS();
+  cout << fmt::format("incoherent power of {} hits from path sums: "
+                      "elapsed time {:.3f}s\n", direct_hits.size(),
+                      (power_end - power_start) / 1000.0);
+#endif
+
+  // Uniform noise with a few drifting signals, searched with and without pruning.
+  // This reuses the start of the input buffer.
+  const int noisy_timesteps = 16;
+  mt19937 rng(1);
+  uniform_real_distribution<float> noise(0.0, 1.0);
+  FilterbankBuffer noisy(noisy_timesteps, num_channels, input.data);
+  for (long i = 0; i < (long) noisy_timesteps * num_channels; ++i) {
+    noisy.data[i] = noise(rng);
+  }
+  for (int chan = 1000; chan < num_channels; chan += 100000) {
+    for (int time = 0; time < noisy_timesteps; ++time) {
+      noisy.set(time, chan + time / 2, 3.0);
+    }
+  }
+  cout << endl;
+  for (bool prune : {false, true}) {
+    Dedopplerer noisy_dedopplerer(noisy_timesteps, num_channels, 1e-6, 1.0, false);
+    noisy_dedopplerer.prune = prune;
+    vector<DedopplerHit> noisy_hits;
+    long noisy_start = timeInMS();
+    noisy_dedopplerer.search(noisy, metadata, NO_BEAM, 0, 1.0, 0.0, 10.0, &noisy_hits);
+    long noisy_end = timeInMS();
+    const PruningStats& stats = noisy_dedopplerer.pruning_stats;
+    cout << fmt::format("{} search of {} timesteps: {} hits, skipped {} of {} "
+                        "regions, elapsed time {:.3f}s\n",
+                        prune ? "pruned" : "unpruned", noisy_timesteps,
+                        noisy_hits.size(), stats.skipped_regions, stats.regions,
+                        (noisy_end - noisy_start) / 1000.0);
+  }
+
+  // The noisy input with a large max drift, searched in full and hierarchically.
+  // A drift block is 1 Hz/s here.
+  cout << endl;
+  for (double max_drift : {4.0, 16.0, 64.0}) {
+    for (bool hierarchical : {false, true}) {
+      Dedopplerer drift_dedopplerer(noisy_timesteps, num_channels, 1e-6, 1.0, false);
+      drift_dedopplerer.hierarchical = hierarchical;
+      vector<DedopplerHit> drift_hits;
+      long drift_start = timeInMS();
+      drift_dedopplerer.search(noisy, metadata, NO_BEAM, 0, max_drift, 0.0, 10.0,
+                               &drift_hits);
+      long drift_end = timeInMS();
+      cout << fmt::format("{} search to {:.0f} Hz/s: {} hits, elapsed time {:.3f}s\n",
+                          hierarchical ? "hierarchical" : "full", max_drift,
+                          drift_hits.size(), (drift_end - drift_start) / 1000.0);
+    }
+  }
+
+  // The noisy input again, split into small coarse channels
+  const int small_channels = 1024;
+  const int num_small = num_channels / small_channels;
+  FilterbankBuffer small_inputs(num_small * noisy_timesteps, small_channels);
+  for (int i = 0; i < num_small; ++i) {
+    for (int time = 0; time < noisy_timesteps; ++time) {
+      memcpy(small_inputs.data + ((long) i * noisy_timesteps + time) * small_channels,
+             noisy.data + (long) time * num_channels + (long) i * small_channels,
+             small_channels * sizeof(float));
+    }
+  }
+  Dedopplerer small_dedopplerer(noisy_timesteps, small_channels, 1e-6, 1.0, false);
+  vector<DedopplerHit> small_hits;
+  cout << endl;
+  long small_start = timeInMS();
+  for (int i = 0; i < num_small; ++i) {
+    FilterbankBuffer small_input(noisy_timesteps, small_channels,
+                                 small_inputs.data +
+                                 (long) i * noisy_timesteps * small_channels);
+    small_dedopplerer.search(small_input, metadata, NO_BEAM, i, 1.0, 0.0, 10.0,
+                             &small_hits);
+  }
+  long small_end = timeInMS();
+  cout << fmt::format("search each of {} coarse channels of {} channels: {} hits, "
+                      "elapsed time {:.3f}s\n", num_small, small_channels,
+                      small_hits.size(), (small_end - small_start) / 1000.0);
+
+  // Run once first, to leave out the setup of the batch buffers
+  vector<DedopplerHit> batch_hits;
+  small_dedopplerer.searchBatch(noisy, num_small, metadata, NO_BEAM, 0, 1.0, 0.0,
+                                10.0, &batch_hits);
+  batch_hits.clear();
+  small_start = timeInMS();
+  small_dedopplerer.searchBatch(noisy, num_small, metadata, NO_BEAM, 0, 1.0, 0.0,
+                                10.0, &batch_hits);
+  small_end = timeInMS();
+  cout << fmt::format("batched search of {} coarse channels: {} hits, "
+                      "elapsed time {:.3f}s\n", num_small, batch_hits.size(),
+                      (small_end - small_start) / 1000.0);
+
+#ifndef SETICORE_CPU_ONLY
+  cudaFree(gpu_top_path_sums);
+  cudaFree(gpu_top_drift_blocks);
+  cudaFree(gpu_top_path_offsets);
+#endif
+}
@@ -1,10 +1,16 @@
 #include "catch/catch.hpp"
+#include <algorithm>
 #include <iostream>
+#include <math.h>
+#include <random>
 #include <vector>
 
+#include "cpu_taylor.h"
 #include "dedoppler.h"
 #include "filterbank_buffer.h"
 #include "filterbank_metadata.h"
+#include "streaming_dedoppler.h"
+#include "util.h"
 
 TEST_CASE("basic functionality", "[dedoppler]") {
   int num_timesteps = 8;
@@ -32,3 +38,441 @@ TEST_CASE("basic functionality", "[dedoppler]") {
   REQUIRE(hits[0].coarse_channel == 555);
 }
 
+TEST_CASE("memory usage counts the buffers of every search thread", "[dedoppler]") {
+  Dedopplerer dedopplerer(16, 1 << 16, 1.0, 1.0, false);
+  size_t one_thread = dedopplerer.memoryUsage();
+  dedopplerer.num_threads = 4;
+  size_t four_threads = dedopplerer.memoryUsage();
+  // Each thread has two buffers of 16 timesteps of sums
+  size_t taylor_bytes = 2 * 16 * (1 << 16) * sizeof(float);
+  REQUIRE(one_thread > taylor_bytes);
+#ifdef SETICORE_CPU_ONLY
+  // The GPU backend only ever uses one set of buffers
+  REQUIRE(four_threads > 4 * taylor_bytes);
+#else
+  REQUIRE(four_threads == one_thread);
+#endif
+}
+
+TEST_CASE("16-bit storage finds the same hit", "[dedoppler]") {
+  int num_timesteps = 8;
+  int num_channels = 1000;
+  FilterbankBuffer buffer(makeNoisyBuffer(num_timesteps, num_channels));
+  FilterbankMetadata metadata = FilterbankMetadata();
+  for (int time = 0; time < num_timesteps; ++time) {
+    buffer.set(time, 70 + time / 2, 1.0);
+  }
+
+  for (StorageFormat format : {STORAGE_FP16, STORAGE_BF16}) {
+    Dedopplerer dedopplerer(num_timesteps, num_channels, 1.0, 1.0, false);
+    dedopplerer.storage_format = format;
+    vector<DedopplerHit> hits;
+    dedopplerer.search(buffer, metadata, NO_BEAM, 555, 0.01, 0.01, 200.0, &hits);
+    REQUIRE(hits.size() == 1);
+    REQUIRE(hits[0].index == 70);
+    REQUIRE(hits[0].drift_steps == 3);
+  }
+}
+
+
+TEST_CASE("unpadded input matches zero-padded input", "[dedoppler]") {
+  int num_timesteps = 12;
+  int num_channels = 1000;
+  FilterbankMetadata metadata = FilterbankMetadata();
+  Dedopplerer dedopplerer(num_timesteps, num_channels, 1e-6, 1.0, false);
+
+  FilterbankBuffer padded(roundUpToPowerOfTwo(num_timesteps), num_channels);
+  padded.zero();
+  FilterbankBuffer input(dedopplerer.inputNumTimesteps(), num_channels);
+  input.zero();
+  for (int time = 0; time < num_timesteps; ++time) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      float value = (time * 7 + chan * 13) % 11;
+      if (chan == 300 + time / 3) {
+        value += 40;
+      }
+      padded.set(time, chan, value);
+      input.set(time, chan, value);
+    }
+  }
+
+  vector<DedopplerHit> expected, hits;
+  dedopplerer.search(padded, metadata, NO_BEAM, 0, 1.0, 0.0, 10.0, &expected);
+  dedopplerer.search(input, metadata, NO_BEAM, 0, 1.0, 0.0, 10.0, &hits);
+  REQUIRE(expected.size() >= 1);
+  REQUIRE(hits.size() == expected.size());
+  for (int i = 0; i < (int) expected.size(); ++i) {
+    REQUIRE(hits[i].index == expected[i].index);
+    REQUIRE(hits[i].drift_steps == expected[i].drift_steps);
+    REQUIRE(hits[i].power == expected[i].power);
+    REQUIRE(hits[i].snr == expected[i].snr);
+  }
+}
+
+// The hit selection that findHits used to do, one window at a time
+static vector<int> scanForHits(const vector<float>& top_path_sums, int window_size,
+                               float path_sum_threshold) {
+  int num_channels = top_path_sums.size();
+  vector<int> answer;
+  for (int i = 0; i * window_size < num_channels; ++i) {
+    int candidate_freq = -1;
+    float candidate_path_sum = path_sum_threshold;
+    for (int j = 0; j < window_size; ++j) {
+      int freq = i * window_size + j;
+      if (freq >= num_channels) {
+        break;
+      }
+      if (top_path_sums[freq] > candidate_path_sum) {
+        candidate_freq = freq;
+        candidate_path_sum = top_path_sums[freq];
+      }
+    }
+    if (candidate_freq < 0) {
+      continue;
+    }
+    int window_end = min(num_channels, candidate_freq + window_size);
+    bool found_larger_path_sum = false;
+    for (int freq = max(0, candidate_freq - window_size + 1); freq < window_end; ++freq) {
+      if (top_path_sums[freq] > candidate_path_sum) {
+        found_larger_path_sum = true;
+        break;
+      }
+    }
+    if (!found_larger_path_sum) {
+      answer.push_back(candidate_freq);
+    }
+  }
+  return answer;
+}
+
+TEST_CASE("hit selection matches a window-by-window scan", "[dedoppler]") {
+  int num_timesteps = 16;
+  int num_channels = 100003;
+  double drift_rate_resolution = 0.1;
+  double max_drift = 0.5;
+  int drift_timesteps = num_timesteps - 1;
+  double normalized_max_drift = max_drift / (drift_rate_resolution * drift_timesteps);
+  int window_size = 2 * ceil(normalized_max_drift * drift_timesteps);
+
+  // Coarse values, so there are lots of ties, and a noise level of about 1
+  mt19937 rng(7);
+  normal_distribution<float> noise(0.0, 1.0);
+  vector<float> column_sums(num_channels);
+  vector<float> top_path_sums(num_channels);
+  for (int i = 0; i < num_channels; ++i) {
+    column_sums[i] = noise(rng);
+    top_path_sums[i] = round(4 * noise(rng)) / 4;
+    if (i % 997 < 3) {
+      top_path_sums[i] += 10.0;
+    }
+  }
+  vector<int> top_drift_blocks(num_channels, 0);
+  vector<int> top_path_offsets(num_channels, 3);
+
+  FilterbankMetadata metadata = FilterbankMetadata();
+  NoiseEstimator noise_estimator;
+  float median, std_dev;
+  noise_estimator.estimate(column_sums.data(), num_channels, &median, &std_dev);
+
+  for (double snr_threshold : {-100.0, 1.0, 2.0, 5.0}) {
+    vector<DedopplerHit> hits;
+    findHits(metadata, NO_BEAM, 0, num_timesteps, drift_rate_resolution, max_drift,
+             0.0, snr_threshold, num_channels, median, std_dev, top_path_sums.data(),
+             top_drift_blocks.data(), top_path_offsets.data(), 0, false, &hits);
+
+    vector<int> expected = scanForHits(top_path_sums, window_size,
+                                       snr_threshold * std_dev + median);
+    REQUIRE(hits.size() == expected.size());
+    for (int i = 0; i < (int) hits.size(); ++i) {
+      REQUIRE(hits[i].index == expected[i]);
+      REQUIRE(hits[i].power == top_path_sums[expected[i]]);
+    }
+
+    // With a limit, we should get the strongest of the same hits, in the same
+    // order. The ties make sure they go to the lower frequency.
+    for (int max_hits : {1, 7, 50, 100000}) {
+      vector<int> strongest(expected);
+      stable_sort(strongest.begin(), strongest.end(), [&](int a, int b) {
+        return top_path_sums[a] > top_path_sums[b];
+      });
+      strongest.resize(min((int) strongest.size(), max_hits));
+      sort(strongest.begin(), strongest.end());
+
+      vector<DedopplerHit> bounded_hits;
+      findHits(metadata, NO_BEAM, 0, num_timesteps, drift_rate_resolution, max_drift,
+               0.0, snr_threshold, num_channels, median, std_dev, top_path_sums.data(),
+               top_drift_blocks.data(), top_path_offsets.data(), max_hits, false,
+               &bounded_hits);
+      REQUIRE(bounded_hits.size() == strongest.size());
+      for (int i = 0; i < (int) bounded_hits.size(); ++i) {
+        REQUIRE(bounded_hits[i].index == strongest[i]);
+      }
+    }
+  }
+}
+
+TEST_CASE("pruned search finds the same hits", "[dedoppler]") {
+  int num_timesteps = 12;
+  int num_channels = 40000;
+  FilterbankMetadata metadata = FilterbankMetadata();
+  Dedopplerer dedopplerer(num_timesteps, num_channels, 1e-6, 1.0, false);
+  Dedopplerer pruned(num_timesteps, num_channels, 1e-6, 1.0, false);
+  pruned.prune = true;
+
+  // Uniform noise, with drifting signals at a few strengths, only some of them
+  // bright enough to be hits
+  mt19937 rng(3);
+  uniform_real_distribution<float> noise(0.0, 1.0);
+  FilterbankBuffer input(dedopplerer.inputNumTimesteps(), num_channels);
+  for (int time = 0; time < num_timesteps; ++time) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      input.set(time, chan, noise(rng));
+    }
+  }
+  for (int i = 0; i < 4; ++i) {
+    int start = 2000 + 10000 * i;
+    for (int time = 0; time < num_timesteps; ++time) {
+      int chan = start + (i - 2) * time / 3;
+      input.set(time, chan, input.get(time, chan) + 0.5 * i);
+    }
+  }
+
+  for (double max_drift : {0.2, 1.0}) {
+    vector<DedopplerHit> expected, hits;
+    dedopplerer.search(input, metadata, NO_BEAM, 0, max_drift, 0.0, 10.0, &expected);
+    pruned.search(input, metadata, NO_BEAM, 0, max_drift, 0.0, 10.0, &hits);
+    REQUIRE(expected.size() >= 1);
+    REQUIRE(hits.size() == expected.size());
+    for (int i = 0; i < (int) expected.size(); ++i) {
+      REQUIRE(hits[i].index == expected[i].index);
+      REQUIRE(hits[i].drift_steps == expected[i].drift_steps);
+      REQUIRE(hits[i].power == expected[i].power);
+      REQUIRE(hits[i].snr == expected[i].snr);
+    }
+  }
+
+#ifdef SETICORE_CPU_ONLY
+  REQUIRE(pruned.pruning_stats.coarse_channels == 2);
+  REQUIRE(pruned.pruning_stats.skipped_regions > 0);
+  REQUIRE(pruned.pruning_stats.skipped_regions < pruned.pruning_stats.regions);
+#endif
+}
+
+TEST_CASE("batched search matches searching each coarse channel", "[dedoppler]") {
+  int num_timesteps = 12;
+  int num_channels = 2000;
+  int num_coarse_channels = 5;
+  FilterbankMetadata metadata = FilterbankMetadata();
+  Dedopplerer dedopplerer(num_timesteps, num_channels, 1e-6, 1.0, false);
+  int input_timesteps = dedopplerer.inputNumTimesteps();
+
+  // A different noise level in each coarse channel, and drifting signals, some of
+  // which would cross into the neighboring coarse channel
+  mt19937 rng(4);
+  uniform_real_distribution<float> noise(0.0, 1.0);
+  int batch_channels = num_coarse_channels * num_channels;
+  FilterbankBuffer input(input_timesteps, batch_channels);
+  input.zero();
+  for (int time = 0; time < num_timesteps; ++time) {
+    for (int chan = 0; chan < batch_channels; ++chan) {
+      input.set(time, chan, (1 + chan / num_channels) * noise(rng));
+    }
+  }
+  for (int i = 0; i < num_coarse_channels; ++i) {
+    for (int start : {i * num_channels + 5, (i + 1) * num_channels - 5,
+                      i * num_channels + 1000}) {
+      for (int time = 0; time < num_timesteps; ++time) {
+        int chan = start + (start % 2 ? 1 : -1) * time;
+        if (0 <= chan && chan < batch_channels) {
+          input.set(time, chan, input.get(time, chan) + 3.0 * (1 + i));
+        }
+      }
+    }
+  }
+
+  for (double max_drift : {0.5, 3.0}) {
+    vector<DedopplerHit> expected;
+    FilterbankBuffer coarse_channel(input_timesteps, num_channels);
+    for (int i = 0; i < num_coarse_channels; ++i) {
+      for (int time = 0; time < input_timesteps; ++time) {
+        for (int chan = 0; chan < num_channels; ++chan) {
+          coarse_channel.set(time, chan, input.get(time, i * num_channels + chan));
+        }
+      }
+      dedopplerer.search(coarse_channel, metadata, NO_BEAM, 10 + i, max_drift, 0.0,
+                         5.0, &expected);
+    }
+
+    vector<DedopplerHit> hits;
+    dedopplerer.searchBatch(input, num_coarse_channels, metadata, NO_BEAM, 10,
+                            max_drift, 0.0, 5.0, &hits);
+    REQUIRE(expected.size() >= (size_t) num_coarse_channels);
+    REQUIRE(hits.size() == expected.size());
+    for (int i = 0; i < (int) expected.size(); ++i) {
+      REQUIRE(hits[i].coarse_channel == expected[i].coarse_channel);
+      REQUIRE(hits[i].index == expected[i].index);
+      REQUIRE(hits[i].drift_steps == expected[i].drift_steps);
+      REQUIRE(hits[i].power == expected[i].power);
+      REQUIRE(hits[i].snr == expected[i].snr);
+    }
+  }
+}
+
+TEST_CASE("hierarchical search finds bright fast-drifting signals", "[dedoppler]") {
+  int num_timesteps = 16;
+  int num_channels = 1 << 16;
+  FilterbankMetadata metadata = FilterbankMetadata();
+  Dedopplerer dedopplerer(num_timesteps, num_channels, 1e-6, 1.0, false);
+  Dedopplerer hierarchical(num_timesteps, num_channels, 1e-6, 1.0, false);
+  hierarchical.hierarchical = true;
+
+  // Bright signals drifting at a range of rates, some slow enough for the
+  // full-resolution part of the search, and the rest at several levels
+  mt19937 rng(5);
+  uniform_real_distribution<float> noise(0.0, 1.0);
+  FilterbankBuffer input(dedopplerer.inputNumTimesteps(), num_channels);
+  for (int time = 0; time < num_timesteps; ++time) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      input.set(time, chan, noise(rng));
+    }
+  }
+  vector<double> drifts = {0.3, -1.6, 3.4, -7.2, 12.6, -17.5};
+  for (int i = 0; i < (int) drifts.size(); ++i) {
+    int start = 5000 + 10000 * i;
+    for (int time = 0; time < num_timesteps; ++time) {
+      int chan = start + (int) round(drifts[i] * time);
+      input.set(time, chan, input.get(time, chan) + 5.0);
+    }
+  }
+
+  // The drift rate resolution is 1/15 Hz/s, so this is 20 channels per timestep
+  double max_drift = 20.0;
+  vector<DedopplerHit> expected, hits;
+  dedopplerer.search(input, metadata, NO_BEAM, 0, max_drift, 0.0, 10.0, &expected);
+  hierarchical.search(input, metadata, NO_BEAM, 0, max_drift, 0.0, 10.0, &hits);
+  REQUIRE(expected.size() == drifts.size());
+  REQUIRE(hits.size() == expected.size());
+  for (int i = 0; i < (int) expected.size(); ++i) {
+    REQUIRE(hits[i].index == expected[i].index);
+    REQUIRE(hits[i].drift_steps == expected[i].drift_steps);
+    REQUIRE(hits[i].power == expected[i].power);
+    REQUIRE(hits[i].snr == expected[i].snr);
+  }
+}
+
+TEST_CASE("incoherent power matches the taylor tree", "[dedoppler]") {
+  int num_timesteps = 12;
+  int num_channels = 1000;
+  int num_paths = roundUpToPowerOfTwo(num_timesteps);
+  FilterbankBuffer padded(makeNoisyBuffer(num_paths, num_channels));
+  for (int time = num_timesteps; time < num_paths; ++time) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      padded.set(time, chan, 0.0);
+    }
+  }
+  FilterbankMetadata metadata = FilterbankMetadata();
+  Dedopplerer dedopplerer(num_timesteps, num_channels, 1e-6, 1.0, false);
+
+  // Hits at a spread of drifts, in no particular order
+  vector<DedopplerHit> hits;
+  for (int drift_steps : {20, -3, 0, 7, -30, 14, 3, -16, 29}) {
+    int index = 400 + 11 * drift_steps;
+    hits.push_back(DedopplerHit(metadata, index, drift_steps, drift_steps * 0.1,
+                                10.0, NO_BEAM, 0, num_timesteps, 100.0));
+  }
+  dedopplerer.addIncoherentPower(padded, hits);
+
+  vector<float> buffer1(num_paths * num_channels), buffer2(num_paths * num_channels);
+  int drift_shift = num_paths - 1;
+  for (int i = 0; i < (int) hits.size(); ++i) {
+    if (i > 0) {
+      REQUIRE(hits[i - 1].drift_steps <= hits[i].drift_steps);
+    }
+    int drift_block = (int) floor((float) hits[i].drift_steps / drift_shift);
+    int path_offset = hits[i].drift_steps - drift_block * drift_shift;
+    const float* tree = basicCpuTaylorTree(padded.data, buffer1.data(),
+                                           buffer2.data(), num_paths, num_channels,
+                                           drift_block);
+    REQUIRE(hits[i].incoherent_power == tree[path_offset * num_channels + hits[i].index]);
+  }
+}
+
+TEST_CASE("streaming search matches searching each window", "[dedoppler]") {
+  int num_timesteps = 16;
+  int num_channels = 1000;
+  int num_spectra = 64;
+  FilterbankMetadata metadata = FilterbankMetadata();
+
+  // Small integers, so that the column sums don't depend on the order of addition
+  vector<float> spectra(num_spectra * num_channels);
+  for (int time = 0; time < num_spectra; ++time) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      spectra[time * num_channels + chan] = (time * 7 + chan * 13) % 11;
+    }
+    // A line drifting right, and a steeper one drifting left
+    spectra[time * num_channels + 200 + time / 2] += 40;
+    spectra[time * num_channels + 800 - time] += 40;
+  }
+
+  for (int hop = 1; hop <= num_timesteps; hop *= 2) {
+    StreamingDedopplerer streamer(num_timesteps, hop, num_channels, 1e-6, 1.0, 1.5);
+    Dedopplerer dedopplerer(num_timesteps, num_channels, 1e-6, 1.0, false);
+    FilterbankBuffer window(num_timesteps, num_channels);
+
+    int num_windows = 0;
+    vector<vector<DedopplerHit> > windows_hits;
+    for (int time = 0; time < num_spectra; ++time) {
+      vector<DedopplerHit> streamed;
+      bool searched = streamer.addSpectrum(&spectra[time * num_channels], metadata,
+                                           NO_BEAM, 0, 0.0, 10.0, &streamed);
+      REQUIRE(searched == (time + 1 >= num_timesteps && (time + 1) % hop == 0));
+      if (!searched) {
+        continue;
+      }
+      ++num_windows;
+      long start = streamer.lastWindowStart();
+      REQUIRE(start == time + 1 - num_timesteps);
+
+      for (int row = 0; row < num_timesteps; ++row) {
+        for (int chan = 0; chan < num_channels; ++chan) {
+          window.set(row, chan, spectra[(start + row) * num_channels + chan]);
+        }
+      }
+      vector<DedopplerHit> expected;
+      dedopplerer.search(window, metadata, NO_BEAM, 0, 1.5, 0.0, 10.0, &expected);
+
+      REQUIRE(expected.size() >= 2);
+      REQUIRE(streamed.size() == expected.size());
+      for (int i = 0; i < (int) expected.size(); ++i) {
+        REQUIRE(streamed[i].index == expected[i].index);
+        REQUIRE(streamed[i].drift_steps == expected[i].drift_steps);
+        REQUIRE(streamed[i].power == expected[i].power);
+        REQUIRE(streamed[i].snr == expected[i].snr);
+      }
+      windows_hits.push_back(streamed);
+    }
+    REQUIRE(num_windows == (num_spectra - num_timesteps) / hop + 1);
+
+    // Adding the spectra all at once reports the same hits, window by window
+    StreamingDedopplerer batch_streamer(num_timesteps, hop, num_channels, 1e-6, 1.0,
+                                        1.5);
+    vector<StreamingWindowHits> windows;
+    int split = num_spectra / 3;
+    int num_batch_windows =
+      batch_streamer.addSpectra(&spectra[0], split, metadata, NO_BEAM, 0, 0.0, 10.0,
+                                &windows);
+    num_batch_windows +=
+      batch_streamer.addSpectra(&spectra[split * num_channels], num_spectra - split,
+                                metadata, NO_BEAM, 0, 0.0, 10.0, &windows);
+    REQUIRE(num_batch_windows == num_windows);
+    REQUIRE((int) windows.size() == num_windows);
+    for (int i = 0; i < num_windows; ++i) {
+      REQUIRE(windows[i].start == (long) i * hop);
+      REQUIRE(windows[i].hits.size() == windows_hits[i].size());
+      for (int j = 0; j < (int) windows[i].hits.size(); ++j) {
+        REQUIRE(windows[i].hits[j].index == windows_hits[i][j].index);
+        REQUIRE(windows[i].hits[j].drift_steps == windows_hits[i][j].drift_steps);
+      }
+    }
+  }
+}
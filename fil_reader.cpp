@@ -1,10 +1,22 @@
+#include <algorithm>
 #include <assert.h>
+#include <fcntl.h>
+#include <fmt/core.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 #include "fil_reader.h"
+#include "simd.h"
+#include "thread_util.h"
+#include "util.h"
 
 using namespace std;
 
@@ -28,12 +40,18 @@ double convertFromSigprocRaOrDec(double sigproc) {
   Opens a sigproc filterbank file for reading.
   This class is not threadsafe.
 */
-FilReader::FilReader(const string& filename) : FilterbankFileReader(filename),
-                                               file(filename, ifstream::binary) {
+FilReader::FilReader(const string& filename)
+  : FilterbankFileReader(filename), file(filename, ifstream::binary), fd(-1),
+    file_size(0), mapped(nullptr),
+    num_threads(max(1, min(8, (int) thread::hardware_concurrency()))) {
   // Read the headers
   // Note: this code will fail on big-endian systems.
   // If this is not working, you may want to compare it to the code at:
   //   https://github.com/UCBerkeleySETI/blimpy/blob/master/blimpy/io/sigproc.py
+  // These headers are optional
+  num_timesteps = 0;
+  telescope_id = NO_TELESCOPE_ID;
+  nbits = 32;
   string header_start = readString();
   if (header_start != "HEADER_START") {
     cerr << "The file " << filename << " did not start with HEADER_START. "
@@ -55,13 +73,18 @@ FilReader::FilReader(const string& filename) : FilterbankFileReader(filename),
     } else if (attr_name == "pulsarcentric") {
       readBasic<int>();
     } else if (attr_name == "nbits") {
-      int nbits = readBasic<int>();
-      // We only handle 32-bit float data
-      assert(nbits == 32);
+      nbits = readBasic<int>();
+      // 32-bit data is floats, and smaller sizes are unsigned integers
+      if (nbits != 8 && nbits != 16 && nbits != 32) {
+        fatal(fmt::format("{} has {}-bit data, but we can only read 8, 16, or 32 bits",
+                          filename, nbits));
+      }
     } else if (attr_name == "nsamples") {
       num_timesteps = readBasic<int>();
     } else if (attr_name == "nchans") {
       num_channels = readBasic<int>();
+    } else if (attr_name == "nfpc") {
+      coarse_channel_size = readBasic<int>();
     } else if (attr_name == "nifs") {
       readBasic<int>();
     } else if (attr_name == "nbeams") {
@@ -108,17 +131,17 @@ FilReader::FilReader(const string& filename) : FilterbankFileReader(filename),
   // So figure out the amount of data based on file size.
   file.seekg(0, file.end);
   long num_data_bytes = file.tellg() - data_start;
-  if (num_data_bytes % sizeof(float) != 0) {
+  if (num_data_bytes % sampleBytes() != 0) {
     cerr << "indivisible amount of data is " << num_data_bytes << " bytes\n";
     exit(1);
   }
-  long num_floats = num_data_bytes / sizeof(float);
-  if (num_floats % num_channels != 0) {
-    cerr << "we have " << num_floats << " which does not divide into " << num_channels
+  long num_samples = num_data_bytes / sampleBytes();
+  if (num_samples % num_channels != 0) {
+    cerr << "we have " << num_samples << " which does not divide into " << num_channels
          << " frequencies\n";
     exit(1);
   }
-  long inferred_num_timesteps = num_floats / num_channels;
+  long inferred_num_timesteps = num_samples / num_channels;
   if (num_timesteps == 0) {
     num_timesteps = inferred_num_timesteps;
   } else if (num_timesteps != inferred_num_timesteps) {
@@ -128,6 +151,21 @@ FilReader::FilReader(const string& filename) : FilterbankFileReader(filename),
   }
   
   inferMetadata();
+
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fatal("could not open file for reading:", filename);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fatal("could not stat", filename);
+  }
+  file_size = st.st_size;
+  void* p = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    fatal("could not mmap", filename);
+  }
+  mapped = (char*) p;
 }
 
 template <class T> T FilReader::readBasic() {
@@ -147,10 +185,117 @@ string FilReader::readString() {
   return answer;
 }
 
-// Loads the data in row-major order.
+bool FilReader::adviseCoarseChannel(int i, int advice) const {
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t slice_bytes = coarse_channel_size * sampleBytes();
+  for (int row = 0; row < num_timesteps; ++row) {
+    size_t begin = (streamoff) data_start +
+      ((size_t) row * num_channels + (size_t) i * coarse_channel_size) * sampleBytes();
+    size_t aligned = begin - begin % page_size;
+    if (madvise(mapped + aligned, begin + slice_bytes - aligned, advice) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Below this much data, copying a coarse channel isn't worth starting threads for
+const size_t MIN_BYTES_PER_THREAD = 4 << 20;
+
+/*
+  Loads the data in row-major order.
+
+  The rows of the coarse channel are copied out of the mapped file by up to
+  num_threads threads. Integer data is converted to floats as it's copied, so
+  there's no separate pass over the data. A coarse channel is a slice out of every
+  row of the file, so rather than leaving it to readahead, we madvise the kernel
+  about exactly the slices we are about to read, and afterwards about the slices of
+  the next coarse channel, since coarse channels are usually loaded in order.
+
+  If the buffer has extra space beyond that needed to load the coarse channel, we
+  zero it out. This also corrects for the DC spike, if needed.
+*/
 void FilReader::loadCoarseChannel(int i, FilterbankBuffer* buffer) const {
-  cerr << "TODO: implement FilReader::loadCoarseChannel\n";
-  exit(1);
+  assert(0 <= i && i < num_coarse_channels);
+  assert(num_timesteps <= buffer->num_timesteps);
+  assert(coarse_channel_size == buffer->num_channels);
+
+  // Map in all the rows at once, rather than faulting them in a page at a time.
+  // Kernels before 5.14 can only be told to start reading them.
+#ifdef MADV_POPULATE_READ
+  if (!adviseCoarseChannel(i, MADV_POPULATE_READ)) {
+    adviseCoarseChannel(i, MADV_WILLNEED);
+  }
+#else
+  adviseCoarseChannel(i, MADV_WILLNEED);
+#endif
+
+  const char* source = mapped + (streamoff) data_start +
+    (size_t) i * coarse_channel_size * sampleBytes();
+  size_t source_stride = (size_t) num_channels * sampleBytes();
+  size_t row_bytes = coarse_channel_size * sizeof(float);
+  float* output = buffer->data;
+  int output_stride = coarse_channel_size;
+  int bits = nbits;
+  auto copyRows = [=](int begin, int end) {
+    for (int row = begin; row < end; ++row) {
+      const char* source_row = source + row * source_stride;
+      float* output_row = output + (size_t) row * output_stride;
+      if (bits == 8) {
+        uint8sToFloats((const uint8_t*) source_row, output_row, output_stride);
+      } else if (bits == 16) {
+        uint16sToFloats((const uint16_t*) source_row, output_row, output_stride);
+      } else {
+        memcpy(output_row, source_row, row_bytes);
+      }
+    }
+  };
+
+  int num_copy_threads = min<long>({num_threads, num_timesteps,
+                                    (long) (row_bytes * num_timesteps /
+                                            MIN_BYTES_PER_THREAD)});
+  if (num_copy_threads <= 1) {
+    copyRows(0, num_timesteps);
+  } else {
+    vector<function<bool()> > tasks;
+    for (int t = 0; t < num_copy_threads; ++t) {
+      int begin = num_timesteps * t / num_copy_threads;
+      int end = num_timesteps * (t + 1) / num_copy_threads;
+      tasks.push_back([=]() {
+        copyRows(begin, end);
+        return true;
+      });
+    }
+    runInParallel(move(tasks), num_copy_threads);
+  }
+
+  if (i + 1 < num_coarse_channels) {
+    adviseCoarseChannel(i + 1, MADV_WILLNEED);
+  }
+
+  if (num_timesteps < buffer->num_timesteps) {
+    // Zero out the extra buffer space
+    size_t num_floats_loaded = (size_t) num_timesteps * coarse_channel_size;
+    size_t num_zeros_needed =
+      (size_t) (buffer->num_timesteps - num_timesteps) * coarse_channel_size;
+    memset(buffer->data + num_floats_loaded, 0, num_zeros_needed * sizeof(float));
+  }
+
+  if (has_dc_spike) {
+    // Remove the DC spike by making it the average of the adjacent columns
+    int mid = coarse_channel_size / 2;
+    for (int row_index = 0; row_index < num_timesteps; ++row_index) {
+      float* row = buffer->data + row_index * coarse_channel_size;
+      row[mid] = (row[mid - 1] + row[mid + 1]) / 2.0;
+    }
+  }
 }
 
-FilReader::~FilReader() {}
+FilReader::~FilReader() {
+  if (mapped) {
+    munmap(mapped, file_size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
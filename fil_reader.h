@@ -11,12 +11,26 @@ double convertFromSigprocRaOrDec(double sigproc);
 
 /*
   This class reads in sigproc filterbank files, typically ending in the .fil suffix.
+  The data is memory-mapped, so loading a coarse channel copies straight out of the
+  page cache.
  */
 class FilReader: public FilterbankFileReader {
  private:
   ifstream file;
 
   streampos data_start;
+
+  // 32 for float data, or 8 or 16 for unsigned integers
+  int nbits;
+  int sampleBytes() const { return nbits / 8; }
+
+  // The whole file is mapped, from the start of the header
+  int fd;
+  size_t file_size;
+  char* mapped;
+
+  // Calls madvise on the rows of a coarse channel. Returns whether it worked.
+  bool adviseCoarseChannel(int i, int advice) const;
   
   template <class T> T readBasic();
   string readString();
@@ -25,5 +39,8 @@ class FilReader: public FilterbankFileReader {
   FilReader(const string& filename);
   ~FilReader();
 
+  // How many threads to copy rows with, for large coarse channels
+  int num_threads;
+
   void loadCoarseChannel(int i, FilterbankBuffer* buffer) const;
 };
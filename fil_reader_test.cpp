@@ -1,5 +1,9 @@
 #include "catch/catch.hpp"
 
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <vector>
+
 #include "fil_reader.h"
 
 TEST_CASE("converting from sigproc ra", "[fil]") {
@@ -11,3 +15,98 @@ TEST_CASE("converting from sigproc ra", "[fil]") {
   hours = convertFromSigprocRaOrDec(-sigproc);
   REQUIRE(hours == Approx(-12.5 - 0.5 / seconds_per_hour));
 }
+
+static void writeFilString(ofstream& file, const string& s) {
+  uint32_t size = s.size();
+  file.write((const char*) &size, sizeof(size));
+  file.write(s.data(), s.size());
+}
+
+template <class T> static void writeFilSample(ofstream& file, float value) {
+  T sample = value;
+  file.write((const char*) &sample, sizeof(sample));
+}
+
+template <class T> static void writeFilAttr(ofstream& file, const string& name,
+                                            T value) {
+  writeFilString(file, name);
+  file.write((const char*) &value, sizeof(value));
+}
+
+// Writes the data as samples of the given number of bits
+static void writeFil(const string& filename, int nbits, int num_channels,
+                     int coarse_channel_size, const vector<float>& data) {
+  ofstream file(filename, ofstream::binary);
+  writeFilString(file, "HEADER_START");
+  writeFilString(file, "source_name");
+  writeFilString(file, "bob");
+  writeFilAttr<int>(file, "nbits", nbits);
+  writeFilAttr<int>(file, "nchans", num_channels);
+  writeFilAttr<int>(file, "nfpc", coarse_channel_size);
+  writeFilAttr<double>(file, "tsamp", 18.0);
+  writeFilAttr<double>(file, "fch1", 1500.0);
+  writeFilAttr<double>(file, "foff", -0.001);
+  writeFilString(file, "HEADER_END");
+  for (float value : data) {
+    if (nbits == 8) {
+      writeFilSample<uint8_t>(file, value);
+    } else if (nbits == 16) {
+      writeFilSample<uint16_t>(file, value);
+    } else {
+      writeFilSample<float>(file, value);
+    }
+  }
+}
+
+TEST_CASE("fil write then load coarse channels", "[fil]") {
+  string dir = boost::filesystem::temp_directory_path().c_str();
+  string filename = dir + "/testing.fil";
+
+  int num_timesteps = 5;
+  // Big enough for the rows to be copied by more than one thread
+  int coarse_channel_size = 1 << 19;
+  int num_coarse_channels = 2;
+  int num_channels = coarse_channel_size * num_coarse_channels;
+  vector<float> data(num_timesteps * num_channels);
+
+  for (int nbits : {8, 16, 32}) {
+    // Values that every sample size can hold exactly
+    for (int i = 0; i < (int) data.size(); ++i) {
+      data[i] = nbits == 32 ? 0.5 * i : i % (1 << nbits);
+    }
+    boost::filesystem::remove(filename);
+    writeFil(filename, nbits, num_channels, coarse_channel_size, data);
+
+    FilReader reader(filename);
+    REQUIRE(reader.source_name == "bob");
+    REQUIRE(reader.num_timesteps == num_timesteps);
+    REQUIRE(reader.num_coarse_channels == num_coarse_channels);
+    REQUIRE(reader.coarse_channel_size == coarse_channel_size);
+    REQUIRE(!reader.has_dc_spike);
+
+    // Extra rows, to check that the padding gets zeroed
+    FilterbankBuffer buffer(8, coarse_channel_size);
+    for (int threads : {1, 4}) {
+      reader.num_threads = threads;
+      for (int i = num_coarse_channels - 1; i >= 0; --i) {
+        for (int time = 0; time < buffer.num_timesteps; ++time) {
+          for (int chan = 0; chan < coarse_channel_size; ++chan) {
+            buffer.set(time, chan, -1.0);
+          }
+        }
+        reader.loadCoarseChannel(i, &buffer);
+        for (int time = 0; time < buffer.num_timesteps; ++time) {
+          for (int chan = 0; chan < coarse_channel_size; chan += 4099) {
+            float expected = 0.0;
+            if (time < num_timesteps) {
+              expected = data[time * num_channels + i * coarse_channel_size + chan];
+            }
+            REQUIRE(buffer.get(time, chan) == expected);
+          }
+        }
+      }
+    }
+  }
+
+  boost::filesystem::remove(filename);
+}
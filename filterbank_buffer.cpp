@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <fmt/core.h>
 #include <iostream>
+#include <string.h>
 
 #include "cuda_util.h"
 #include "util.h"
@@ -14,8 +15,15 @@ FilterbankBuffer::FilterbankBuffer(int num_timesteps, int num_channels)
   : num_timesteps(num_timesteps), num_channels(num_channels), managed(true),
     size(num_timesteps * num_channels),
     bytes(sizeof(float) * size) {
+#ifdef SETICORE_CPU_ONLY
+  data = (float*) malloc(bytes);
+  if (data == nullptr) {
+    fatal(fmt::format("FilterbankBuffer: could not allocate {} bytes", bytes));
+  }
+#else
   cudaMallocManaged(&data, bytes);
   checkCudaMalloc("FilterbankBuffer", bytes);
+#endif
 }
 
 // Creates a buffer that is a view on memory owned by the caller.
@@ -27,7 +35,11 @@ FilterbankBuffer::FilterbankBuffer(int num_timesteps, int num_channels, float* d
 
 FilterbankBuffer::~FilterbankBuffer() {
   if (managed) {
+#ifdef SETICORE_CPU_ONLY
+    free(data);
+#else
     cudaFree(data);
+#endif
   }
 }
 
@@ -45,8 +57,10 @@ void FilterbankBuffer::set(int time, int channel, float value) {
 }
 
 float FilterbankBuffer::get(int time, int channel) const {
+#ifndef SETICORE_CPU_ONLY
   cudaDeviceSynchronize();
   checkCuda("FilterbankBuffer get");
+#endif
   int index = time * num_channels + channel;
   return data[index];
 }
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <cstddef>
+
 using namespace std;
 
 /*
-  The FilterbankBuffer stores the contents of a filterbank file in unified memory.
+  The FilterbankBuffer stores the contents of a filterbank file in unified memory,
+  or in regular host memory for a CPU-only build.
   Just one beam. This can be a single coarse channel, or the entire file.
  */
 class FilterbankBuffer {
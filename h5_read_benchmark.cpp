@@ -0,0 +1,107 @@
+#include <boost/filesystem.hpp>
+#include <fmt/core.h>
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <vector>
+
+#include "filterbank_buffer.h"
+#include "h5_reader.h"
+#include "h5_writer.h"
+#include "util.h"
+
+using namespace std;
+
+/*
+  Writes a compressed FBH5 file of noise, with chunks that span four coarse
+  channels, to benchmark with when no file is provided.
+ */
+void writeTestFile(const string& filename, int num_timesteps, int num_coarse_channels,
+                   int coarse_channel_size) {
+  FilterbankMetadata metadata;
+  metadata.source_name = "benchmark";
+  metadata.fch1 = 0.0;
+  metadata.foff = -2.7939677238464355e-06;
+  metadata.tstart = 0.0;
+  metadata.tsamp = 18.253611008;
+  metadata.src_dej = 0.0;
+  metadata.src_raj = 0.0;
+  metadata.num_timesteps = num_timesteps;
+  metadata.num_channels = (long) num_coarse_channels * coarse_channel_size;
+  metadata.coarse_channel_size = coarse_channel_size;
+  metadata.num_coarse_channels = num_coarse_channels;
+  metadata.telescope_id = NO_TELESCOPE_ID;
+
+  H5WriterOptions options;
+  options.chunk_timesteps = 1;
+  options.chunk_channels = 4 * coarse_channel_size;
+  options.deflate_level = 1;
+  options.shuffle = true;
+
+  // Noise with a realistic dynamic range, rounded so that it compresses somewhat
+  mt19937 rng(42);
+  normal_distribution<float> noise(1e9, 1e7);
+  vector<float> data(num_timesteps * metadata.num_channels);
+  for (float& v : data) {
+    v = round(noise(rng) / 4096) * 4096;
+  }
+
+  H5Writer writer(filename, metadata, options);
+  writer.setData(data.data());
+  writer.close();
+}
+
+/*
+  Performance testing reading every coarse channel out of an h5 file.
+  run: h5_read_benchmark [filename]
+  Without a filename, this benchmarks a generated compressed file.
+ */
+int main(int argc, char* argv[]) {
+  string filename;
+  bool generated = argc < 2;
+  if (generated) {
+    filename = string(boost::filesystem::temp_directory_path().c_str()) +
+      "/h5_read_benchmark.h5";
+    cout << "writing a test file to " << filename << endl;
+    writeTestFile(filename, 16, 32, 1 << 16);
+  } else {
+    filename = argv[1];
+  }
+
+  struct Config {
+    string description;
+    size_t cache_bytes;
+    bool direct;
+  };
+  vector<Config> configs = {
+    {"hyperslab reads", 0, false},
+    {"cache of one chunk", 1, false},
+    {fmt::format("chunk cache of {}", prettyBytes(DEFAULT_CHUNK_CACHE_BYTES)),
+     DEFAULT_CHUNK_CACHE_BYTES, false},
+    {"direct chunk reads", DEFAULT_CHUNK_CACHE_BYTES, true},
+  };
+  for (const Config& config : configs) {
+    // A new reader each time, so nothing is cached from the last run
+    H5Reader reader(filename);
+    reader.chunk_cache_bytes = config.cache_bytes;
+    reader.direct_chunk_reads = config.direct;
+    FilterbankBuffer buffer(reader.num_timesteps, reader.coarse_channel_size);
+    long start = timeInMS();
+    for (int i = 0; i < reader.num_coarse_channels; ++i) {
+      reader.loadCoarseChannel(i, &buffer);
+    }
+    long end = timeInMS();
+    double mb = (double) reader.num_timesteps * reader.num_channels * sizeof(float) /
+      (1 << 20);
+    string threads = config.direct ?
+      fmt::format(" on {} thread{}", reader.num_threads,
+                  reader.num_threads == 1 ? "" : "s") : "";
+    cout << fmt::format("{}{}: {:.1f} MB in {:.3f}s, {:.1f} MB/s\n",
+                        config.description, threads, mb, (end - start) / 1000.0,
+                        mb * 1000.0 / (end - start));
+  }
+
+  if (generated) {
+    boost::filesystem::remove(filename);
+  }
+}
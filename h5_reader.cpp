@@ -1,12 +1,16 @@
+#include <algorithm>
 #include <assert.h>
 #include <cstdlib>
 #include <fmt/core.h>
 #include "hdf5.h"
 #include <iostream>
 #include <string.h>
+#include <thread>
 #include "util.h"
+#include <zlib.h>
 
 #include "h5_reader.h"
+#include "thread_util.h"
 
 using namespace std;
 
@@ -16,8 +20,13 @@ using namespace std;
   telescope input from one of the known telescopes. If the data is an
   unexpected size or shape we should be conservative and exit.
  */
-H5Reader::H5Reader(const string& filename) : FilterbankFileReader(filename) {
-  file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+H5Reader::H5Reader(const string& filename)
+  : FilterbankFileReader(filename), chunk_cache_bytes(DEFAULT_CHUNK_CACHE_BYTES),
+    direct_chunk_reads(true),
+    num_threads(max(1, min(8, (int) thread::hardware_concurrency()))) {
+  // SWMR reading works for any file, and lets us read one that an H5Writer is
+  // still appending to
+  file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
   if (file == H5I_INVALID_HID) {
     fatal("could not open file for reading:", filename);
   }
@@ -51,6 +60,33 @@ H5Reader::H5Reader(const string& filename) : FilterbankFileReader(filename) {
   }
   num_timesteps = dims[0];
   num_channels = dims[2];
+
+  chunk_dims[0] = chunk_dims[1] = chunk_dims[2] = 0;
+  hid_t create_plist = H5Dget_create_plist(dataset);
+  if (create_plist == H5I_INVALID_HID) {
+    fatal("could not get dataset creation property list");
+  }
+  if (H5Pget_layout(create_plist) == H5D_CHUNKED &&
+      H5Pget_chunk(create_plist, 3, chunk_dims) != 3) {
+    fatal("could not get chunk dimensions");
+  }
+
+  // We can decompress chunks ourselves if we know all of their filters
+  can_decode_chunks = chunk_dims[0] > 0;
+  int num_filters = H5Pget_nfilters(create_plist);
+  for (int f = 0; f < num_filters; ++f) {
+    unsigned int flags, config;
+    unsigned int cd_values[8];
+    size_t num_cd_values = 8;
+    char name[64];
+    H5Z_filter_t filter = H5Pget_filter2(create_plist, f, &flags, &num_cd_values,
+                                         cd_values, sizeof(name), name, &config);
+    if (filter != H5Z_FILTER_DEFLATE && filter != H5Z_FILTER_SHUFFLE) {
+      can_decode_chunks = false;
+    }
+    filters.push_back(filter);
+  }
+  H5Pclose(create_plist);
   
   telescope_id = getLongAttr("telescope_id");
 
@@ -167,7 +203,31 @@ string H5Reader::getStringAttr(const string& name) const {
 void H5Reader::loadCoarseChannel(int i, FilterbankBuffer* buffer) const {
   assert(num_timesteps <= buffer->num_timesteps);
   assert(coarse_channel_size == buffer->num_channels);
-  
+
+  if (chunk_dims[0] > 0 && chunk_cache_bytes > 0) {
+    loadCoarseChannelFromChunks(i, buffer);
+  } else {
+    loadCoarseChannelFromHyperslab(i, buffer);
+  }
+
+  if (num_timesteps < buffer->num_timesteps) {
+    // Zero out the extra buffer space
+    int num_floats_loaded = num_timesteps * coarse_channel_size;
+    int num_zeros_needed = (buffer->num_timesteps - num_timesteps) * coarse_channel_size;
+    memset(buffer->data + num_floats_loaded, 0, num_zeros_needed * sizeof(float));
+  }
+
+  if (has_dc_spike) {
+    // Remove the DC spike by making it the average of the adjacent columns
+    int mid = coarse_channel_size / 2;
+    for (int row_index = 0; row_index < num_timesteps; ++row_index) {
+      float* row = buffer->data + row_index * coarse_channel_size;
+      row[mid] = (row[mid - 1] + row[mid + 1]) / 2.0;
+    }
+  }
+}
+
+void H5Reader::loadCoarseChannelFromHyperslab(int i, FilterbankBuffer* buffer) const {
   // Select a hyperslab containing just the coarse channel we want
   const hsize_t offset[3] = {0, 0, unsigned(i * coarse_channel_size)};
   const hsize_t coarse_channel_dim[3] = {unsigned(num_timesteps), 1,
@@ -191,23 +251,231 @@ void H5Reader::loadCoarseChannel(int i, FilterbankBuffer* buffer) const {
   }
     
   H5Sclose(memspace);
+}
 
-  if (num_timesteps < buffer->num_timesteps) {
-    // Zero out the extra buffer space
-    int num_floats_loaded = num_timesteps * coarse_channel_size;
-    int num_zeros_needed = (buffer->num_timesteps - num_timesteps) * coarse_channel_size;
-    memset(buffer->data + num_floats_loaded, 0, num_zeros_needed * sizeof(float));
+/*
+  Assembles the coarse channel out of every chunk that overlaps it. Chunks that
+  overlap several coarse channels stay in the cache, so when coarse channels are
+  loaded in order, each chunk only gets read and decompressed once.
+*/
+void H5Reader::loadCoarseChannelFromChunks(int i, FilterbankBuffer* buffer) const {
+  long begin_freq = i * coarse_channel_size;
+  long end_freq = begin_freq + coarse_channel_size;
+  long num_time_chunks = (num_timesteps + chunk_dims[0] - 1) / chunk_dims[0];
+  long first_freq_chunk = begin_freq / chunk_dims[2];
+  long last_freq_chunk = (end_freq - 1) / chunk_dims[2];
+  vector<ChunkIndex> indexes;
+  for (long time_chunk = 0; time_chunk < num_time_chunks; ++time_chunk) {
+    for (long freq_chunk = first_freq_chunk; freq_chunk <= last_freq_chunk;
+         ++freq_chunk) {
+      indexes.push_back(make_pair(time_chunk, freq_chunk));
+    }
   }
 
-  if (has_dc_spike) {
-    // Remove the DC spike by making it the average of the adjacent columns
-    int mid = coarse_channel_size / 2;
-    for (int row_index = 0; row_index < num_timesteps; ++row_index) {
-      float* row = buffer->data + row_index * coarse_channel_size;
-      row[mid] = (row[mid - 1] + row[mid + 1]) / 2.0;
+  // Work through as many chunks at a time as fit in the cache
+  size_t capacity = chunkCacheCapacity();
+  for (size_t group_begin = 0; group_begin < indexes.size(); group_begin += capacity) {
+    vector<ChunkIndex> group(indexes.begin() + group_begin,
+                             indexes.begin() + min(indexes.size(),
+                                                   group_begin + capacity));
+    cacheChunks(group);
+
+    for (const ChunkIndex& index : group) {
+      const Chunk& chunk = *chunk_cache_index.at(chunkKey(index));
+
+      // Copy the part of each row that overlaps the coarse channel
+      long chunk_begin_freq = index.second * chunk_dims[2];
+      long copy_begin = max(begin_freq, chunk_begin_freq);
+      long copy_end = min(end_freq, chunk_begin_freq + chunk.num_channels);
+      for (long row = 0; row < chunk.num_timesteps; ++row) {
+        long time = index.first * chunk_dims[0] + row;
+        memcpy(buffer->data + time * coarse_channel_size + (copy_begin - begin_freq),
+               chunk.data.data() + row * chunk.num_channels +
+               (copy_begin - chunk_begin_freq),
+               (copy_end - copy_begin) * sizeof(float));
+      }
     }
   }
 }
+
+long H5Reader::chunkKey(const ChunkIndex& index) const {
+  long num_freq_chunks = (num_channels + chunk_dims[2] - 1) / chunk_dims[2];
+  return index.first * num_freq_chunks + index.second;
+}
+
+size_t H5Reader::chunkCacheCapacity() const {
+  size_t chunk_bytes = chunk_dims[0] * chunk_dims[2] * sizeof(float);
+  return max<size_t>(1, chunk_cache_bytes / chunk_bytes);
+}
+
+/*
+  Makes sure that all of these chunks are in the cache, and marks them as the most
+  recently used. There can't be more of them than the cache capacity.
+*/
+void H5Reader::cacheChunks(const vector<ChunkIndex>& indexes) const {
+  size_t capacity = chunkCacheCapacity();
+  assert(indexes.size() <= capacity);
+  vector<ChunkIndex> missing;
+  for (const ChunkIndex& index : indexes) {
+    auto it = chunk_cache_index.find(chunkKey(index));
+    if (it == chunk_cache_index.end()) {
+      missing.push_back(index);
+    } else {
+      chunk_cache.splice(chunk_cache.begin(), chunk_cache, it->second);
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
+
+  // Evict the least recently used chunks, reusing their memory
+  vector<Chunk> chunks(missing.size());
+  size_t num_reused = 0;
+  while (!chunk_cache.empty() && chunk_cache.size() + missing.size() > capacity) {
+    Chunk& evicted = chunk_cache.back();
+    chunk_cache_index.erase(evicted.key);
+    if (num_reused < chunks.size()) {
+      chunks[num_reused++] = move(evicted);
+    }
+    chunk_cache.pop_back();
+  }
+
+  if (direct_chunk_reads && can_decode_chunks) {
+    readChunksDirectly(missing, &chunks);
+  } else {
+    for (int j = 0; j < (int) missing.size(); ++j) {
+      readChunk(missing[j], &chunks[j]);
+    }
+  }
+
+  for (int j = 0; j < (int) missing.size(); ++j) {
+    chunks[j].key = chunkKey(missing[j]);
+    chunk_cache.push_front(move(chunks[j]));
+    chunk_cache_index[chunk_cache.front().key] = chunk_cache.begin();
+  }
+}
+
+/*
+  Reads the raw compressed chunks with H5Dread_chunk, and then decompresses them
+  on num_threads threads. The hdf5 library is not threadsafe, so all of the
+  reading happens on this thread.
+*/
+void H5Reader::readChunksDirectly(const vector<ChunkIndex>& indexes,
+                                  vector<Chunk>* chunks) const {
+  vector<vector<char> > raw_chunks(indexes.size());
+  vector<uint32_t> filter_masks(indexes.size());
+  vector<function<bool()> > tasks;
+  for (int j = 0; j < (int) indexes.size(); ++j) {
+    const hsize_t offset[3] = {hsize_t(indexes[j].first * chunk_dims[0]), 0,
+                               hsize_t(indexes[j].second * chunk_dims[2])};
+    hsize_t storage_size;
+    if (H5Dget_chunk_storage_size(dataset, offset, &storage_size) < 0) {
+      fatal("could not get chunk storage size");
+    }
+    if (storage_size == 0) {
+      // This chunk was never written, so the library has to supply its fill value
+      readChunk(indexes[j], &(*chunks)[j]);
+      continue;
+    }
+    raw_chunks[j].resize(storage_size);
+    if (H5Dread_chunk(dataset, H5P_DEFAULT, offset, &filter_masks[j],
+                      raw_chunks[j].data()) < 0) {
+      fatal("H5Dread_chunk failed");
+    }
+    tasks.push_back([this, &indexes, &raw_chunks, &filter_masks, chunks, j]() {
+      return decodeChunk(indexes[j], raw_chunks[j], filter_masks[j], &(*chunks)[j]);
+    });
+  }
+
+  int num_decode_threads = min(num_threads, (int) tasks.size());
+  if (!runInParallel(move(tasks), num_decode_threads)) {
+    fatal("could not decompress an h5 chunk");
+  }
+}
+
+/*
+  Runs the filters of the dataset backwards, the way the hdf5 library would.
+  Bit f of the filter mask is set if filter f was skipped for this chunk.
+  Returns whether decoding worked.
+*/
+bool H5Reader::decodeChunk(const ChunkIndex& index, const vector<char>& raw,
+                           uint32_t filter_mask, Chunk* chunk) const {
+  size_t chunk_bytes = chunk_dims[0] * chunk_dims[2] * sizeof(float);
+  vector<char> current(raw);
+  vector<char> next(chunk_bytes);
+  for (int f = filters.size() - 1; f >= 0; --f) {
+    if (filter_mask & (1u << f)) {
+      continue;
+    }
+    if (filters[f] == H5Z_FILTER_DEFLATE) {
+      uLongf decompressed_size = chunk_bytes;
+      if (uncompress((Bytef*) next.data(), &decompressed_size,
+                     (const Bytef*) current.data(), current.size()) != Z_OK ||
+          decompressed_size != chunk_bytes) {
+        return false;
+      }
+      next.resize(decompressed_size);
+    } else if (filters[f] == H5Z_FILTER_SHUFFLE) {
+      // Each byte of a float was stored in its own plane
+      if (current.size() != chunk_bytes) {
+        return false;
+      }
+      size_t n = chunk_bytes / sizeof(float);
+      next.resize(chunk_bytes);
+      for (size_t b = 0; b < sizeof(float); ++b) {
+        const char* plane = current.data() + b * n;
+        for (size_t k = 0; k < n; ++k) {
+          next[k * sizeof(float) + b] = plane[k];
+        }
+      }
+    } else {
+      return false;
+    }
+    swap(current, next);
+  }
+  if (current.size() != chunk_bytes) {
+    return false;
+  }
+
+  // A chunk that hangs off the end of the data is stored at full size
+  chunk->num_timesteps = min<long>(chunk_dims[0],
+                                   num_timesteps - index.first * chunk_dims[0]);
+  chunk->num_channels = min<long>(chunk_dims[2],
+                                  num_channels - index.second * chunk_dims[2]);
+  chunk->data.resize(chunk->num_timesteps * chunk->num_channels);
+  for (long row = 0; row < chunk->num_timesteps; ++row) {
+    memcpy(chunk->data.data() + row * chunk->num_channels,
+           current.data() + row * chunk_dims[2] * sizeof(float),
+           chunk->num_channels * sizeof(float));
+  }
+  return true;
+}
+
+// Reads exactly one chunk, so the hdf5 library decompresses it exactly once
+void H5Reader::readChunk(const ChunkIndex& index, Chunk* chunk) const {
+  long begin_time = index.first * chunk_dims[0];
+  long begin_freq = index.second * chunk_dims[2];
+  chunk->num_timesteps = min<long>(chunk_dims[0], num_timesteps - begin_time);
+  chunk->num_channels = min<long>(chunk_dims[2], num_channels - begin_freq);
+  chunk->data.resize(chunk->num_timesteps * chunk->num_channels);
+
+  const hsize_t offset[3] = {hsize_t(begin_time), 0, hsize_t(begin_freq)};
+  const hsize_t dims[3] = {hsize_t(chunk->num_timesteps), 1,
+                           hsize_t(chunk->num_channels)};
+  if (H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset, NULL, dims, NULL) < 0) {
+    fatal("failed to select chunk hyperslab");
+  }
+  hid_t memspace = H5Screate_simple(3, dims, NULL);
+  if (memspace == H5I_INVALID_HID) {
+    fatal("failed to create memspace");
+  }
+  if (H5Dread(dataset, H5T_NATIVE_FLOAT, memspace, dataspace, H5P_DEFAULT,
+              chunk->data.data()) < 0) {
+    fatal("h5 read failed. make sure that plugin files are in the plugin directory:",
+          H5_DEFAULT_PLUGINDIR);
+  }
+  H5Sclose(memspace);
+}
   
 H5Reader::~H5Reader() {
   H5Sclose(dataspace);
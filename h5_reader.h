@@ -1,5 +1,9 @@
 #pragma once
 
+#include <list>
+#include <unordered_map>
+#include <vector>
+
 #include "filterbank_file_reader.h"
 #include "hdf5.h"
 
@@ -18,10 +22,67 @@ class H5Reader: public FilterbankFileReader {
   long getLongAttr(const string& name) const;
   bool attrExists(const string& name) const;
   hid_t file, dataset, dataspace;
+
+  // The chunk dimensions of the dataset, in time, beam, and frequency.
+  // Zero if the dataset is not chunked.
+  hsize_t chunk_dims[3];
+
+  // One chunk of data, decompressed. Chunks at the end of the data may be smaller
+  // than chunk_dims.
+  struct Chunk {
+    long key;
+    long num_timesteps;
+    long num_channels;
+    vector<float> data;
+  };
+
+  // The cache of decompressed chunks, most recently used first, and indexed by key
+  mutable list<Chunk> chunk_cache;
+  mutable unordered_map<long, list<Chunk>::iterator> chunk_cache_index;
+
+  // A chunk is indexed by its time chunk and its frequency chunk
+  typedef pair<long, long> ChunkIndex;
+  long chunkKey(const ChunkIndex& index) const;
+  size_t chunkCacheCapacity() const;
+  void cacheChunks(const vector<ChunkIndex>& indexes) const;
+
+  // The filters that the dataset was written with, in the order they were applied,
+  // and whether decodeChunk knows how to undo all of them
+  vector<H5Z_filter_t> filters;
+  bool can_decode_chunks;
+
+  // Reading chunks through the hdf5 library, or reading them raw and decoding
+  // them ourselves
+  void readChunk(const ChunkIndex& index, Chunk* chunk) const;
+  void readChunksDirectly(const vector<ChunkIndex>& indexes,
+                          vector<Chunk>* chunks) const;
+  bool decodeChunk(const ChunkIndex& index, const vector<char>& raw,
+                   uint32_t filter_mask, Chunk* chunk) const;
+
+  void loadCoarseChannelFromChunks(int i, FilterbankBuffer* buffer) const;
+  void loadCoarseChannelFromHyperslab(int i, FilterbankBuffer* buffer) const;
   
  public:
   H5Reader(const string& filename);
   ~H5Reader();
 
+  // How much memory the cache of decompressed chunks can use. A chunked dataset
+  // may have chunks that span several coarse channels, and the cache lets us
+  // decompress each of them only once. It always holds at least one chunk.
+  // Set this to zero to read each coarse channel with a single hyperslab read,
+  // leaving any caching to the hdf5 library.
+  size_t chunk_cache_bytes;
+
+  // Whether to read chunks raw and decompress them on num_threads threads, rather
+  // than through the single-threaded hdf5 filter pipeline. This only happens for
+  // datasets whose filters are all deflate or shuffle, and the hdf5 library handles
+  // anything else.
+  bool direct_chunk_reads;
+  int num_threads;
+
   void loadCoarseChannel(int i, FilterbankBuffer* buffer) const;
 };
+
+// Enough to decompress each chunk once when a typical file is read in coarse
+// channel order
+const size_t DEFAULT_CHUNK_CACHE_BYTES = 256 << 20;
@@ -1,40 +1,21 @@
 #include "catch/catch.hpp"
 
 #include <boost/filesystem.hpp>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "filterbank_buffer.h"
 #include "h5_reader.h"
+#include "h5_write_queue.h"
 #include "h5_writer.h"
+#include "test_util.h"
 #include "util.h"
 
 TEST_CASE("h5 write then read", "[h5]") {
-  string dir = boost::filesystem::temp_directory_path().c_str();
-  string filename = dir + "/testing.h5";
-  boost::filesystem::remove(filename);
-    
-  FilterbankMetadata m;
-  m.source_name = "bob";
-  m.fch1 = 1.0;
-  m.foff = 2.0;
-  m.tstart = 3.0;
-  m.tsamp = 4.0;
-  m.src_dej = 5.0;
-  m.src_raj = 6.0;
-  m.num_timesteps = 10;
-  m.num_channels = 100;
-  m.coarse_channel_size = 10;
-  m.num_coarse_channels = 10;
-  m.telescope_id = MEERKAT;
-
-  vector<float> data;
-  for (int time = 0; time < m.num_timesteps; ++time) {
-    for (int chan = 0; chan < m.num_channels; ++chan) {
-      data.push_back(100.0 * time + 1.0 * chan);
-    }
-  }
-  
-  H5Writer writer(filename, m);
-  writer.setData(&data[0]);
-  writer.close();
+  string filename = testFilename("testing.h5");
+  FilterbankMetadata m = testMetadata(10, 10, 10);
+  writeTestH5(filename, m);
 
   H5Reader f(filename);
 
@@ -58,3 +39,280 @@ TEST_CASE("h5 write then read", "[h5]") {
   
   boost::filesystem::remove(filename);
 }
+
+// Writes an h5 file with a chunked dataset, with the given filters
+static void writeChunkedH5(const string& filename, const FilterbankMetadata& m,
+                           const vector<float>& data, const hsize_t* chunk_dims,
+                           const vector<H5Z_filter_t>& filters) {
+  hid_t file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+  hsize_t dims[3] = {hsize_t(m.num_timesteps), 1, hsize_t(m.num_channels)};
+  hid_t dataspace = H5Screate_simple(3, dims, NULL);
+  hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+  REQUIRE(H5Pset_chunk(plist, 3, chunk_dims) >= 0);
+  for (H5Z_filter_t filter : filters) {
+    if (filter == H5Z_FILTER_SHUFFLE) {
+      REQUIRE(H5Pset_shuffle(plist) >= 0);
+    } else if (filter == H5Z_FILTER_DEFLATE) {
+      REQUIRE(H5Pset_deflate(plist, 1) >= 0);
+    } else {
+      REQUIRE(filter == H5Z_FILTER_FLETCHER32);
+      REQUIRE(H5Pset_fletcher32(plist) >= 0);
+    }
+  }
+  hid_t dataset = H5Dcreate2(file, "data", H5T_NATIVE_FLOAT, dataspace, H5P_DEFAULT,
+                             plist, H5P_DEFAULT);
+  REQUIRE(H5Dwrite(dataset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                   data.data()) >= 0);
+
+  auto setAttr = [&](const string& name, hid_t type, const void* value) {
+    hid_t scalar = H5Screate(H5S_SCALAR);
+    hid_t attr = H5Acreate2(dataset, name.c_str(), type, scalar, H5P_DEFAULT,
+                            H5P_DEFAULT);
+    REQUIRE(H5Awrite(attr, type, value) >= 0);
+    H5Aclose(attr);
+    H5Sclose(scalar);
+  };
+  for (auto attr : {make_pair("fch1", m.fch1), make_pair("foff", m.foff),
+                    make_pair("tstart", m.tstart), make_pair("tsamp", m.tsamp),
+                    make_pair("src_dej", m.src_dej), make_pair("src_raj", m.src_raj)}) {
+    setAttr(attr.first, H5T_NATIVE_DOUBLE, &attr.second);
+  }
+  long telescope_id = m.telescope_id;
+  setAttr("telescope_id", H5T_NATIVE_LONG, &telescope_id);
+  setAttr("nfpc", H5T_NATIVE_LONG, &m.coarse_channel_size);
+  hid_t string_type = H5Tcopy(H5T_C_S1);
+  H5Tset_size(string_type, m.source_name.size());
+  setAttr("source_name", string_type, m.source_name.c_str());
+
+  H5Tclose(string_type);
+  H5Dclose(dataset);
+  H5Pclose(plist);
+  H5Sclose(dataspace);
+  H5Fclose(file);
+}
+
+TEST_CASE("chunked h5 reads match however they are done", "[h5]") {
+  string filename = testFilename("testing_chunked.h5");
+  FilterbankMetadata m = testMetadata(10, 10, 100);
+  vector<float> data = testData(m.num_timesteps, m.num_channels);
+
+  // Chunks that span more than two coarse channels, with partial chunks at the
+  // end of both dimensions
+  hsize_t chunk_dims[3] = {3, 1, 240};
+  size_t chunk_bytes = 3 * 240 * sizeof(float);
+  // The checksum filter is one that direct chunk reads can't decode
+  vector<vector<H5Z_filter_t> > filter_lists = {
+    {},
+    {H5Z_FILTER_SHUFFLE, H5Z_FILTER_DEFLATE},
+    {H5Z_FILTER_DEFLATE},
+    {H5Z_FILTER_SHUFFLE, H5Z_FILTER_DEFLATE, H5Z_FILTER_FLETCHER32},
+  };
+  for (const auto& filters : filter_lists) {
+    writeChunkedH5(filename, m, data, chunk_dims, filters);
+    H5Reader f(filename);
+    REQUIRE(f.num_coarse_channels == 10);
+    for (bool direct : {true, false}) {
+      for (size_t cache_bytes : {DEFAULT_CHUNK_CACHE_BYTES, 5 * chunk_bytes,
+                                 (size_t) 1, (size_t) 0}) {
+        f.direct_chunk_reads = direct;
+        f.num_threads = 3;
+        f.chunk_cache_bytes = cache_bytes;
+        // Padded, to check the zeroing too
+        FilterbankBuffer buffer(16, f.coarse_channel_size);
+        for (int i : {0, 1, 2, 3, 9, 4, 5, 6, 7, 8}) {
+          f.loadCoarseChannel(i, &buffer);
+          for (int time = 0; time < buffer.num_timesteps; ++time) {
+            for (int chan = 0; chan < f.coarse_channel_size; ++chan) {
+              float expected = 0.0;
+              if (time < m.num_timesteps) {
+                expected = data[time * m.num_channels + i * f.coarse_channel_size +
+                                chan];
+              }
+              REQUIRE(buffer.get(time, chan) == expected);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  boost::filesystem::remove(filename);
+}
+
+TEST_CASE("h5 write queue writes compressed chunks", "[h5]") {
+  FilterbankMetadata m = testMetadata(10, 10, 100);
+  H5WriterOptions options = compressedOptions(m, 1);
+  REQUIRE(options.chunk_timesteps == m.num_timesteps);
+  REQUIRE(options.chunk_channels == m.coarse_channel_size);
+
+  auto makeData = [&](int file_index) {
+    vector<float> data = testData(m.num_timesteps, m.num_channels);
+    for (float& value : data) {
+      value += 1000.0 * file_index;
+    }
+    return data;
+  };
+  int num_files = 3;
+  vector<string> filenames;
+  for (int i = 0; i < num_files; ++i) {
+    filenames.push_back(testFilename("testing_queue" + to_string(i) + ".h5"));
+  }
+  {
+    // Room for less than two files, so writes have to wait for each other
+    H5WriteQueue queue(m.num_timesteps * m.num_channels * sizeof(float) * 3 / 2);
+    for (int i = 0; i < num_files; ++i) {
+      queue.write(filenames[i], m, options, makeData(i));
+    }
+    queue.flush();
+  }
+
+  for (int i = 0; i < num_files; ++i) {
+    const string& filename = filenames[i];
+
+    hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    hid_t dataset = H5Dopen2(file, "data", H5P_DEFAULT);
+    hid_t plist = H5Dget_create_plist(dataset);
+    REQUIRE(H5Pget_layout(plist) == H5D_CHUNKED);
+    hsize_t chunk_dims[3];
+    REQUIRE(H5Pget_chunk(plist, 3, chunk_dims) == 3);
+    REQUIRE(chunk_dims[0] == (hsize_t) m.num_timesteps);
+    REQUIRE(chunk_dims[2] == (hsize_t) m.coarse_channel_size);
+    REQUIRE(H5Pget_nfilters(plist) == 2);
+    unsigned int flags;
+    REQUIRE(H5Pget_filter2(plist, 0, &flags, NULL, NULL, 0, NULL, NULL) ==
+            H5Z_FILTER_SHUFFLE);
+    REQUIRE(H5Pget_filter2(plist, 1, &flags, NULL, NULL, 0, NULL, NULL) ==
+            H5Z_FILTER_DEFLATE);
+    H5Pclose(plist);
+    H5Dclose(dataset);
+    H5Fclose(file);
+
+    H5Reader f(filename);
+    REQUIRE(f.source_name == m.source_name);
+    REQUIRE(f.num_coarse_channels == m.num_coarse_channels);
+    vector<float> data = makeData(i);
+    FilterbankBuffer buffer(f.num_timesteps, f.coarse_channel_size);
+    for (int coarse_channel = 0; coarse_channel < f.num_coarse_channels;
+         ++coarse_channel) {
+      f.loadCoarseChannel(coarse_channel, &buffer);
+      for (int time = 0; time < f.num_timesteps; ++time) {
+        for (int chan = 0; chan < f.coarse_channel_size; ++chan) {
+          REQUIRE(buffer.get(time, chan) ==
+                  data[time * m.num_channels +
+                       coarse_channel * f.coarse_channel_size + chan]);
+        }
+      }
+    }
+    boost::filesystem::remove(filename);
+  }
+}
+
+/*
+  Reads an h5 file in a new process, like a downstream tool would, with the
+  test case below. A process can't have the same file open for writing and
+  reading, so a child process has to do the reading.
+  Returns whether every check passed.
+ */
+static bool readInChildProcess(const string& filename, int expected_timesteps) {
+  extern char** environ;
+  vector<string> env_strings = {
+    "SETICORE_PARTIAL_H5=" + filename,
+    "SETICORE_PARTIAL_H5_TIMESTEPS=" + to_string(expected_timesteps),
+  };
+  vector<char*> env;
+  for (char** e = environ; *e; ++e) {
+    env.push_back(*e);
+  }
+  for (string& s : env_strings) {
+    env.push_back(&s[0]);
+  }
+  env.push_back(nullptr);
+  char exe[] = "/proc/self/exe";
+  char test_spec[] = "[h5_partial_reader]";
+  char* argv[] = {exe, test_spec, nullptr};
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execve(exe, argv, env.data());
+    _exit(127);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+    return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Only run from readInChildProcess
+TEST_CASE("read a partially written h5 file", "[.][h5_partial_reader]") {
+  const char* filename = getenv("SETICORE_PARTIAL_H5");
+  const char* expected_timesteps = getenv("SETICORE_PARTIAL_H5_TIMESTEPS");
+  REQUIRE(filename != nullptr);
+  REQUIRE(expected_timesteps != nullptr);
+
+  H5Reader f(filename);
+  REQUIRE(f.num_timesteps == atoi(expected_timesteps));
+  FilterbankBuffer buffer(f.num_timesteps, f.coarse_channel_size);
+  for (int coarse_channel = 0; coarse_channel < f.num_coarse_channels;
+       ++coarse_channel) {
+    f.loadCoarseChannel(coarse_channel, &buffer);
+    for (int time = 0; time < f.num_timesteps; ++time) {
+      for (int chan = 0; chan < f.coarse_channel_size; ++chan) {
+        REQUIRE(buffer.get(time, chan) ==
+                100.0 * time + coarse_channel * f.coarse_channel_size + chan);
+      }
+    }
+  }
+}
+
+TEST_CASE("h5 files can be appended to a few timesteps at a time", "[h5]") {
+  string filename = testFilename("testing_append.h5");
+
+  // Not necessarily the number of timesteps appended
+  FilterbankMetadata m = testMetadata(1, 10, 100);
+  H5WriterOptions options = compressedOptions(m, 1);
+  options.chunk_timesteps = 3;
+  options.extendible = true;
+
+  int num_timesteps = 10;
+  vector<float> data = testData(num_timesteps, m.num_channels);
+
+  {
+    H5WriteQueue queue(0);
+    int file_id = queue.openFile(filename, m, options);
+    int time = 0;
+    for (int slice_timesteps : {4, 4, 2}) {
+      auto begin = data.begin() + time * m.num_channels;
+      queue.append(file_id, vector<float>(begin,
+                                          begin + slice_timesteps * m.num_channels));
+      time += slice_timesteps;
+
+      if (time < num_timesteps) {
+        // Another process can read what has been appended so far
+        queue.flush();
+        REQUIRE(readInChildProcess(filename, time));
+      }
+    }
+    queue.closeFile(file_id);
+    queue.flush();
+  }
+
+  H5Reader f(filename);
+  REQUIRE(f.source_name == m.source_name);
+  REQUIRE(f.num_timesteps == num_timesteps);
+  REQUIRE(f.num_channels == m.num_channels);
+  FilterbankBuffer buffer(f.num_timesteps, f.coarse_channel_size);
+  for (int coarse_channel = 0; coarse_channel < f.num_coarse_channels;
+       ++coarse_channel) {
+    f.loadCoarseChannel(coarse_channel, &buffer);
+    for (int time = 0; time < f.num_timesteps; ++time) {
+      for (int chan = 0; chan < f.coarse_channel_size; ++chan) {
+        REQUIRE(buffer.get(time, chan) ==
+                data[time * m.num_channels + coarse_channel * f.coarse_channel_size +
+                     chan]);
+      }
+    }
+  }
+
+  boost::filesystem::remove(filename);
+}
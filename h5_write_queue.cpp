@@ -0,0 +1,122 @@
+#include "h5_write_queue.h"
+
+#include "thread_util.h"
+
+using namespace std;
+
+H5WriteQueue::H5WriteQueue(size_t max_queued_bytes)
+  : max_queued_bytes(max_queued_bytes), stopped(false), num_pending_jobs(0),
+    queued_bytes(0), next_file_id(0) {
+  writer_thread = thread(&H5WriteQueue::runWriterThread, this);
+}
+
+H5WriteQueue::~H5WriteQueue() {
+  unique_lock<mutex> lock(m);
+  stopped = true;
+  lock.unlock();
+  cv.notify_all();
+  if (writer_thread.joinable()) {
+    writer_thread.join();
+  }
+}
+
+void H5WriteQueue::push(function<void()> run, size_t bytes) {
+  unique_lock<mutex> lock(m);
+  cv.wait(lock, [&] {
+    return error || queued_bytes == 0 || queued_bytes + bytes <= max_queued_bytes;
+  });
+  if (error) {
+    rethrow_exception(error);
+  }
+
+  Job job;
+  job.run = move(run);
+  job.bytes = bytes;
+  jobs.push(move(job));
+  ++num_pending_jobs;
+  queued_bytes += bytes;
+  lock.unlock();
+  cv.notify_all();
+}
+
+void H5WriteQueue::write(const string& filename, const FilterbankMetadata& metadata,
+                         const H5WriterOptions& options, vector<float> data) {
+  size_t bytes = data.size() * sizeof(float);
+  push([filename, metadata, options, data = move(data)]() {
+    H5Writer writer(filename, metadata, options);
+    writer.setData(data.data());
+    writer.close();
+  }, bytes);
+}
+
+int H5WriteQueue::openFile(const string& filename, const FilterbankMetadata& metadata,
+                           const H5WriterOptions& options) {
+  unique_lock<mutex> lock(m);
+  int file_id = next_file_id++;
+  lock.unlock();
+
+  push([this, file_id, filename, metadata, options]() {
+    open_files[file_id].reset(new H5Writer(filename, metadata, options));
+  }, 0);
+  return file_id;
+}
+
+void H5WriteQueue::append(int file_id, vector<float> data) {
+  size_t bytes = data.size() * sizeof(float);
+  push([this, file_id, data = move(data)]() {
+    H5Writer& writer = *open_files.at(file_id);
+    writer.appendData(data.data(), data.size() / writer.metadata.num_channels);
+  }, bytes);
+}
+
+void H5WriteQueue::closeFile(int file_id) {
+  push([this, file_id]() {
+    open_files.at(file_id)->close();
+    open_files.erase(file_id);
+  }, 0);
+}
+
+void H5WriteQueue::flush() {
+  unique_lock<mutex> lock(m);
+  cv.wait(lock, [&] { return error || num_pending_jobs == 0; });
+  if (error) {
+    rethrow_exception(error);
+  }
+}
+
+// Runs each queued job in order, until stopped and out of jobs
+void H5WriteQueue::runWriterThread() {
+  setThreadName("h5 writer");
+  while (true) {
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [&] { return stopped || !jobs.empty(); });
+    if (jobs.empty()) {
+      break;
+    }
+    Job job = move(jobs.front());
+    jobs.pop();
+    lock.unlock();
+
+    size_t bytes = job.bytes;
+    try {
+      job.run();
+    } catch (...) {
+      lock.lock();
+      error = current_exception();
+      lock.unlock();
+      cv.notify_all();
+      break;
+    }
+
+    // Free the memory before letting more data in
+    job.run = nullptr;
+    lock.lock();
+    --num_pending_jobs;
+    queued_bytes -= bytes;
+    lock.unlock();
+    cv.notify_all();
+  }
+
+  // Any files still open are closed here, so that hdf5 is only used on this thread
+  open_files.clear();
+}
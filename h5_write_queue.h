@@ -0,0 +1,93 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "filterbank_metadata.h"
+#include "h5_writer.h"
+
+using namespace std;
+
+/*
+  The H5WriteQueue writes h5 files on a background thread, so that the client code
+  can go on producing data while earlier data is compressed and written.
+
+  Call write() with the entire data for a file. Or, to write a file a few
+  timesteps at a time, call openFile() with extendible options, then append() each
+  time slice as it's produced, then closeFile(). Each of these returns as soon as
+  the work is queued, unless more than max_queued_bytes of data are already
+  waiting, in which case it waits for the writer thread to catch up. A single
+  piece of data larger than max_queued_bytes is still accepted when nothing else
+  is waiting.
+
+  Only the writer thread ever calls into the hdf5 library, since it isn't
+  threadsafe. So nothing else should use hdf5 while the H5WriteQueue exists.
+
+  If writing fails, the error is rethrown from the next call to any method here.
+  The destructor finishes writing anything that was queued, and closes any files
+  that are still open.
+ */
+class H5WriteQueue {
+ public:
+  const size_t max_queued_bytes;
+
+  H5WriteQueue(size_t max_queued_bytes);
+  ~H5WriteQueue();
+
+  // data must be formatted as row-major:
+  //   data[time][freq]
+  void write(const string& filename, const FilterbankMetadata& metadata,
+             const H5WriterOptions& options, vector<float> data);
+
+  // Returns an id to append to the file with
+  int openFile(const string& filename, const FilterbankMetadata& metadata,
+               const H5WriterOptions& options);
+
+  // data must be whole rows, in the same format as write()
+  void append(int file_id, vector<float> data);
+
+  void closeFile(int file_id);
+
+  // Waits until everything queued has been written
+  void flush();
+
+ private:
+  // A piece of work for the writer thread, which holds on to this many bytes of
+  // data until it runs
+  struct Job {
+    function<void()> run;
+    size_t bytes;
+  };
+
+  mutex m;
+  condition_variable cv;
+
+  // Set when no more jobs are coming
+  bool stopped;
+
+  queue<Job> jobs;
+
+  // The jobs that are queued or running right now, and the bytes of data they hold
+  int num_pending_jobs;
+  size_t queued_bytes;
+
+  // The first error in the writer thread, which stops it
+  exception_ptr error;
+
+  // The files opened with openFile. Only the writer thread uses these writers.
+  int next_file_id;
+  map<int, unique_ptr<H5Writer> > open_files;
+
+  thread writer_thread;
+
+  void push(function<void()> run, size_t bytes);
+
+  void runWriterThread();
+};
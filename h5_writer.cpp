@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fmt/core.h>
 #include "hdf5.h"
 #include <iostream>
@@ -7,27 +8,89 @@
 
 using namespace std;
 
-H5Writer::H5Writer(const string& filename, const FilterbankMetadata& metadata)
-  : filename(filename), metadata(metadata) {
+// Chunks much larger than this are slow to read a piece of
+const long MAX_CHUNK_BYTES = 16 << 20;
+
+H5WriterOptions compressedOptions(const FilterbankMetadata& metadata,
+                                  int deflate_level) {
+  H5WriterOptions options;
+  long row_bytes = metadata.coarse_channel_size * sizeof(float);
+  options.chunk_timesteps = max(1L, min(metadata.num_timesteps,
+                                        MAX_CHUNK_BYTES / row_bytes));
+  options.chunk_channels = metadata.coarse_channel_size;
+  options.deflate_level = deflate_level;
+  options.shuffle = deflate_level > 0;
+  return options;
+}
+
+H5Writer::H5Writer(const string& filename, const FilterbankMetadata& metadata,
+                   const H5WriterOptions& options)
+  : filename(filename), metadata(metadata), options(options), closed(false),
+    num_timesteps_written(0) {
+  bool chunked = options.chunk_timesteps > 0 && options.chunk_channels > 0;
+  if (!chunked && (options.deflate_level > 0 || options.shuffle)) {
+    fatal("cannot compress an h5 file without chunking it:", filename);
+  }
+  if (!chunked && options.extendible) {
+    fatal("cannot append to an h5 file without chunking it:", filename);
+  }
+  if (options.deflate_level < 0 || options.deflate_level > 9) {
+    fatal(fmt::format("invalid deflate level: {}", options.deflate_level));
+  }
+
+  // An extendible file is written in SWMR (single writer, multiple reader) mode,
+  // which needs the newer file format
+  hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+  if (options.extendible &&
+      H5Pset_libver_bounds(fapl, H5F_LIBVER_V110, H5F_LIBVER_LATEST) < 0) {
+    fatal("could not set the hdf5 file format version for", filename);
+  }
+
   // Deletes any already-existing file there
-  file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+  file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+  H5Pclose(fapl);
   if (file == H5I_INVALID_HID) {
     fatal("could not open file for writing:", filename);
   }
 
+  // An extendible dataset starts empty, and grows in time with each append
   hsize_t dims[3];
-  dims[0] = metadata.num_timesteps;
+  dims[0] = options.extendible ? 0 : metadata.num_timesteps;
   dims[1] = 1;
   dims[2] = metadata.num_channels;
-  dataspace = H5Screate_simple(3, dims, NULL);
+  hsize_t max_dims[3] = {dims[0], dims[1], dims[2]};
+  if (options.extendible) {
+    max_dims[0] = H5S_UNLIMITED;
+  }
+  dataspace = H5Screate_simple(3, dims, max_dims);
   if (dataspace == H5I_INVALID_HID) {
     fatal(fmt::format("could not create dataspace with dims {}, 1, {}",
                       dims[0], dims[2]));
   }
 
-  // For now, don't set chunking or use bitshuffle.
+  // Filters apply in the order they are added, so shuffle goes before deflate
+  hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+  if (chunked) {
+    hsize_t chunk_dims[3];
+    chunk_dims[0] = options.extendible ? options.chunk_timesteps :
+      min<hsize_t>(options.chunk_timesteps, max<hsize_t>(dims[0], 1));
+    chunk_dims[1] = 1;
+    chunk_dims[2] = min<hsize_t>(options.chunk_channels, max<hsize_t>(dims[2], 1));
+    if (H5Pset_chunk(plist, 3, chunk_dims) < 0) {
+      fatal(fmt::format("could not set chunk dims {}, 1, {}",
+                        chunk_dims[0], chunk_dims[2]));
+    }
+    if (options.shuffle && H5Pset_shuffle(plist) < 0) {
+      fatal("could not set the shuffle filter");
+    }
+    if (options.deflate_level > 0 && H5Pset_deflate(plist, options.deflate_level) < 0) {
+      fatal("could not set the deflate filter");
+    }
+  }
+
   dataset = H5Dcreate2(file, "data", H5T_NATIVE_FLOAT, dataspace,
-                       H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+                       H5P_DEFAULT, plist, H5P_DEFAULT);
+  H5Pclose(plist);
   if (dataset == H5I_INVALID_HID) {
     fatal(fmt::format("could not create dataset with num_timesteps {}, "
                       "num_channels {}, dims ({}, 1, {})",
@@ -45,6 +108,13 @@ H5Writer::H5Writer(const string& filename, const FilterbankMetadata& metadata)
   setStringAttr("source_name", metadata.source_name);
   setLongAttr("telescope_id", metadata.telescope_id);
   setLongAttr("nfpc", metadata.coarse_channel_size);
+
+  // Nothing new can be created in SWMR mode, so this waits until every attribute
+  // is written. From here on, other processes can open the file with
+  // H5F_ACC_SWMR_READ and read whatever has been appended.
+  if (options.extendible && H5Fstart_swmr_write(file) < 0) {
+    fatal("could not start SWMR writing to", filename);
+  }
 }
 
 H5Writer::~H5Writer() {
@@ -52,12 +122,49 @@ H5Writer::~H5Writer() {
 }
 
 void H5Writer::setData(const float* data) {
+  if (options.extendible) {
+    fatal("use appendData rather than setData to write to an extendible h5 file:",
+          filename);
+  }
   auto status = H5Dwrite(dataset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, data);
   if (status < 0) {
     fatal("hdf5 data write failed");
   }
 }
 
+void H5Writer::appendData(const float* data, int num_timesteps) {
+  if (!options.extendible) {
+    fatal("cannot append to an h5 file that was not created extendible:", filename);
+  }
+
+  hsize_t dims[3];
+  dims[0] = num_timesteps_written + num_timesteps;
+  dims[1] = 1;
+  dims[2] = metadata.num_channels;
+  if (H5Dset_extent(dataset, dims) < 0) {
+    fatal(fmt::format("could not extend {} to {} timesteps", filename, dims[0]));
+  }
+
+  hid_t file_space = H5Dget_space(dataset);
+  hsize_t start[3] = {hsize_t(num_timesteps_written), 0, 0};
+  hsize_t count[3] = {hsize_t(num_timesteps), 1, dims[2]};
+  H5Sselect_hyperslab(file_space, H5S_SELECT_SET, start, NULL, count, NULL);
+  hid_t memory_space = H5Screate_simple(3, count, NULL);
+  auto status = H5Dwrite(dataset, H5T_NATIVE_FLOAT, memory_space, file_space,
+                         H5P_DEFAULT, data);
+  H5Sclose(memory_space);
+  H5Sclose(file_space);
+  if (status < 0) {
+    fatal("hdf5 data append failed");
+  }
+  num_timesteps_written += num_timesteps;
+
+  // Flush, so that SWMR readers can see what has been written so far
+  if (H5Dflush(dataset) < 0) {
+    fatal("could not flush", filename);
+  }
+}
+
 void H5Writer::close() {
   if (closed) {
     return;
@@ -6,25 +6,62 @@
 
 using namespace std;
 
+/*
+  How the H5Writer lays out the data on disk.
+  By default the dataset is contiguous and uncompressed.
+ */
+struct H5WriterOptions {
+  // The chunk shape, in timesteps and channels. If either is zero, the dataset is
+  // stored contiguously instead.
+  int chunk_timesteps = 0;
+  int chunk_channels = 0;
+
+  // Zero for no compression, up to 9 for the most. Compression requires chunks.
+  int deflate_level = 0;
+
+  // Whether to shuffle the bytes of each chunk before compressing it, which
+  // usually makes floating point data compress better
+  bool shuffle = false;
+
+  // Whether the data is written a few timesteps at a time with appendData, rather
+  // than all at once. The file ends up with however many timesteps were appended,
+  // whatever the metadata says. This requires chunks.
+  bool extendible = false;
+};
+
+// Chunks of one coarse channel each, compressed with shuffle and deflate.
+// This is the layout that H5Reader reads fastest, one coarse channel at a time.
+H5WriterOptions compressedOptions(const FilterbankMetadata& metadata,
+                                  int deflate_level);
 
 class H5Writer{
  public:
   const string filename;
   const FilterbankMetadata metadata;
+  const H5WriterOptions options;
   bool closed;
-  
+
   H5Writer(const string& filename,
-           const FilterbankMetadata& metadata);
+           const FilterbankMetadata& metadata,
+           const H5WriterOptions& options = H5WriterOptions());
   ~H5Writer();
 
   // data must be formatted as row-major:
   //   data[time][freq]
   void setData(const float* data);
-  
+
+  // For an extendible file, writes the next num_timesteps rows, in the same
+  // format as setData.
+  // Extendible files are written in SWMR mode, and each append is flushed, so
+  // another process that opens the file with H5F_ACC_SWMR_READ can read the rows
+  // appended so far while it is still being written. H5Reader opens files this way.
+  void appendData(const float* data, int num_timesteps);
+
   void close();
-  
+
  private:
   hid_t file, dataset, dataspace;
+  long num_timesteps_written;
 
   void setAttr(const string& name, hid_t type, const void* value);
   void setDoubleAttr(const string& name, double value);
@@ -1,12 +1,16 @@
 #include <assert.h>
+#ifndef SETICORE_CPU_ONLY
 #include "beamforming_pipeline.h"
+#endif
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/program_options.hpp>
 #include <exception>
 #include <fmt/core.h>
 #include <iostream>
+#ifndef SETICORE_CPU_ONLY
 #include "raw_file_group.h"
+#endif
 #include "run_dedoppler.h"
 #include <string>
 #include "thread_util.h"
@@ -18,6 +22,10 @@ using namespace std;
 namespace po = boost::program_options;
 
 int beamformingMode(const po::variables_map& vm) {
+#ifdef SETICORE_CPU_ONLY
+  fatal("this seticore was built without CUDA, so it cannot beamform");
+  return 1;
+#else
   string input_dir = vm["input"].as<string>();
   string output_dir = vm["output"].as<string>();
 
@@ -48,6 +56,11 @@ int beamformingMode(const po::variables_map& vm) {
   int fft_size = vm["fft_size"].as<int>();
   int num_fine_channels = vm["fine_channels"].as<int>();
   
+  int h5_deflate_level = vm["h5_deflate"].as<int>();
+  if (h5_deflate_level < 0 || h5_deflate_level > 9) {
+    fatal("--h5_deflate must be between 0 and 9");
+  }
+
   if (vm.count("min_drift")) {
     cout << "the min_drift flag is ignored in beamforming mode.\n";
   }
@@ -61,6 +74,8 @@ int beamformingMode(const po::variables_map& vm) {
     if (vm.count("h5_dir")) {
       pipeline.h5_dir = vm["h5_dir"].as<string>();
     }
+    pipeline.h5_deflate_level = h5_deflate_level;
+    pipeline.max_hits = vm["max_hits"].as<int>();
     int tstart = time(NULL);
     pipeline.findHits();
     int tmid = time(NULL);
@@ -70,6 +85,7 @@ int beamformingMode(const po::variables_map& vm) {
     cout << fmt::format("time to make stamps: {:d}s\n", tstop - tmid);
   }
   return 0;
+#endif
 }
 
 int dedopplerMode(const po::variables_map& vm) {
@@ -90,14 +106,51 @@ int dedopplerMode(const po::variables_map& vm) {
   double max_drift = vm["max_drift"].as<double>();
   double snr = vm["snr"].as<double>();
   double min_drift = vm.count("min_drift") ? vm["min_drift"].as<double>() : 0.0;
+  int num_threads = vm["threads"].as<int>();
+  if (num_threads < 1) {
+    fatal("--threads must be at least 1");
+  }
+  bool prune = vm["prune"].as<bool>();
+  int max_hits = vm["max_hits"].as<int>();
+  bool hierarchical = vm["hierarchical"].as<bool>();
+  string storage_format_name = vm["storage_format"].as<string>();
+  StorageFormat storage_format = STORAGE_FP32;
+  if (storage_format_name == "fp16") {
+    storage_format = STORAGE_FP16;
+  } else if (storage_format_name == "bf16") {
+    storage_format = STORAGE_BF16;
+  } else if (storage_format_name != "fp32") {
+    fatal("--storage_format must be fp32, fp16, or bf16, not", storage_format_name);
+  }
+
+  if (vm.count("top_paths")) {
+    string top_paths = vm["top_paths"].as<string>();
+    cout << "rethresholding the top paths in " << top_paths << " for " << input << endl;
+    cout << fmt::format("rethreshold parameters: min_drift={:.4f} snr={:.2f}{}\n",
+                        min_drift, snr,
+                        max_hits > 0 ? fmt::format(" max_hits={}", max_hits) : "");
+    cout << "writing output to " << output << endl;
+    rethresholdDedoppler(input, top_paths, output, min_drift, snr, max_hits);
+    return 0;
+  }
+  string save_top_paths = vm.count("save_top_paths") ?
+    vm["save_top_paths"].as<string>() : "";
 
   cout << "loading input from " << input << endl;
   cout << fmt::format("dedoppler parameters: max_drift={:.2f} min_drift={:.4f} "
-                      "snr={:.2f}\n",
-                      max_drift, min_drift, snr);
+                      "snr={:.2f} threads={}{}{}{}{}\n",
+                      max_drift, min_drift, snr, num_threads, prune ? " prune" : "",
+                      max_hits > 0 ? fmt::format(" max_hits={}", max_hits) : "",
+                      hierarchical ? " hierarchical" : "",
+                      storage_format == STORAGE_FP32 ? "" :
+                      " storage_format=" + storageFormatName(storage_format));
   cout << "writing output to " << output << endl;
+  if (!save_top_paths.empty()) {
+    cout << "saving top paths to " << save_top_paths << endl;
+  }
   int tstart = time(NULL);
-  runDedoppler(input, output, max_drift, min_drift, snr);
+  runDedoppler(input, output, max_drift, min_drift, snr, num_threads, prune,
+               max_hits, hierarchical, storage_format, save_top_paths);
   int tstop = time(NULL);
   cerr << fmt::format("dedoppler elapsed time: {:d}s\n", tstop - tstart);
   return 0;
@@ -126,6 +179,33 @@ int main(int argc, char* argv[]) {
       ("snr,s", po::value<double>()->default_value(25.0),
        "minimum SNR to report a hit")
 
+      ("threads", po::value<int>()->default_value(1),
+       "how many coarse channels to dedoppler at once")
+
+      ("prune", po::bool_switch(),
+       "skip searching drift blocks and frequency ranges that can't reach the SNR "
+       "threshold. only works on the CPU")
+
+      ("max_hits", po::value<int>()->default_value(0),
+       "only keep this many hits for each coarse channel and beam, the strongest "
+       "ones. 0 for no limit")
+
+      ("hierarchical", po::bool_switch(),
+       "search drift rates above two channels per timestep on frequency-scrunched "
+       "data. much faster for large max_drift, but less sensitive to fast drifts")
+
+      ("storage_format", po::value<string>()->default_value("fp32"),
+       "how to store intermediate Taylor sums: fp32, or fp16 or bf16 to use half the "
+       "memory at some cost in precision. only works on the CPU")
+
+      ("save_top_paths", po::value<string>(),
+       "also save the top path for each frequency to this file, so that --top_paths "
+       "can find hits for a different snr later")
+
+      ("top_paths", po::value<string>(),
+       "find hits from top paths saved by --save_top_paths for this input, instead "
+       "of searching. uses the saved max_drift")
+
       ("recipe_dir", po::value<string>(),
        "the directory to find beamforming recipes in. set this to beamform.")
 
@@ -134,6 +214,9 @@ int main(int argc, char* argv[]) {
     
       ("h5_dir", po::value<string>(),
        "optional directory to save .h5 files containing post-beamform data")
+
+      ("h5_deflate", po::value<int>()->default_value(0),
+       "how much to compress the files saved to --h5_dir, from 0 for not at all to 9")
     
       ("num_bands", po::value<int>()->default_value(1),
        "number of bands to break input into")
@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <fmt/core.h>
+#include <iostream>
+#include <math.h>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "noise_estimator.h"
+#include "util.h"
+
+using namespace std;
+
+/*
+  The way Dedopplerer::search used to estimate noise, with three partial sorts.
+  This reorders column_sums.
+ */
+void nthElementNoise(float* column_sums, int num_sums, float* median, float* std_dev) {
+  int mid = num_sums / 2;
+  auto column_sums_end = column_sums + num_sums;
+  std::nth_element(column_sums, column_sums + mid, column_sums_end);
+  int first = ceil(0.05 * num_sums);
+  int last = floor(0.95 * num_sums);
+  std::nth_element(column_sums, column_sums + first, column_sums + mid - 1);
+  std::nth_element(column_sums + mid + 1, column_sums + last, column_sums_end);
+  *median = column_sums[mid];
+  float sum = std::accumulate(column_sums + first, column_sums + last + 1, 0.0);
+  float m = sum / (last + 1 - first);
+  float accum = 0.0;
+  std::for_each(column_sums + first, column_sums + last + 1,
+                [&](const float f) {
+                  accum += (f - m) * (f - m);
+                });
+  *std_dev = sqrt(accum / (last + 1 - first));
+}
+
+/*
+  Performance testing the noise estimate for a coarse channel of column sums.
+ */
+int main(int argc, char* argv[]) {
+  const int num_channels = 1 << 20;
+  const int num_trials = 50;
+  mt19937 rng(42);
+  normal_distribution<float> noise(16384.0, 128.0);
+  vector<float> column_sums(num_channels);
+  for (float& v : column_sums) {
+    v = noise(rng);
+  }
+  vector<float> scratch(num_channels);
+  float median, std_dev;
+
+  long start = timeInMS();
+  for (int i = 0; i < num_trials; ++i) {
+    copy(column_sums.begin(), column_sums.end(), scratch.begin());
+    nthElementNoise(scratch.data(), num_channels, &median, &std_dev);
+  }
+  long end = timeInMS();
+  cout << fmt::format("nth_element: median {:.3f}, std dev {:.3f}, "
+                      "{:.2f} ms per channel\n", median, std_dev,
+                      (double) (end - start) / num_trials);
+
+  NoiseEstimator estimator;
+  start = timeInMS();
+  for (int i = 0; i < num_trials; ++i) {
+    estimator.estimate(column_sums.data(), num_channels, &median, &std_dev);
+  }
+  end = timeInMS();
+  cout << fmt::format("NoiseEstimator: median {:.3f}, std dev {:.3f}, "
+                      "{:.2f} ms per channel\n", median, std_dev,
+                      (double) (end - start) / num_trials);
+
+  for (int subband_size : {1 << 12, 1 << 16}) {
+    vector<float> medians(num_channels / subband_size);
+    vector<float> std_devs(num_channels / subband_size);
+    start = timeInMS();
+    for (int i = 0; i < num_trials; ++i) {
+      estimator.estimateSubbands(column_sums.data(), num_channels, subband_size,
+                                 medians.data(), std_devs.data());
+    }
+    end = timeInMS();
+    cout << fmt::format("NoiseEstimator with {} subbands: {:.2f} ms per channel\n",
+                        medians.size(), (double) (end - start) / num_trials);
+  }
+}
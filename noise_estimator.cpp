@@ -0,0 +1,245 @@
+#include "noise_estimator.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+using namespace std;
+
+// The low FINE_BITS of the sort key pick a fine bucket, and the bits above that
+// pick a coarse bucket. Only NUM_COARSE coarse buckets around the median get
+// their own counters, which still covers 16 powers of two either side of it.
+const int FINE_BITS = 12;
+const int NUM_FINE = 1 << FINE_BITS;
+const uint32_t FINE_MASK = NUM_FINE - 1;
+const int NUM_COARSE = 1 << 16;
+
+// How many values to sample to pick a shift for the sums
+const int MAX_SAMPLE_SIZE = 1024;
+
+// Below this size, clearing the histograms costs more than a partial sort
+const int MIN_HISTOGRAM_VALUES = 1 << 16;
+
+/*
+  Maps a float to an unsigned int with the same ordering.
+  Positive floats just need their sign bit set, and negative floats need all
+  their bits flipped.
+ */
+static inline uint32_t sortKey(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  uint32_t mask = ((uint32_t) -(int32_t) (bits >> 31)) | 0x80000000;
+  return bits ^ mask;
+}
+
+static inline float fromSortKey(uint32_t key) {
+  uint32_t bits = (key & 0x80000000) ? (key ^ 0x80000000) : ~key;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+/*
+  The ranks, in sorted order, of the median and of the first and last values of
+  the central 90%.
+ */
+static void quantileRanks(int num_values, int* first, int* mid, int* last) {
+  *mid = num_values / 2;
+  *first = ceil(0.05 * num_values);
+  *last = floor(0.95 * num_values);
+  if (*last < *first) {
+    // Too few values to trim anything
+    *first = *mid;
+    *last = *mid;
+  }
+}
+
+/*
+  Calculates the standard deviation from the sum and sum of squares of
+  (value - shift) over count values.
+  Shifting by something close to the median keeps the subtraction from losing
+  precision.
+ */
+static float shiftedStdDev(double sum, double sum_squares, long count) {
+  double mean = sum / count;
+  double variance = sum_squares / count - mean * mean;
+  return sqrt(max(variance, 0.0));
+}
+
+NoiseEstimator::NoiseEstimator() {}
+
+void NoiseEstimator::estimate(const float* values, int num_values, float* median,
+                              float* std_dev) {
+  assert(num_values > 0);
+  if (num_values < MIN_HISTOGRAM_VALUES) {
+    partialSortEstimate(values, num_values, median, std_dev);
+  } else {
+    histogramEstimate(values, num_values, median, std_dev);
+  }
+}
+
+void NoiseEstimator::estimateSubbands(const float* values, int num_values,
+                                      int subband_size, float* medians,
+                                      float* std_devs) {
+  assert(subband_size > 0);
+  for (int i = 0; i * (long) subband_size < num_values; ++i) {
+    long start = (long) i * subband_size;
+    int size = min((long) subband_size, num_values - start);
+    estimate(values + start, size, medians + i, std_devs + i);
+  }
+}
+
+void NoiseEstimator::partialSortEstimate(const float* values, int num_values,
+                                         float* median, float* std_dev) {
+  int first, mid, last;
+  quantileRanks(num_values, &first, &mid, &last);
+
+  // We don't need a full sort, just the 5th, 50th, and 95th percentiles
+  scratch.assign(values, values + num_values);
+  auto begin = scratch.begin();
+  nth_element(begin, begin + mid, scratch.end());
+  if (first < mid) {
+    nth_element(begin, begin + first, begin + mid);
+  }
+  if (last > mid) {
+    nth_element(begin + mid + 1, begin + last, scratch.end());
+  }
+  *median = scratch[mid];
+
+  double sum = 0.0;
+  double sum_squares = 0.0;
+  for (int i = first; i <= last; ++i) {
+    double delta = scratch[i] - (double) *median;
+    sum += delta;
+    sum_squares += delta * delta;
+  }
+  *std_dev = shiftedStdDev(sum, sum_squares, last + 1 - first);
+}
+
+void NoiseEstimator::histogramEstimate(const float* values, int num_values,
+                                       float* median, float* std_dev) {
+  int first, mid, last;
+  quantileRanks(num_values, &first, &mid, &last);
+
+  // Center the coarse buckets on the median of a sample, which should be close
+  // to the real median. Summing differences from it also keeps the sums precise.
+  int sample_stride = max(1, num_values / MAX_SAMPLE_SIZE);
+  scratch.clear();
+  for (int i = 0; i < num_values; i += sample_stride) {
+    scratch.push_back(values[i]);
+  }
+  nth_element(scratch.begin(), scratch.begin() + scratch.size() / 2, scratch.end());
+  float shift = scratch[scratch.size() / 2];
+  long coarse_base = (long) (sortKey(shift) >> FINE_BITS) - NUM_COARSE / 2;
+
+  // Values beyond the range of the coarse buckets get lumped into the end ones
+  auto coarseBucket = [&](uint32_t key) {
+    long bucket = (long) (key >> FINE_BITS) - coarse_base;
+    return (int) min(max(bucket, 0L), (long) NUM_COARSE - 1);
+  };
+
+  // The first pass counts values by coarse bucket, and adds them up
+  coarse_counts.assign(NUM_COARSE, 0);
+  coarse_sums.assign(NUM_COARSE, 0.0);
+  coarse_squares.assign(NUM_COARSE, 0.0);
+  for (int i = 0; i < num_values; ++i) {
+    int bucket = coarseBucket(sortKey(values[i]));
+    double delta = values[i] - (double) shift;
+    ++coarse_counts[bucket];
+    coarse_sums[bucket] += delta;
+    coarse_squares[bucket] += delta * delta;
+  }
+
+  // Find the coarse bucket that holds each quantile, and how many values come
+  // before that bucket
+  int ranks[3] = {first, mid, last};
+  int buckets[3];
+  long bases[3];
+  long seen = 0;
+  int quantile = 0;
+  for (int bucket = 0; bucket < NUM_COARSE && quantile < 3; ++bucket) {
+    long next = seen + coarse_counts[bucket];
+    while (quantile < 3 && ranks[quantile] < next) {
+      buckets[quantile] = bucket;
+      bases[quantile] = seen;
+      ++quantile;
+    }
+    seen = next;
+  }
+  assert(quantile == 3);
+  int first_bucket = buckets[0];
+  int mid_bucket = buckets[1];
+  int last_bucket = buckets[2];
+  if (first_bucket == 0 || last_bucket == NUM_COARSE - 1) {
+    // The values are spread too widely for the coarse buckets to resolve them
+    partialSortEstimate(values, num_values, median, std_dev);
+    return;
+  }
+
+  // Values in buckets strictly between the first and last quantiles are all in
+  // the central 90%
+  double sum = 0.0;
+  double sum_squares = 0.0;
+  for (int bucket = first_bucket + 1; bucket < last_bucket; ++bucket) {
+    sum += coarse_sums[bucket];
+    sum_squares += coarse_squares[bucket];
+  }
+
+  // The second pass makes a fine histogram for each quantile's bucket.
+  // Quantiles that share a bucket share a histogram.
+  fine_counts.assign(3 * NUM_FINE, 0);
+  int mid_slot = (mid_bucket == first_bucket) ? 0 : 1;
+  int last_slot = (last_bucket == mid_bucket) ? mid_slot : 2;
+  for (int i = 0; i < num_values; ++i) {
+    uint32_t key = sortKey(values[i]);
+    int bucket = coarseBucket(key);
+    int slot = -1;
+    slot = (bucket == last_bucket) ? last_slot : slot;
+    slot = (bucket == mid_bucket) ? mid_slot : slot;
+    slot = (bucket == first_bucket) ? 0 : slot;
+    if (slot >= 0) {
+      ++fine_counts[(slot << FINE_BITS) | (key & FINE_MASK)];
+    }
+  }
+  const uint32_t* fine_first = fine_counts.data();
+  const uint32_t* fine_mid = fine_first + (mid_slot << FINE_BITS);
+  const uint32_t* fine_last = fine_first + (last_slot << FINE_BITS);
+
+  // Each fine bucket holds copies of a single value
+  auto fineValue = [&](int bucket, uint32_t low) {
+    return fromSortKey((uint32_t) ((bucket + coarse_base) << FINE_BITS) | low);
+  };
+  seen = bases[1];
+  for (uint32_t low = 0; low < (uint32_t) NUM_FINE; ++low) {
+    seen += fine_mid[low];
+    if (mid < seen) {
+      *median = fineValue(mid_bucket, low);
+      break;
+    }
+  }
+
+  // Add in the values of the first and last buckets that are in the central 90%
+  auto addCentralValues = [&](int bucket, const uint32_t* counts, long base) {
+    long seen = base;
+    for (uint32_t low = 0; low < (uint32_t) NUM_FINE; ++low) {
+      if (counts[low] == 0) {
+        continue;
+      }
+      long lo = max(seen, (long) first);
+      long hi = min(seen + counts[low] - 1, (long) last);
+      if (lo <= hi) {
+        double delta = fineValue(bucket, low) - (double) shift;
+        sum += (hi + 1 - lo) * delta;
+        sum_squares += (hi + 1 - lo) * delta * delta;
+      }
+      seen += counts[low];
+    }
+  };
+  addCentralValues(first_bucket, fine_first, bases[0]);
+  if (last_bucket != first_bucket) {
+    addCentralValues(last_bucket, fine_last, bases[2]);
+  }
+
+  *std_dev = shiftedStdDev(sum, sum_squares, last + 1 - first);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/*
+  The NoiseEstimator calculates the robust noise statistics that dedoppler search
+  uses to set its threshold: the median, and the standard deviation of the
+  central 90% of the values. A few bright signals should not affect these much.
+
+  This gives the same order statistics as a partial sort, but for large inputs
+  it finds them by radix selection instead. Each float maps to an integer sort
+  key. One pass over the data counts and sums up the values by the high bits of
+  their keys, which pins down the coarse buckets that hold the quantiles. A
+  second pass makes a histogram of the low bits within those buckets, which
+  resolves the quantiles exactly. Neither pass reorders the input.
+
+  The histograms are kept around between calls, so reuse a NoiseEstimator rather
+  than making a new one for each coarse channel.
+ */
+class NoiseEstimator {
+public:
+  NoiseEstimator();
+
+  // Calculates the statistics of num_values values.
+  void estimate(const float* values, int num_values, float* median, float* std_dev);
+
+  // Calculates separate statistics for each subband of subband_size values.
+  // The last subband gets whatever is left over, so there are
+  // ceil(num_values / subband_size) outputs.
+  void estimateSubbands(const float* values, int num_values, int subband_size,
+                        float* medians, float* std_devs);
+
+private:
+  // Counts of values by the high bits of their sort key, and the sums of
+  // their differences from a shift, and of the squares of those differences
+  vector<uint32_t> coarse_counts;
+  vector<double> coarse_sums;
+  vector<double> coarse_squares;
+
+  // Counts of values by the low bits of their sort key, for up to three
+  // coarse buckets
+  vector<uint32_t> fine_counts;
+
+  // A copy of the input for inputs small enough to just partially sort, or a
+  // sample of it for larger inputs
+  vector<float> scratch;
+
+  void histogramEstimate(const float* values, int num_values, float* median,
+                         float* std_dev);
+  void partialSortEstimate(const float* values, int num_values, float* median,
+                           float* std_dev);
+};
@@ -0,0 +1,109 @@
+#include "catch/catch.hpp"
+#include <algorithm>
+#include <math.h>
+#include <random>
+#include <vector>
+
+#include "noise_estimator.h"
+
+using namespace std;
+
+// The statistics from a full sort
+static void sortedNoise(const float* values, int num_values, float* median,
+                        double* std_dev) {
+  vector<float> sorted(values, values + num_values);
+  sort(sorted.begin(), sorted.end());
+  int mid = num_values / 2;
+  int first = ceil(0.05 * num_values);
+  int last = floor(0.95 * num_values);
+  if (last < first) {
+    first = mid;
+    last = mid;
+  }
+  *median = sorted[mid];
+  double mean = 0.0;
+  for (int i = first; i <= last; ++i) {
+    mean += sorted[i];
+  }
+  mean /= last + 1 - first;
+  double accum = 0.0;
+  for (int i = first; i <= last; ++i) {
+    accum += (sorted[i] - mean) * (sorted[i] - mean);
+  }
+  *std_dev = sqrt(accum / (last + 1 - first));
+}
+
+static void requireSortedNoise(NoiseEstimator& estimator, const vector<float>& values) {
+  float expected_median;
+  double expected_std_dev;
+  sortedNoise(values.data(), values.size(), &expected_median, &expected_std_dev);
+  float median, std_dev;
+  estimator.estimate(values.data(), values.size(), &median, &std_dev);
+  REQUIRE(median == expected_median);
+  REQUIRE(std_dev == Approx(expected_std_dev).epsilon(1e-5).margin(1e-6));
+}
+
+TEST_CASE("noise estimate matches a full sort", "[noise]") {
+  NoiseEstimator estimator;
+  mt19937 rng(42);
+  normal_distribution<float> noise(500.0, 20.0);
+
+  // Small inputs get partially sorted, large ones use the histogram
+  for (int num_values : {1, 2, 3, 20, 1000, 65535, 65536, 100003, 1 << 20}) {
+    vector<float> values(num_values);
+    for (float& v : values) {
+      v = noise(rng);
+    }
+
+    // A few bright signals
+    for (int i = 0; i < num_values; i += 9973) {
+      values[i] = 1e6;
+    }
+    requireSortedNoise(estimator, values);
+
+    // Negative values order differently as bits
+    for (float& v : values) {
+      v -= 500.0;
+    }
+    requireSortedNoise(estimator, values);
+
+    // Lots of ties
+    for (float& v : values) {
+      v = round(v / 10.0);
+    }
+    requireSortedNoise(estimator, values);
+  }
+
+  vector<float> constant(200000, 3.0);
+  requireSortedNoise(estimator, constant);
+
+  // Spread over too many powers of two for the histogram to resolve
+  vector<float> spread(200000);
+  for (int i = 0; i < (int) spread.size(); ++i) {
+    spread[i] = pow(2.0, (i * 7919) % 200 - 100.0);
+  }
+  requireSortedNoise(estimator, spread);
+}
+
+TEST_CASE("subband noise estimates", "[noise]") {
+  NoiseEstimator estimator;
+  int num_values = 1000;
+  int subband_size = 300;
+  vector<float> values(num_values);
+  for (int i = 0; i < num_values; ++i) {
+    // Each subband has its own level
+    values[i] = 100 * (i / subband_size) + (i * 37) % 11;
+  }
+  vector<float> medians(4), std_devs(4);
+  estimator.estimateSubbands(values.data(), num_values, subband_size, medians.data(),
+                             std_devs.data());
+  for (int i = 0; i < 4; ++i) {
+    int start = i * subband_size;
+    int size = min(subband_size, num_values - start);
+    float expected_median;
+    double expected_std_dev;
+    sortedNoise(values.data() + start, size, &expected_median, &expected_std_dev);
+    REQUIRE(medians[i] == expected_median);
+    REQUIRE(std_devs[i] == Approx(expected_std_dev).epsilon(1e-5));
+  }
+}
@@ -0,0 +1,111 @@
+#include "prefetching_reader.h"
+
+#include <assert.h>
+
+#include "thread_util.h"
+
+using namespace std;
+
+PrefetchingReader::PrefetchingReader(const FilterbankFileReader& file,
+                                     int buffer_timesteps, int num_buffers)
+  : file(file), buffer_timesteps(buffer_timesteps), num_buffers(num_buffers),
+    stopped(false), done(false), num_buffers_created(0), next_to_read(0) {
+  assert(buffer_timesteps >= file.num_timesteps);
+  assert(num_buffers >= 1);
+  io_thread = thread(&PrefetchingReader::runInputThread, this);
+}
+
+PrefetchingReader::~PrefetchingReader() {
+  stop();
+  if (io_thread.joinable()) {
+    io_thread.join();
+  }
+}
+
+void PrefetchingReader::stop() {
+  unique_lock<mutex> lock(m);
+  stopped = true;
+  lock.unlock();
+  cv.notify_all();
+}
+
+unique_ptr<FilterbankBuffer> PrefetchingReader::read(int* coarse_channel) {
+  unique_lock<mutex> lock(m);
+  while (!stopped && !error && !done && buffer_queue.empty()) {
+    cv.wait(lock);
+  }
+
+  if (error) {
+    rethrow_exception(error);
+  }
+  if (stopped || buffer_queue.empty()) {
+    return nullptr;
+  }
+
+  auto buffer = move(buffer_queue.front());
+  buffer_queue.pop();
+  *coarse_channel = next_to_read++;
+  return buffer;
+}
+
+void PrefetchingReader::returnBuffer(unique_ptr<FilterbankBuffer> buffer) {
+  if (buffer.get() == nullptr) {
+    return;
+  }
+  unique_lock<mutex> lock(m);
+  extra_buffers.push(move(buffer));
+  lock.unlock();
+  cv.notify_all();
+}
+
+unique_ptr<FilterbankBuffer> PrefetchingReader::makeBuffer() {
+  unique_lock<mutex> lock(m);
+  while (!stopped && extra_buffers.empty() && num_buffers_created >= num_buffers) {
+    cv.wait(lock);
+  }
+
+  if (stopped) {
+    return nullptr;
+  }
+  if (!extra_buffers.empty()) {
+    auto buffer = move(extra_buffers.front());
+    extra_buffers.pop();
+    return buffer;
+  }
+  ++num_buffers_created;
+  lock.unlock();
+
+  return make_unique<FilterbankBuffer>(buffer_timesteps, file.coarse_channel_size);
+}
+
+// Loads every coarse channel and passes it to the buffer_queue
+void PrefetchingReader::runInputThread() {
+  setThreadName("prefetch");
+  for (int coarse_channel = 0; coarse_channel < file.num_coarse_channels;
+       ++coarse_channel) {
+    auto buffer = makeBuffer();
+    if (!buffer) {
+      return;
+    }
+
+    try {
+      file.loadCoarseChannel(coarse_channel, buffer.get());
+    } catch (...) {
+      unique_lock<mutex> lock(m);
+      error = current_exception();
+      lock.unlock();
+      cv.notify_all();
+      return;
+    }
+
+    unique_lock<mutex> lock(m);
+    buffer_queue.push(move(buffer));
+    lock.unlock();
+    cv.notify_all();
+  }
+
+  unique_lock<mutex> lock(m);
+  done = true;
+  lock.unlock();
+  cv.notify_all();
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+#include "filterbank_buffer.h"
+#include "filterbank_file_reader.h"
+
+using namespace std;
+
+/*
+  The PrefetchingReader loads every coarse channel of a FilterbankFileReader, in
+  order, on a background thread. So the disk reads and decompression for the next
+  coarse channel can happen while the client code is searching this one.
+
+  Call read() to get the next coarse channel, and when you're done with it, call
+  returnBuffer() so that its memory can be reused for a later coarse channel.
+  read() and returnBuffer() are threadsafe, so several threads can each work on
+  their own coarse channels.
+
+  The input thread loads up to num_buffers coarse channels ahead of the ones that
+  have been returned, so that many buffers of memory get used.
+
+  Only the input thread ever calls loadCoarseChannel, so the file itself doesn't
+  need to be threadsafe. This matters for hdf5, which isn't. While the
+  PrefetchingReader exists, nothing else should use the file.
+ */
+class PrefetchingReader {
+ public:
+  const FilterbankFileReader& file;
+
+  // Each buffer has this many rows, and rows past the end of the file are zeroed
+  const int buffer_timesteps;
+
+  const int num_buffers;
+
+  PrefetchingReader(const FilterbankFileReader& file, int buffer_timesteps,
+                    int num_buffers);
+  ~PrefetchingReader();
+
+  // Returns the next coarse channel, and sets *coarse_channel to its index.
+  // Returns nullptr once every coarse channel has been read, or after stop().
+  // If loading fails, this rethrows the error.
+  unique_ptr<FilterbankBuffer> read(int* coarse_channel);
+
+  void returnBuffer(unique_ptr<FilterbankBuffer> buffer);
+
+  // Stops loading, and makes any subsequent read return nullptr
+  void stop();
+
+ private:
+  mutex m;
+  condition_variable cv;
+  bool stopped;
+
+  // Whether the input thread has loaded every coarse channel
+  bool done;
+
+  // The first error in the input thread, rethrown to readers
+  exception_ptr error;
+
+  int num_buffers_created;
+
+  // The index of the coarse channel at the front of buffer_queue
+  int next_to_read;
+
+  // Buffers that contain coarse channels, in order, ready to be read
+  queue<unique_ptr<FilterbankBuffer> > buffer_queue;
+
+  // Buffers that contain nothing useful
+  queue<unique_ptr<FilterbankBuffer> > extra_buffers;
+
+  thread io_thread;
+
+  // Waits for a buffer to load into. Returns nullptr if the reader is stopped first.
+  unique_ptr<FilterbankBuffer> makeBuffer();
+
+  void runInputThread();
+};
@@ -0,0 +1,68 @@
+#include "catch/catch.hpp"
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <mutex>
+#include <thread>
+
+#include "filterbank_buffer.h"
+#include "h5_reader.h"
+#include "prefetching_reader.h"
+#include "test_util.h"
+
+TEST_CASE("prefetching reader delivers every coarse channel in order",
+          "[prefetching_reader]") {
+  string filename = testFilename("prefetching.h5");
+  writeTestH5(filename, testMetadata(6, 10, 8));
+
+  // Load everything the usual way first, since the file can't be used while a
+  // PrefetchingReader is reading it
+  H5Reader file(filename);
+  int buffer_timesteps = 8;
+  vector<vector<float> > expected;
+  for (int i = 0; i < file.num_coarse_channels; ++i) {
+    FilterbankBuffer buffer(buffer_timesteps, file.coarse_channel_size);
+    file.loadCoarseChannel(i, &buffer);
+    expected.emplace_back(buffer.data, buffer.data + buffer.size);
+  }
+
+  for (int num_threads = 1; num_threads <= 3; ++num_threads) {
+    PrefetchingReader reader(file, buffer_timesteps, num_threads + 1);
+    mutex seen_mutex;
+    vector<int> seen;
+    bool matched = true;
+    vector<thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&]() {
+        while (true) {
+          int coarse_channel;
+          auto buffer = reader.read(&coarse_channel);
+          if (!buffer) {
+            return;
+          }
+          vector<float> loaded(buffer->data, buffer->data + buffer->size);
+          reader.returnBuffer(move(buffer));
+          lock_guard<mutex> lock(seen_mutex);
+          seen.push_back(coarse_channel);
+          matched = matched && loaded == expected[coarse_channel];
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    REQUIRE(matched);
+    REQUIRE(seen.size() == expected.size());
+    sort(seen.begin(), seen.end());
+    for (int i = 0; i < (int) seen.size(); ++i) {
+      REQUIRE(seen[i] == i);
+    }
+
+    // Once every coarse channel has been read, there is nothing more
+    int coarse_channel;
+    REQUIRE(reader.read(&coarse_channel) == nullptr);
+  }
+
+  boost::filesystem::remove(filename);
+}
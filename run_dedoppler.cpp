@@ -1,11 +1,21 @@
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
 #include <fmt/core.h>
 #include <iostream>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include "dedoppler.h"
 #include "filterbank_file_reader.h"
 #include "hit_recorder.h"
+#include "prefetching_reader.h"
 #include "run_dedoppler.h"
+#include "thread_util.h"
+#include "top_path_file.h"
 #include "util.h"
 
 using namespace std;
@@ -20,6 +30,23 @@ using namespace std;
   min_drift is the minimum drift we are looking for.
     If it's set to zero, we report zero-drift signals.
   snr_threshold is the minimum SNR we require to report a signal
+  num_threads is how many threads to use.
+    Each coarse channel being processed at once has its own Dedopplerer and buffer,
+    so memory usage scales with it.
+  prune is whether to skip searching where no hit is possible. This only works in
+    a CPU-only build, and it reports how much it skipped at the end.
+  max_hits, if positive, is how many hits to keep for each coarse channel, the
+    ones with the largest path sums.
+  hierarchical is whether to search high drift rates on scrunched copies of the
+    data. See Dedopplerer::searchScrunched.
+  storage_format is how a CPU-only build stores the intermediate Taylor sums.
+    The 16-bit formats halve the Taylor buffers, but lose some precision.
+  top_paths_filename, if not empty, is where to save the top paths of every coarse
+    channel, so that rethresholdDedoppler can find hits for other thresholds later.
+
+  Hits are always recorded in coarse channel order, so the output doesn't depend on
+  the number of threads. The coarse channels are loaded on a separate thread, one
+  ahead of the search threads, so that loading overlaps with searching.
 
   Note that this algorithm does require an input file. In particular, the hit recorder
   copies over some metadata from it. If you wanted to run an algorithm similar to this one
@@ -28,25 +55,200 @@ using namespace std;
   object that satisfied the FilterbankFile interface, just to provide metadata.
  */
 void runDedoppler(const string& input_filename, const string& output_filename,
-                  double max_drift, double min_drift, double snr_threshold) {
+                  double max_drift, double min_drift, double snr_threshold,
+                  int num_threads, bool prune, int max_hits,
+                  bool hierarchical, StorageFormat storage_format,
+                  const string& top_paths_filename) {
   auto file = loadFilterbankFile(input_filename);
   auto recorder = makeHitRecorder(output_filename, *file.get(), max_drift);
 
-  Dedopplerer dedopplerer(file->num_timesteps, file->coarse_channel_size, file->foff,
-                          file->tsamp, file->has_dc_spike);
-  dedopplerer.print_hits = true;
-  FilterbankBuffer buffer(roundUpToPowerOfTwo(file->num_timesteps),
-                          file->coarse_channel_size);
-  
-  // Load and process one coarse channel at a time from the filterbank file
+  unique_ptr<TopPathFileWriter> top_path_writer;
+  if (!top_paths_filename.empty()) {
+    TopPathFileHeader header;
+    header.num_timesteps = file->num_timesteps;
+    header.coarse_channel_size = file->coarse_channel_size;
+    header.num_coarse_channels = file->num_coarse_channels;
+    header.max_drift = max_drift;
+    // Both of these leave out paths that can't reach this snr threshold
+    header.min_snr = (prune || hierarchical) ? snr_threshold : -INFINITY;
+    top_path_writer.reset(new TopPathFileWriter(top_paths_filename, header));
+  }
+
+  // Coarse channels are the easiest thing to parallelize. If there are more threads
+  // than coarse channels, the extras go to searching drift blocks in parallel.
+  int num_channel_threads = max(1, min(num_threads, (int) file->num_coarse_channels));
+  int num_search_threads = max(1, num_threads / num_channel_threads);
+
+  // Each worker gets its own Dedopplerer. Creating them up front tells us how
+  // many rows the input buffers need.
+  vector<unique_ptr<Dedopplerer> > dedopplerers;
+  for (int i = 0; i < num_channel_threads; ++i) {
+    dedopplerers.emplace_back(new Dedopplerer(file->num_timesteps,
+                                              file->coarse_channel_size, file->foff,
+                                              file->tsamp, file->has_dc_spike));
+    Dedopplerer& dedopplerer = *dedopplerers.back();
+    dedopplerer.num_threads = num_search_threads;
+    dedopplerer.prune = prune;
+    dedopplerer.max_hits = max_hits;
+    dedopplerer.hierarchical = hierarchical;
+    dedopplerer.storage_format = storage_format;
+  }
+
+  // One extra buffer lets the next coarse channel load while every worker searches
+  PrefetchingReader reader(*file.get(), dedopplerers[0]->inputNumTimesteps(),
+                           num_channel_threads + 1);
+
+  // Coarse channels are handed out in order, and their hits must be recorded in
+  // order. A worker that finishes early waits for its turn before recording,
+  // because the recorder needs the data that is still in its buffer.
+  int next_to_record = 0;
+  mutex record_mutex;
+  condition_variable record_cv;
+
+  // The first error in any worker stops all of them, and gets rethrown here
+  exception_ptr error;
+  bool stopped = false;
+
+  // Totals over all the workers, updated once they finish
+  PruningStats pruning_stats;
+
+  auto worker = [&](Dedopplerer& dedopplerer) {
+    setThreadName("dedoppler");
+    try {
+      vector<DedopplerHit> hits;
+      TopPaths top_paths;
+
+      while (true) {
+        int coarse_channel;
+        unique_ptr<FilterbankBuffer> buffer = reader.read(&coarse_channel);
+        if (!buffer) {
+          lock_guard<mutex> lock(record_mutex);
+          const PruningStats& stats = dedopplerer.pruning_stats;
+          pruning_stats.coarse_channels += stats.coarse_channels;
+          pruning_stats.skipped_coarse_channels += stats.skipped_coarse_channels;
+          pruning_stats.regions += stats.regions;
+          pruning_stats.skipped_regions += stats.skipped_regions;
+          return;
+        }
+
+        hits.clear();
+        dedopplerer.search(*buffer, *file.get(), NO_BEAM, coarse_channel, max_drift,
+                           min_drift, snr_threshold, &hits);
+        if (top_path_writer) {
+          dedopplerer.topPaths(&top_paths);
+        }
+
+        unique_lock<mutex> lock(record_mutex);
+        record_cv.wait(lock, [&] {
+          return stopped || next_to_record == coarse_channel;
+        });
+        if (stopped) {
+          return;
+        }
+        for (DedopplerHit hit : hits) {
+          cout << "hit: " << hit.toString() << endl;
+          recorder->recordHit(hit, buffer->data);
+        }
+        if (top_path_writer) {
+          top_path_writer->write(top_paths);
+        }
+        ++next_to_record;
+        record_cv.notify_all();
+        lock.unlock();
+        reader.returnBuffer(move(buffer));
+      }
+    } catch (...) {
+      lock_guard<mutex> lock(record_mutex);
+      if (!error) {
+        error = current_exception();
+      }
+      stopped = true;
+      reader.stop();
+      record_cv.notify_all();
+    }
+  };
+
+  vector<thread> threads;
+  for (int i = 0; i < num_channel_threads; ++i) {
+    threads.emplace_back(worker, ref(*dedopplerers[i]));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  if (error) {
+    rethrow_exception(error);
+  }
+
+  if (prune) {
+    if (pruning_stats.regions == 0) {
+      cout << "pruning is not supported by this build, so nothing was skipped\n";
+    } else {
+      cout << fmt::format("pruning skipped {} of {} drift block regions ({:.1f}%), "
+                          "including every region of {} of {} coarse channels\n",
+                          pruning_stats.skipped_regions, pruning_stats.regions,
+                          100.0 * pruning_stats.skipped_regions / pruning_stats.regions,
+                          pruning_stats.skipped_coarse_channels,
+                          pruning_stats.coarse_channels);
+    }
+  }
+}
+
+/*
+  Finds hits from the top paths saved by an earlier runDedoppler, without running
+  the Taylor tree again, and writes them to a .dat file or a .hits file. The hits
+  are the same as running runDedoppler again on the same input with these options
+  and the original max drift.
+
+  input_filename must be the file that the top paths came from. Its metadata goes
+  into the output, and a .hits file needs its data for the hits that are found.
+  snr_threshold can't be lower than the threshold of the original run, if it used
+  pruning or hierarchical search.
+ */
+void rethresholdDedoppler(const string& input_filename,
+                          const string& top_paths_filename,
+                          const string& output_filename, double min_drift,
+                          double snr_threshold, int max_hits) {
+  auto file = loadFilterbankFile(input_filename);
+  TopPathFileReader reader(top_paths_filename);
+  const TopPathFileHeader& header = reader.header;
+  if (header.num_timesteps != file->num_timesteps ||
+      header.coarse_channel_size != file->coarse_channel_size ||
+      header.num_coarse_channels != file->num_coarse_channels) {
+    fatal(fmt::format("{} has {} coarse channels of {} x {} top paths, which does not "
+                      "match {}", top_paths_filename, header.num_coarse_channels,
+                      header.num_timesteps, header.coarse_channel_size,
+                      input_filename));
+  }
+  if (snr_threshold < header.min_snr) {
+    fatal(fmt::format("{} came from a search with snr threshold {}, so it cannot be "
+                      "rethresholded to {}", top_paths_filename, header.min_snr,
+                      snr_threshold));
+  }
+
+  auto recorder = makeHitRecorder(output_filename, *file.get(), header.max_drift);
+  int drift_timesteps = roundUpToPowerOfTwo(file->num_timesteps) - 1;
+  double drift_rate_resolution = 1e6 * file->foff / (drift_timesteps * file->tsamp);
+
+  // The data is only needed for recording hits, so it's only loaded when there are some
+  FilterbankBuffer buffer(file->num_timesteps, file->coarse_channel_size);
+  TopPaths top_paths;
   vector<DedopplerHit> hits;
   for (int coarse_channel = 0; coarse_channel < file->num_coarse_channels;
        ++coarse_channel) {
-    file->loadCoarseChannel(coarse_channel, &buffer);
+    reader.read(coarse_channel, &top_paths);
     hits.clear();
-    dedopplerer.search(buffer, *file.get(), NO_BEAM, coarse_channel, max_drift, min_drift,
-                       snr_threshold, &hits);
-    for (DedopplerHit hit : hits) {        
+    findHits(*file.get(), NO_BEAM, coarse_channel, file->num_timesteps,
+             drift_rate_resolution, header.max_drift, min_drift, snr_threshold,
+             file->coarse_channel_size, top_paths.median, top_paths.std_dev,
+             top_paths.path_sums.data(), top_paths.drift_blocks.data(),
+             top_paths.path_offsets.data(), max_hits, false, &hits);
+    if (hits.empty()) {
+      continue;
+    }
+    file->loadCoarseChannel(coarse_channel, &buffer);
+    for (DedopplerHit hit : hits) {
+      cout << "hit: " << hit.toString() << endl;
       recorder->recordHit(hit, buffer.data);
     }
   }
@@ -2,8 +2,16 @@
 
 #include <string>
 
+#include "simd.h"
+
 using namespace std;
 
 void runDedoppler(const string& input_filename, const string& output_filename,
-                  double max_drift, double snr, double min_drift);
+                  double max_drift, double min_drift, double snr_threshold,
+                  int num_threads, bool prune, int max_hits, bool hierarchical,
+                  StorageFormat storage_format, const string& top_paths_filename);
 
+void rethresholdDedoppler(const string& input_filename,
+                          const string& top_paths_filename,
+                          const string& output_filename, double min_drift,
+                          double snr_threshold, int max_hits);
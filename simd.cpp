@@ -0,0 +1,618 @@
+#include "simd.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SETICORE_X86
+#endif
+
+using namespace std;
+
+// Set by setSimdLevel, or -1 to use the detected level.
+// Atomic, since the first threads to use simd may all start at once.
+static atomic<int> simd_level_override(-1);
+
+SimdLevel detectSimdLevel() {
+#ifdef SETICORE_X86
+  // These builtins check cpuid, along with whether the OS saves the wide registers
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SIMD_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  }
+#endif
+  return SIMD_SCALAR;
+}
+
+SimdLevel simdLevel() {
+  int level = simd_level_override.load(memory_order_relaxed);
+  if (level >= 0) {
+    return (SimdLevel) level;
+  }
+  // Function-local statics are initialized exactly once, even with many threads
+  static const SimdLevel detected = detectSimdLevel();
+  return detected;
+}
+
+void setSimdLevel(SimdLevel level) {
+  assert(level <= detectSimdLevel());
+  simd_level_override.store(level, memory_order_relaxed);
+}
+
+string simdLevelName(SimdLevel level) {
+  switch (level) {
+  case SIMD_AVX512:
+    return "avx512";
+  case SIMD_AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+static void addArraysScalar(const float* a, const float* b, float* output, long n) {
+  for (long i = 0; i < n; ++i) {
+    output[i] = a[i] + b[i];
+  }
+}
+
+#ifdef SETICORE_X86
+
+__attribute__((target("avx2")))
+static void addArraysAVX2(const float* a, const float* b, float* output, long n) {
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 sum = _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    _mm256_storeu_ps(output + i, sum);
+  }
+  addArraysScalar(a + i, b + i, output + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void addArraysAVX512(const float* a, const float* b, float* output, long n) {
+  long i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 sum = _mm512_add_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    _mm512_storeu_ps(output + i, sum);
+  }
+  addArraysScalar(a + i, b + i, output + i, n - i);
+}
+
+#endif
+
+void addArrays(const float* a, const float* b, float* output, long n) {
+#ifdef SETICORE_X86
+  switch (simdLevel()) {
+  case SIMD_AVX512:
+    addArraysAVX512(a, b, output, n);
+    return;
+  case SIMD_AVX2:
+    addArraysAVX2(a, b, output, n);
+    return;
+  default:
+    break;
+  }
+#endif
+  addArraysScalar(a, b, output, n);
+}
+
+static void addArraysUpdateMaxScalar(const float* a, const float* b, float* max_sums,
+                                     int* max_labels_a, int* max_labels_b,
+                                     int label_a, int label_b, long n) {
+  for (long i = 0; i < n; ++i) {
+    float sum = a[i] + b[i];
+    if (sum > max_sums[i]) {
+      max_sums[i] = sum;
+      max_labels_a[i] = label_a;
+      max_labels_b[i] = label_b;
+    }
+  }
+}
+
+#ifdef SETICORE_X86
+
+__attribute__((target("avx2")))
+static void addArraysUpdateMaxAVX2(const float* a, const float* b, float* max_sums,
+                                   int* max_labels_a, int* max_labels_b,
+                                   int label_a, int label_b, long n) {
+  __m256i labels_a = _mm256_set1_epi32(label_a);
+  __m256i labels_b = _mm256_set1_epi32(label_b);
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 sum = _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 old_max = _mm256_loadu_ps(max_sums + i);
+    // An ordered comparison, so NaN never replaces anything, as with scalar >
+    __m256 greater = _mm256_cmp_ps(sum, old_max, _CMP_GT_OQ);
+    if (_mm256_movemask_ps(greater) == 0) {
+      continue;
+    }
+    __m256i mask = _mm256_castps_si256(greater);
+    _mm256_storeu_ps(max_sums + i, _mm256_blendv_ps(old_max, sum, greater));
+    __m256i* out_a = (__m256i*) (max_labels_a + i);
+    __m256i* out_b = (__m256i*) (max_labels_b + i);
+    _mm256_storeu_si256(out_a, _mm256_blendv_epi8(_mm256_loadu_si256(out_a),
+                                                  labels_a, mask));
+    _mm256_storeu_si256(out_b, _mm256_blendv_epi8(_mm256_loadu_si256(out_b),
+                                                  labels_b, mask));
+  }
+  addArraysUpdateMaxScalar(a + i, b + i, max_sums + i, max_labels_a + i,
+                           max_labels_b + i, label_a, label_b, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void addArraysUpdateMaxAVX512(const float* a, const float* b, float* max_sums,
+                                     int* max_labels_a, int* max_labels_b,
+                                     int label_a, int label_b, long n) {
+  __m512i labels_a = _mm512_set1_epi32(label_a);
+  __m512i labels_b = _mm512_set1_epi32(label_b);
+  long i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 sum = _mm512_add_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    __mmask16 greater = _mm512_cmp_ps_mask(sum, _mm512_loadu_ps(max_sums + i),
+                                           _CMP_GT_OQ);
+    if (greater == 0) {
+      continue;
+    }
+    _mm512_mask_storeu_ps(max_sums + i, greater, sum);
+    _mm512_mask_storeu_epi32(max_labels_a + i, greater, labels_a);
+    _mm512_mask_storeu_epi32(max_labels_b + i, greater, labels_b);
+  }
+  addArraysUpdateMaxScalar(a + i, b + i, max_sums + i, max_labels_a + i,
+                           max_labels_b + i, label_a, label_b, n - i);
+}
+
+#endif
+
+void addArraysUpdateMax(const float* a, const float* b, float* max_sums,
+                        int* max_labels_a, int* max_labels_b,
+                        int label_a, int label_b, long n) {
+#ifdef SETICORE_X86
+  switch (simdLevel()) {
+  case SIMD_AVX512:
+    addArraysUpdateMaxAVX512(a, b, max_sums, max_labels_a, max_labels_b,
+                             label_a, label_b, n);
+    return;
+  case SIMD_AVX2:
+    addArraysUpdateMaxAVX2(a, b, max_sums, max_labels_a, max_labels_b,
+                           label_a, label_b, n);
+    return;
+  default:
+    break;
+  }
+#endif
+  addArraysUpdateMaxScalar(a, b, max_sums, max_labels_a, max_labels_b,
+                           label_a, label_b, n);
+}
+
+static float maxOfArrayScalar(const float* input, long n, float max_value) {
+  for (long i = 0; i < n; ++i) {
+    // Ordered, so NaN never replaces anything
+    if (input[i] > max_value) {
+      max_value = input[i];
+    }
+  }
+  return max_value;
+}
+
+#ifdef SETICORE_X86
+
+// The max instructions return their second operand when either is NaN, so
+// keeping the running maximum second ignores NaNs, as the scalar code does.
+
+__attribute__((target("avx2")))
+static float maxOfArrayAVX2(const float* input, long n) {
+  __m256 max_values = _mm256_set1_ps(-INFINITY);
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    max_values = _mm256_max_ps(_mm256_loadu_ps(input + i), max_values);
+  }
+  float lanes[8];
+  _mm256_storeu_ps(lanes, max_values);
+  float max_value = maxOfArrayScalar(lanes, 8, -INFINITY);
+  return maxOfArrayScalar(input + i, n - i, max_value);
+}
+
+__attribute__((target("avx512f")))
+static float maxOfArrayAVX512(const float* input, long n) {
+  __m512 max_values = _mm512_set1_ps(-INFINITY);
+  long i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // The maskz form avoids a spurious gcc warning about uninitialized registers
+    max_values = _mm512_maskz_max_ps(0xffff, _mm512_loadu_ps(input + i), max_values);
+  }
+  float lanes[16];
+  _mm512_storeu_ps(lanes, max_values);
+  float max_value = maxOfArrayScalar(lanes, 16, -INFINITY);
+  return maxOfArrayScalar(input + i, n - i, max_value);
+}
+
+#endif
+
+void blockMaxima(const float* input, long n, int block_size, float* maxima) {
+  assert(block_size > 0);
+#ifdef SETICORE_X86
+  SimdLevel level = simdLevel();
+#endif
+  for (long start = 0; start < n; start += block_size) {
+    long size = min((long) block_size, n - start);
+    float* output = maxima + start / block_size;
+#ifdef SETICORE_X86
+    if (level == SIMD_AVX512) {
+      *output = maxOfArrayAVX512(input + start, size);
+      continue;
+    }
+    if (level == SIMD_AVX2) {
+      *output = maxOfArrayAVX2(input + start, size);
+      continue;
+    }
+#endif
+    *output = maxOfArrayScalar(input + start, size, -INFINITY);
+  }
+}
+
+string storageFormatName(StorageFormat format) {
+  switch (format) {
+  case STORAGE_FP16:
+    return "fp16";
+  case STORAGE_BF16:
+    return "bf16";
+  default:
+    return "fp32";
+  }
+}
+
+static uint32_t floatBits(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+static float bitsToFloat(uint32_t bits) {
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Rounds away the low bits of value, to nearest even, given the number of bits
+static uint32_t roundShift(uint32_t value, int shift) {
+  uint32_t answer = value >> shift;
+  uint32_t remainder = value & ((1u << shift) - 1);
+  uint32_t half = 1u << (shift - 1);
+  if (remainder > half || (remainder == half && (answer & 1))) {
+    ++answer;
+  }
+  return answer;
+}
+
+// The same as the F16C conversion, with round-to-nearest-even
+static uint16_t floatToFp16(float f) {
+  uint32_t bits = floatBits(f);
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs_bits = bits & 0x7fffffff;
+
+  if (abs_bits >= 0x7f800000) {
+    // Infinity, or NaN, which gets quieted
+    if (abs_bits == 0x7f800000) {
+      return sign | 0x7c00;
+    }
+    return sign | 0x7e00 | ((abs_bits >> 13) & 0x3ff);
+  }
+  if (abs_bits >= 0x477ff000) {
+    // Rounds up past the largest fp16
+    return sign | 0x7c00;
+  }
+  if (abs_bits >= 0x38800000) {
+    // A normal fp16. Rebias the exponent from 127 to 15.
+    return sign | roundShift(abs_bits - 0x38000000, 13);
+  }
+  if (abs_bits <= 0x33000000) {
+    // Rounds down to zero
+    return sign;
+  }
+  // A subnormal fp16, in units of 2^-24
+  int exponent = abs_bits >> 23;
+  uint32_t mantissa = (abs_bits & 0x7fffff) | 0x800000;
+  return sign | roundShift(mantissa, 126 - exponent);
+}
+
+static float fp16ToFloat(uint16_t h) {
+  uint32_t sign = (h & 0x8000) << 16;
+  int exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  if (exponent == 0) {
+    // Zero or subnormal, which is exactly representable as a float
+    return bitsToFloat(sign | floatBits(mantissa * 5.9604644775390625e-8f));
+  }
+  if (exponent == 31) {
+    return bitsToFloat(sign | 0x7f800000 | (mantissa << 13));
+  }
+  return bitsToFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+// The same as VCVTNEPS2BF16
+static uint16_t floatToBf16(float f) {
+  uint32_t bits = floatBits(f);
+  if ((bits & 0x7f800000) == 0) {
+    bits &= 0x80000000;
+  }
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    return (bits >> 16) | 0x40;
+  }
+  return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+
+static float bf16ToFloat(uint16_t h) {
+  return bitsToFloat(((uint32_t) h) << 16);
+}
+
+static void floatsToHalvesScalar(const float* input, uint16_t* output, long n,
+                                 StorageFormat format) {
+  if (format == STORAGE_FP16) {
+    for (long i = 0; i < n; ++i) {
+      output[i] = floatToFp16(input[i]);
+    }
+  } else {
+    for (long i = 0; i < n; ++i) {
+      output[i] = floatToBf16(input[i]);
+    }
+  }
+}
+
+static void halvesToFloatsScalar(const uint16_t* input, float* output, long n,
+                                 StorageFormat format) {
+  if (format == STORAGE_FP16) {
+    for (long i = 0; i < n; ++i) {
+      output[i] = fp16ToFloat(input[i]);
+    }
+  } else {
+    for (long i = 0; i < n; ++i) {
+      output[i] = bf16ToFloat(input[i]);
+    }
+  }
+}
+
+#ifdef SETICORE_X86
+
+// F16C came out before AVX2, but check anyway
+static bool hasF16C() {
+  static bool answer = __builtin_cpu_supports("f16c");
+  return answer;
+}
+
+static bool hasAvx512Bf16() {
+  static bool answer = __builtin_cpu_supports("avx512bf16");
+  return answer;
+}
+
+// The bf16 rounding of floatToBf16, eight at a time
+__attribute__((target("avx2")))
+static __m256i roundToBf16AVX2(__m256i bits) {
+  __m256i exponent_mask = _mm256_set1_epi32(0x7f800000);
+  __m256i subnormal = _mm256_cmpeq_epi32(_mm256_and_si256(bits, exponent_mask),
+                                         _mm256_setzero_si256());
+  bits = _mm256_blendv_epi8(bits,
+                            _mm256_and_si256(bits, _mm256_set1_epi32(0x80000000)),
+                            subnormal);
+  __m256i abs_bits = _mm256_and_si256(bits, _mm256_set1_epi32(0x7fffffff));
+  __m256i nan = _mm256_cmpgt_epi32(abs_bits, exponent_mask);
+  __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+  __m256i rounded = _mm256_srli_epi32(
+    _mm256_add_epi32(bits, _mm256_add_epi32(_mm256_set1_epi32(0x7fff), odd)), 16);
+  __m256i quiet = _mm256_or_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(0x40));
+  return _mm256_blendv_epi8(rounded, quiet, nan);
+}
+
+__attribute__((target("avx2,f16c")))
+static void floatsToHalvesAVX2(const float* input, uint16_t* output, long n,
+                               StorageFormat format) {
+  long i = 0;
+  if (format == STORAGE_FP16) {
+    for (; i + 8 <= n; i += 8) {
+      __m128i halves = _mm256_cvtps_ph(_mm256_loadu_ps(input + i),
+                                       _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+      _mm_storeu_si128((__m128i*) (output + i), halves);
+    }
+  } else {
+    for (; i + 8 <= n; i += 8) {
+      __m256i rounded = roundToBf16AVX2(_mm256_castps_si256(_mm256_loadu_ps(input + i)));
+      // Pack down to 16 bits. packus works within 128-bit lanes, so fix the order
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(rounded, rounded),
+                                                0xd8);
+      _mm_storeu_si128((__m128i*) (output + i), _mm256_castsi256_si128(packed));
+    }
+  }
+  floatsToHalvesScalar(input + i, output + i, n - i, format);
+}
+
+__attribute__((target("avx2,f16c")))
+static void halvesToFloatsAVX2(const uint16_t* input, float* output, long n,
+                               StorageFormat format) {
+  long i = 0;
+  if (format == STORAGE_FP16) {
+    for (; i + 8 <= n; i += 8) {
+      __m128i halves = _mm_loadu_si128((const __m128i*) (input + i));
+      _mm256_storeu_ps(output + i, _mm256_cvtph_ps(halves));
+    }
+  } else {
+    for (; i + 8 <= n; i += 8) {
+      __m128i halves = _mm_loadu_si128((const __m128i*) (input + i));
+      __m256i bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(halves), 16);
+      _mm256_storeu_ps(output + i, _mm256_castsi256_ps(bits));
+    }
+  }
+  halvesToFloatsScalar(input + i, output + i, n - i, format);
+}
+
+__attribute__((target("avx512f,avx512bf16")))
+static void floatsToBf16AVX512(const float* input, uint16_t* output, long n) {
+  long i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256bh halves = _mm512_cvtneps_pbh(_mm512_loadu_ps(input + i));
+    _mm256_storeu_si256((__m256i*) (output + i), (__m256i) halves);
+  }
+  floatsToHalvesScalar(input + i, output + i, n - i, STORAGE_BF16);
+}
+
+__attribute__((target("avx512f")))
+static void floatsToFp16AVX512(const float* input, uint16_t* output, long n) {
+  long i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // The maskz forms avoid a spurious gcc warning about uninitialized registers
+    __m256i halves = _mm512_maskz_cvtps_ph(0xffff, _mm512_loadu_ps(input + i),
+                                           _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    _mm256_storeu_si256((__m256i*) (output + i), halves);
+  }
+  floatsToHalvesScalar(input + i, output + i, n - i, STORAGE_FP16);
+}
+
+__attribute__((target("avx512f")))
+static void halvesToFloatsAVX512(const uint16_t* input, float* output, long n,
+                                 StorageFormat format) {
+  // The maskz forms avoid a spurious gcc warning about uninitialized registers
+  long i = 0;
+  if (format == STORAGE_FP16) {
+    for (; i + 16 <= n; i += 16) {
+      __m256i halves = _mm256_loadu_si256((const __m256i*) (input + i));
+      _mm512_storeu_ps(output + i, _mm512_maskz_cvtph_ps(0xffff, halves));
+    }
+  } else {
+    for (; i + 16 <= n; i += 16) {
+      __m256i halves = _mm256_loadu_si256((const __m256i*) (input + i));
+      __m512i bits = _mm512_maskz_slli_epi32(0xffff,
+                                             _mm512_maskz_cvtepu16_epi32(0xffff, halves),
+                                             16);
+      _mm512_storeu_ps(output + i, _mm512_castsi512_ps(bits));
+    }
+  }
+  halvesToFloatsScalar(input + i, output + i, n - i, format);
+}
+
+#endif
+
+void floatsToHalves(const float* input, uint16_t* output, long n, StorageFormat format) {
+  assert(format == STORAGE_FP16 || format == STORAGE_BF16);
+#ifdef SETICORE_X86
+  SimdLevel level = simdLevel();
+  if (level == SIMD_AVX512 && format == STORAGE_FP16) {
+    floatsToFp16AVX512(input, output, n);
+    return;
+  }
+  if (level == SIMD_AVX512 && hasAvx512Bf16()) {
+    floatsToBf16AVX512(input, output, n);
+    return;
+  }
+  if (level >= SIMD_AVX2 && hasF16C()) {
+    floatsToHalvesAVX2(input, output, n, format);
+    return;
+  }
+#endif
+  floatsToHalvesScalar(input, output, n, format);
+}
+
+void halvesToFloats(const uint16_t* input, float* output, long n, StorageFormat format) {
+  assert(format == STORAGE_FP16 || format == STORAGE_BF16);
+#ifdef SETICORE_X86
+  SimdLevel level = simdLevel();
+  if (level == SIMD_AVX512) {
+    halvesToFloatsAVX512(input, output, n, format);
+    return;
+  }
+  if (level >= SIMD_AVX2 && hasF16C()) {
+    halvesToFloatsAVX2(input, output, n, format);
+    return;
+  }
+#endif
+  halvesToFloatsScalar(input, output, n, format);
+}
+
+template <class T> static void unsignedToFloatsScalar(const T* input, float* output,
+                                                     long n) {
+  for (long i = 0; i < n; ++i) {
+    output[i] = input[i];
+  }
+}
+
+#ifdef SETICORE_X86
+
+__attribute__((target("avx2")))
+static void uint8sToFloatsAVX2(const uint8_t* input, float* output, long n) {
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i bytes = _mm_loadl_epi64((const __m128i*) (input + i));
+    _mm256_storeu_ps(output + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes)));
+  }
+  unsignedToFloatsScalar(input + i, output + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void uint16sToFloatsAVX2(const uint16_t* input, float* output, long n) {
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i words = _mm_loadu_si128((const __m128i*) (input + i));
+    _mm256_storeu_ps(output + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(words)));
+  }
+  unsignedToFloatsScalar(input + i, output + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void uint8sToFloatsAVX512(const uint8_t* input, float* output, long n) {
+  long i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*) (input + i));
+    __m512i ints = _mm512_maskz_cvtepu8_epi32(0xffff, bytes);
+    _mm512_storeu_ps(output + i, _mm512_maskz_cvtepi32_ps(0xffff, ints));
+  }
+  unsignedToFloatsScalar(input + i, output + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void uint16sToFloatsAVX512(const uint16_t* input, float* output, long n) {
+  long i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i words = _mm256_loadu_si256((const __m256i*) (input + i));
+    __m512i ints = _mm512_maskz_cvtepu16_epi32(0xffff, words);
+    _mm512_storeu_ps(output + i, _mm512_maskz_cvtepi32_ps(0xffff, ints));
+  }
+  unsignedToFloatsScalar(input + i, output + i, n - i);
+}
+
+#endif
+
+void uint8sToFloats(const uint8_t* input, float* output, long n) {
+#ifdef SETICORE_X86
+  switch (simdLevel()) {
+  case SIMD_AVX512:
+    uint8sToFloatsAVX512(input, output, n);
+    return;
+  case SIMD_AVX2:
+    uint8sToFloatsAVX2(input, output, n);
+    return;
+  default:
+    break;
+  }
+#endif
+  unsignedToFloatsScalar(input, output, n);
+}
+
+void uint16sToFloats(const uint16_t* input, float* output, long n) {
+#ifdef SETICORE_X86
+  switch (simdLevel()) {
+  case SIMD_AVX512:
+    uint16sToFloatsAVX512(input, output, n);
+    return;
+  case SIMD_AVX2:
+    uint16sToFloatsAVX2(input, output, n);
+    return;
+  default:
+    break;
+  }
+#endif
+  unsignedToFloatsScalar(input, output, n);
+}
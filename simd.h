@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+/*
+  Helpers for vectorized host code.
+
+  The instruction set is chosen at runtime, based on what cpuid reports for this
+  machine, so the same binary can run on any x86 host. Every level computes
+  exactly the same floating point operations, just more of them at once, so
+  results do not depend on the level.
+ */
+enum SimdLevel {
+  SIMD_SCALAR = 0,
+  SIMD_AVX2 = 1,
+  SIMD_AVX512 = 2,
+};
+
+// The best instruction set that this machine supports
+SimdLevel detectSimdLevel();
+
+// The instruction set that vectorized helpers currently use.
+// This defaults to detectSimdLevel().
+SimdLevel simdLevel();
+
+// Overrides the instruction set, for testing and benchmarking.
+// Threads that are already running may not see the change right away, so call
+// it before starting any worker threads.
+void setSimdLevel(SimdLevel level);
+
+string simdLevelName(SimdLevel level);
+
+// Sets output[i] = a[i] + b[i] for i in [0, n)
+void addArrays(const float* a, const float* b, float* output, long n);
+
+// For i in [0, n), where a[i] + b[i] > max_sums[i], sets max_sums[i] to the sum,
+// and labels it by setting max_labels_a[i] = label_a and max_labels_b[i] = label_b.
+void addArraysUpdateMax(const float* a, const float* b, float* max_sums,
+                        int* max_labels_a, int* max_labels_b,
+                        int label_a, int label_b, long n);
+
+// Sets maxima[i] to the largest value in block i of the input, where each block
+// is block_size values, and the last block gets whatever is left over.
+// NaNs are ignored, and a block with nothing else has a maximum of -infinity.
+void blockMaxima(const float* input, long n, int block_size, float* maxima);
+
+// Formats for storing intermediate sums. The 16-bit formats halve the memory
+// traffic, at the cost of precision.
+enum StorageFormat {
+  STORAGE_FP32 = 0,
+  STORAGE_FP16 = 1,
+  STORAGE_BF16 = 2,
+};
+
+string storageFormatName(StorageFormat format);
+
+// Converts between floats and a 16-bit format, rounding to nearest even.
+// Conversion to bf16 flushes subnormals to zero, as the AVX-512 BF16 instructions do,
+// so the results are the same whichever instructions are used.
+void floatsToHalves(const float* input, uint16_t* output, long n, StorageFormat format);
+void halvesToFloats(const uint16_t* input, float* output, long n, StorageFormat format);
+
+// Converts unsigned integer samples to floats, as stored in 8-bit and 16-bit
+// filterbank files. Every value converts exactly.
+void uint8sToFloats(const uint8_t* input, float* output, long n);
+void uint16sToFloats(const uint16_t* input, float* output, long n);
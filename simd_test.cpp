@@ -0,0 +1,133 @@
+#include "catch/catch.hpp"
+#include <math.h>
+#include <random>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "simd.h"
+
+using namespace std;
+
+// Random floats of every kind, including subnormals, infinities, and NaNs
+static vector<float> makeTrickyFloats(int n) {
+  mt19937 rng(17);
+  vector<float> answer(n);
+  for (int i = 0; i < n; ++i) {
+    uint32_t bits = rng();
+    switch (i % 5) {
+    case 0:
+      // Subnormal
+      bits &= 0x807fffff;
+      break;
+    case 1:
+      // Infinity or NaN
+      bits |= 0x7f800000;
+      break;
+    case 2:
+      // Near the fp16 range
+      bits = (bits & 0x81ffffff) | 0x38000000;
+      break;
+    default:
+      break;
+    }
+    memcpy(&answer[i], &bits, sizeof(bits));
+  }
+  return answer;
+}
+
+TEST_CASE("half conversions match at every simd level", "[simd]") {
+  SimdLevel original_level = simdLevel();
+  // Not a multiple of any vector width, to exercise the tails
+  int n = 100003;
+  vector<float> input = makeTrickyFloats(n);
+
+  for (StorageFormat format : {STORAGE_FP16, STORAGE_BF16}) {
+    setSimdLevel(SIMD_SCALAR);
+    vector<uint16_t> expected_halves(n);
+    floatsToHalves(input.data(), expected_halves.data(), n, format);
+    vector<float> expected_floats(n);
+    halvesToFloats(expected_halves.data(), expected_floats.data(), n, format);
+
+    for (int level = SIMD_SCALAR; level <= detectSimdLevel(); ++level) {
+      setSimdLevel((SimdLevel) level);
+      vector<uint16_t> halves(n);
+      floatsToHalves(input.data(), halves.data(), n, format);
+      REQUIRE(halves == expected_halves);
+
+      vector<float> floats(n);
+      halvesToFloats(halves.data(), floats.data(), n, format);
+      REQUIRE(memcmp(floats.data(), expected_floats.data(), n * sizeof(float)) == 0);
+    }
+  }
+  setSimdLevel(original_level);
+}
+
+TEST_CASE("half conversions round to nearest even", "[simd]") {
+  vector<float> input = {1.0, 65504.0, 65520.0, 1.0 + 1.0 / 2048, 1.0 + 3.0 / 2048,
+                         5.9604644775390625e-8, 2.98023223876953125e-8};
+  vector<uint16_t> fp16(input.size());
+  floatsToHalves(input.data(), fp16.data(), input.size(), STORAGE_FP16);
+  REQUIRE(fp16[0] == 0x3c00);
+  REQUIRE(fp16[1] == 0x7bff);
+  // Halfway past the largest fp16 rounds up to infinity
+  REQUIRE(fp16[2] == 0x7c00);
+  // Ties go to the even mantissa
+  REQUIRE(fp16[3] == 0x3c00);
+  REQUIRE(fp16[4] == 0x3c02);
+  // The smallest subnormal, and half of it, which ties down to zero
+  REQUIRE(fp16[5] == 0x0001);
+  REQUIRE(fp16[6] == 0x0000);
+
+  vector<uint16_t> bf16(input.size());
+  floatsToHalves(input.data(), bf16.data(), input.size(), STORAGE_BF16);
+  REQUIRE(bf16[0] == 0x3f80);
+  REQUIRE(bf16[3] == 0x3f80);
+}
+
+TEST_CASE("block maxima match at every simd level", "[simd]") {
+  SimdLevel original_level = simdLevel();
+  int n = 100003;
+  vector<float> input = makeTrickyFloats(n);
+  for (int block_size : {1, 7, 16, 100, 1000}) {
+    int num_blocks = (n + block_size - 1) / block_size;
+    vector<float> expected(num_blocks, -INFINITY);
+    for (int i = 0; i < n; ++i) {
+      if (input[i] > expected[i / block_size]) {
+        expected[i / block_size] = input[i];
+      }
+    }
+    for (int level = SIMD_SCALAR; level <= detectSimdLevel(); ++level) {
+      setSimdLevel((SimdLevel) level);
+      vector<float> maxima(num_blocks);
+      blockMaxima(input.data(), n, block_size, maxima.data());
+      REQUIRE(memcmp(maxima.data(), expected.data(), num_blocks * sizeof(float)) == 0);
+    }
+  }
+  setSimdLevel(original_level);
+}
+
+TEST_CASE("integer conversions match at every simd level", "[simd]") {
+  SimdLevel original_level = simdLevel();
+  int n = 100003;
+  mt19937 rng(23);
+  vector<uint8_t> bytes(n);
+  vector<uint16_t> words(n);
+  vector<float> expected_bytes(n), expected_words(n);
+  for (int i = 0; i < n; ++i) {
+    bytes[i] = rng();
+    words[i] = rng();
+    expected_bytes[i] = bytes[i];
+    expected_words[i] = words[i];
+  }
+
+  for (int level = SIMD_SCALAR; level <= detectSimdLevel(); ++level) {
+    setSimdLevel((SimdLevel) level);
+    vector<float> floats(n);
+    uint8sToFloats(bytes.data(), floats.data(), n);
+    REQUIRE(floats == expected_bytes);
+    uint16sToFloats(words.data(), floats.data(), n);
+    REQUIRE(floats == expected_words);
+  }
+  setSimdLevel(original_level);
+}
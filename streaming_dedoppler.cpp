@@ -0,0 +1,230 @@
+#include "streaming_dedoppler.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <fmt/core.h>
+#include <string.h>
+
+#include "cpu_taylor.h"
+#include "dedoppler.h"
+#include "simd.h"
+#include "util.h"
+
+using namespace std;
+
+StreamingDedopplerer::StreamingDedopplerer(int num_timesteps, int hop,
+                                           int num_channels, double foff,
+                                           double tsamp, double max_drift)
+  : num_timesteps(num_timesteps), hop(hop), num_channels(num_channels), foff(foff),
+    tsamp(tsamp), max_drift(max_drift), print_hits(false), max_hits(0),
+    spectra_added(0), last_window_start(-1) {
+  if (num_timesteps < 2 || !isPowerOfTwo(num_timesteps)) {
+    fatal(fmt::format("streaming dedoppler needs a power-of-two window, not {}",
+                      num_timesteps));
+  }
+  if (hop < 1 || hop > num_timesteps || !isPowerOfTwo(hop)) {
+    fatal(fmt::format("streaming dedoppler hop must be a power of two from 1 to {}, "
+                      "not {}", num_timesteps, hop));
+  }
+
+  hops_per_window = num_timesteps / hop;
+  num_levels = 0;
+  while ((1 << num_levels) < hops_per_window) {
+    ++num_levels;
+  }
+
+  int drift_timesteps = num_timesteps - 1;
+  drift_rate_resolution = 1e6 * foff / (drift_timesteps * tsamp);
+  driftBlockRange(drift_rate_resolution, drift_timesteps, max_drift,
+                  &min_drift_block, &max_drift_block);
+
+  hop_input.resize((long) hop * num_channels);
+  buffer1.resize((long) hop * num_channels);
+  buffer2.resize((long) hop * num_channels);
+
+  subtrees.resize(max_drift_block - min_drift_block + 1);
+  for (auto& levels : subtrees) {
+    levels.resize(num_levels);
+    for (int level = 0; level < num_levels; ++level) {
+      levels[level].resize((1 << level) + 1);
+      for (auto& subtree : levels[level]) {
+        subtree.resize((long) hop * (1 << level) * num_channels);
+      }
+    }
+  }
+
+  hop_column_sums.resize(hops_per_window);
+  for (auto& sums : hop_column_sums) {
+    sums.resize(num_channels);
+  }
+  column_sums.resize(num_channels);
+  top_path_sums.resize(num_channels);
+  top_drift_blocks.resize(num_channels);
+  top_path_offsets.resize(num_channels);
+}
+
+long StreamingDedopplerer::numSpectra() const {
+  return spectra_added;
+}
+
+long StreamingDedopplerer::lastWindowStart() const {
+  return last_window_start;
+}
+
+size_t StreamingDedopplerer::memoryUsage() const {
+  size_t floats = hop_input.size() + buffer1.size() + buffer2.size() +
+    column_sums.size() + top_path_sums.size();
+  for (auto& levels : subtrees) {
+    for (auto& ring : levels) {
+      for (auto& subtree : ring) {
+        floats += subtree.size();
+      }
+    }
+  }
+  for (auto& sums : hop_column_sums) {
+    floats += sums.size();
+  }
+  return floats * sizeof(float) +
+    (top_drift_blocks.size() + top_path_offsets.size()) * sizeof(int);
+}
+
+bool StreamingDedopplerer::addSpectrum(const float* spectrum,
+                                       const FilterbankMetadata& metadata,
+                                       int beam, int coarse_channel, double min_drift,
+                                       double snr_threshold,
+                                       vector<DedopplerHit>* output) {
+  long row = spectra_added % hop;
+  memcpy(hop_input.data() + row * num_channels, spectrum,
+         num_channels * sizeof(float));
+  ++spectra_added;
+  if (spectra_added % hop != 0) {
+    return false;
+  }
+
+  long hop_index = spectra_added / hop - 1;
+  addHop(hop_index);
+  if (hop_index + 1 < hops_per_window) {
+    return false;
+  }
+  searchWindow(hop_index + 1 - hops_per_window, metadata, beam, coarse_channel,
+               min_drift, snr_threshold, output);
+  return true;
+}
+
+int StreamingDedopplerer::addSpectra(const float* spectra, int num_spectra,
+                                     const FilterbankMetadata& metadata, int beam,
+                                     int coarse_channel, double min_drift,
+                                     double snr_threshold,
+                                     vector<StreamingWindowHits>* output) {
+  int num_windows = 0;
+  vector<DedopplerHit> hits;
+  for (int i = 0; i < num_spectra; ++i) {
+    if (addSpectrum(spectra + (long) i * num_channels, metadata, beam,
+                    coarse_channel, min_drift, snr_threshold, &hits)) {
+      StreamingWindowHits window;
+      window.start = last_window_start;
+      window.hits.swap(hits);
+      output->push_back(move(window));
+      ++num_windows;
+    }
+  }
+  return num_windows;
+}
+
+/*
+  Processes a hop that has completely arrived in hop_input. This calculates its
+  column sums, and for each drift block, the newest subtree at each level.
+  The newest subtree at a level is merged from two subtrees of the level below,
+  the newest one and the one just before it in time.
+ */
+void StreamingDedopplerer::addHop(long hop_index) {
+  float* sums = hop_column_sums[hop_index % hops_per_window].data();
+  memset(sums, 0, num_channels * sizeof(float));
+  for (int row = 0; row < hop; ++row) {
+    addArrays(sums, hop_input.data() + (long) row * num_channels, sums, num_channels);
+  }
+
+  if (num_levels == 0) {
+    // Each window is a single hop, so there is nothing to cache
+    return;
+  }
+
+  for (int drift_block = min_drift_block; drift_block <= max_drift_block;
+       ++drift_block) {
+    auto& levels = subtrees[drift_block - min_drift_block];
+
+    float* leaf = levels[0][hop_index % 2].data();
+    const float* tree = partialCpuTaylorTree(hop_input.data(), leaf, buffer2.data(),
+                                             hop, num_channels, drift_block, hop);
+    if (tree != leaf) {
+      copy(tree, tree + (long) hop * num_channels, leaf);
+    }
+
+    for (int level = 1; level < num_levels; ++level) {
+      int half_hops = 1 << (level - 1);
+      long first_hop = hop_index + 1 - 2 * half_hops;
+      if (first_hop < 0) {
+        break;
+      }
+      auto& halves = levels[level - 1];
+      auto& targets = levels[level];
+      int half_length = hop * half_hops;
+      cpuTaylorMergeStep(halves[first_hop % halves.size()].data(),
+                         halves[(first_hop + half_hops) % halves.size()].data(),
+                         half_length, targets[first_hop % targets.size()].data(),
+                         num_channels, num_channels, 2 * half_length, drift_block);
+    }
+  }
+}
+
+/*
+  Searches the window that starts at hop number first_hop_index, once all of its
+  subtrees are ready.
+
+  The results are the same as running Dedopplerer::search on the window, except
+  that the column sums are added up a hop at a time, so they may round differently.
+ */
+void StreamingDedopplerer::searchWindow(long first_hop_index,
+                                        const FilterbankMetadata& metadata,
+                                        int beam, int coarse_channel, double min_drift,
+                                        double snr_threshold,
+                                        vector<DedopplerHit>* output) {
+  const vector<float>& first_sums = hop_column_sums[first_hop_index % hops_per_window];
+  copy(first_sums.begin(), first_sums.end(), column_sums.begin());
+  for (int i = 1; i < hops_per_window; ++i) {
+    const float* sums = hop_column_sums[(first_hop_index + i) % hops_per_window].data();
+    addArrays(column_sums.data(), sums, column_sums.data(), num_channels);
+  }
+
+  fill(top_path_sums.begin(), top_path_sums.end(), 0.0);
+  fill(top_drift_blocks.begin(), top_drift_blocks.end(), 0);
+  fill(top_path_offsets.begin(), top_path_offsets.end(), 0);
+
+  for (int drift_block = min_drift_block; drift_block <= max_drift_block;
+       ++drift_block) {
+    if (num_levels == 0) {
+      cpuTaylorTreeTopPaths(hop_input.data(), buffer1.data(), buffer2.data(),
+                            num_timesteps, num_channels, drift_block,
+                            top_path_sums.data(), top_drift_blocks.data(),
+                            top_path_offsets.data());
+      continue;
+    }
+
+    // The window is the top level of subtrees, merged with its neighbor
+    auto& halves = subtrees[drift_block - min_drift_block][num_levels - 1];
+    long second_hop_index = first_hop_index + hops_per_window / 2;
+    cpuMergeTopPaths(halves[first_hop_index % halves.size()].data(),
+                     halves[second_hop_index % halves.size()].data(),
+                     num_timesteps / 2, num_timesteps, num_channels, drift_block,
+                     top_path_sums.data(), top_drift_blocks.data(),
+                     top_path_offsets.data());
+  }
+
+  last_window_start = first_hop_index * hop;
+  float median, std_dev;
+  noise_estimator.estimate(column_sums.data(), num_channels, &median, &std_dev);
+  findHits(metadata, beam, coarse_channel, num_timesteps, drift_rate_resolution,
+           max_drift, min_drift, snr_threshold, num_channels, median, std_dev,
+           top_path_sums.data(), top_drift_blocks.data(), top_path_offsets.data(),
+           max_hits, print_hits, output);
+}
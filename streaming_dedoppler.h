@@ -0,0 +1,130 @@
+#pragma once
+
+#include <vector>
+
+#include "dedoppler_hit.h"
+#include "filterbank_metadata.h"
+#include "noise_estimator.h"
+
+using namespace std;
+
+// The hits of one window searched by a StreamingDedopplerer
+struct StreamingWindowHits {
+  // The index of the first spectrum in the window
+  long start;
+
+  vector<DedopplerHit> hits;
+};
+
+/*
+  The StreamingDedopplerer runs dedoppler search over a sliding window of the
+  most recent num_timesteps spectra, for data that arrives a spectrum at a time.
+  A new window is searched every hop spectra.
+
+  Consecutive windows share most of their Taylor tree. In the
+    buffer[time_block][path_offset][start_frequency]
+  layout described in taylor.cu, each time block of a round is a complete Taylor
+  tree of its own timesteps, which does not depend on where the window starts.
+  So we keep those subtrees around, and each new hop of spectra only adds one new
+  subtree at each level. The last round of each window is fused with the top path
+  search, like cpuTaylorTreeTopPaths, and never written out.
+
+  This runs on the host, in either build.
+ */
+class StreamingDedopplerer {
+public:
+  // How many timesteps are in each window. Must be a power of two.
+  const int num_timesteps;
+
+  // How many spectra arrive between the starts of consecutive windows.
+  // Must be a power of two, no larger than num_timesteps.
+  const int hop;
+
+  const int num_channels;
+
+  // Frequency difference between adjacent bins, in MHz
+  const double foff;
+
+  // Time difference between adjacent bins, in seconds
+  const double tsamp;
+
+  // The cached subtrees depend on which drift blocks we search, so unlike
+  // Dedopplerer::search, the max drift is fixed up front.
+  const double max_drift;
+
+  bool print_hits;
+
+  // If positive, each window only reports this many hits, as in Dedopplerer
+  int max_hits;
+
+  StreamingDedopplerer(int num_timesteps, int hop, int num_channels, double foff,
+                       double tsamp, double max_drift);
+
+  // Adds one spectrum of num_channels floats.
+  // If that completes a window, the window is searched, the hits are appended to
+  // output, and this returns true.
+  bool addSpectrum(const float* spectrum, const FilterbankMetadata& metadata,
+                   int beam, int coarse_channel, double min_drift,
+                   double snr_threshold, vector<DedopplerHit>* output);
+
+  // Adds num_spectra spectra, stored row-major. Each window this completes is
+  // searched, and appended to output with its own hits, even if it has none.
+  // Returns how many windows were searched.
+  int addSpectra(const float* spectra, int num_spectra,
+                 const FilterbankMetadata& metadata, int beam, int coarse_channel,
+                 double min_drift, double snr_threshold,
+                 vector<StreamingWindowHits>* output);
+
+  // How many spectra have been added so far
+  long numSpectra() const;
+
+  // The index of the first spectrum in the most recently searched window,
+  // or -1 if no window has been searched yet.
+  long lastWindowStart() const;
+
+  size_t memoryUsage() const;
+
+private:
+  // How many hops make up a window
+  int hops_per_window;
+
+  // The number of cached levels of subtrees. Level i has subtrees of
+  // hop * 2^i timesteps.
+  int num_levels;
+
+  int min_drift_block, max_drift_block;
+
+  // The difference in adjacent drift rates that we look for, in Hz/s
+  double drift_rate_resolution;
+
+  long spectra_added;
+  long last_window_start;
+
+  // The spectra of the hop that is currently arriving
+  vector<float> hop_input;
+
+  // Work buffers for the Taylor tree of a single hop
+  vector<float> buffer1, buffer2;
+
+  // subtrees[drift block][level][slot] is a ring of the recent subtrees at each
+  // level. The subtree starting at hop number n is stored in slot
+  // n % (2^level + 1), which is just enough to keep every subtree that a future
+  // subtree or window will need.
+  vector<vector<vector<vector<float> > > > subtrees;
+
+  // The column sums of the most recent hops_per_window hops. The hop starting
+  // at hop number n is stored in slot n % hops_per_window.
+  vector<vector<float> > hop_column_sums;
+
+  vector<float> column_sums;
+  vector<float> top_path_sums;
+  vector<int> top_drift_blocks;
+  vector<int> top_path_offsets;
+
+  NoiseEstimator noise_estimator;
+
+  void addHop(long hop_index);
+  void searchWindow(long first_hop_index, const FilterbankMetadata& metadata,
+                    int beam, int coarse_channel, double min_drift,
+                    double snr_threshold, vector<DedopplerHit>* output);
+};
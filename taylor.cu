@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <assert.h>
 #include <cuda.h>
 #include <iostream>
@@ -348,3 +349,187 @@ const float* optimizedTaylorTree(const float* source, float* buffer1, float* buf
   return twoStageTaylorTree(source, buffer1, buffer2, num_timesteps, num_channels,
                             drift_block);
 }
+
+/*
+  Run the rounds of the Taylor tree algorithm up to paths of length
+  max_path_length, using the tiled kernel for as many rounds as it can do.
+  The output has num_timesteps / max_path_length time blocks, so with
+  max_path_length = 1 it is just the input.
+ */
+const float* partialTaylorTree(const float* input, float* buffer1, float* buffer2,
+                               int num_timesteps, int num_channels, int drift_block,
+                               int max_path_length) {
+  assert(isPowerOfTwo(max_path_length));
+  assert(max_path_length <= num_timesteps);
+  if (max_path_length < 2) {
+    return input;
+  }
+
+  const float* source = input;
+  float* target = buffer1;
+  int path_length = 2;
+
+  // The tiled kernel only supports tiles of height 4 through 32
+  int tile_height = min(max_path_length, 32);
+  if (tile_height >= 4) {
+    int tile_width = tileWidth(tile_height);
+    int tile_block_width = tileBlockWidth(tile_height);
+    int num_blocks = (num_channels + tile_block_width - 1) / tile_block_width;
+    dim3 grid_dim(num_blocks, num_timesteps / tile_height, 1);
+    dim3 block_dim(tile_width, 1, 1);
+    switch (tile_height) {
+    case 4:
+      tiledTaylorKernel<4><<<grid_dim, block_dim>>>
+        (input, buffer1, num_channels, drift_block);
+      break;
+    case 8:
+      tiledTaylorKernel<8><<<grid_dim, block_dim>>>
+        (input, buffer1, num_channels, drift_block);
+      break;
+    case 16:
+      tiledTaylorKernel<16><<<grid_dim, block_dim>>>
+        (input, buffer1, num_channels, drift_block);
+      break;
+    case 32:
+      tiledTaylorKernel<32><<<grid_dim, block_dim>>>
+        (input, buffer1, num_channels, drift_block);
+      break;
+    }
+    checkCuda("partialTaylorTree: tiledTaylorKernel");
+    source = buffer1;
+    target = buffer2;
+    path_length = tile_height * 2;
+  }
+
+  int grid_size = (num_channels + CUDA_MAX_THREADS - 1) / CUDA_MAX_THREADS;
+  for (; path_length <= max_path_length; path_length *= 2) {
+    oneStepTaylorKernel<<<grid_size, CUDA_MAX_THREADS>>>
+      (source, target, num_timesteps, num_channels, path_length, drift_block);
+    checkCuda("partialTaylorTree: oneStepTaylorKernel");
+
+    source = target;
+    target = (target == buffer1) ? buffer2 : buffer1;
+  }
+
+  return source;
+}
+
+/*
+  Gather information about the top hits.
+
+  The eventual goal is for every frequency freq, we want:
+
+  top_path_sums[freq] to contain the largest path sum that starts at freq
+  top_drift_blocks[freq] to contain the drift block of that path
+  top_path_offsets[freq] to contain the path offset of that path
+
+  path_sums[path_offset][freq] contains one path sum.
+  (In row-major order.)
+  So we are just taking the max along a column and carrying some
+  metadata along as we find it. One thread per freq.
+
+  The function ignores data corresponding to invalid paths. See
+  comments in taylor.cu for details.
+*/
+__global__ void findTopPathSumsKernel(const float* path_sums, int num_timesteps,
+                                      int num_freqs, int drift_block,
+                                      float* top_path_sums, int* top_drift_blocks,
+                                      int* top_path_offsets) {
+  int freq = blockIdx.x * blockDim.x + threadIdx.x;
+  if (freq < 0 || freq >= num_freqs) {
+    return;
+  }
+
+  for (int path_offset = 0; path_offset < num_timesteps; ++path_offset) {
+    // Check if the last frequency in this path is out of bounds
+    int last_freq = (num_timesteps - 1) * drift_block + path_offset + freq;
+    if (last_freq < 0 || last_freq >= num_freqs) {
+      // No more of these paths can be valid, either
+      return;
+    }
+
+    float path_sum = path_sums[num_freqs * path_offset + freq];
+    if (path_sum > top_path_sums[freq]) {
+      top_path_sums[freq] = path_sum;
+      top_drift_blocks[freq] = drift_block;
+      top_path_offsets[freq] = path_offset;
+    }
+  }
+}
+
+void findTopPathSums(const float* path_sums, int num_timesteps, int num_freqs,
+                     int drift_block, float* top_path_sums,
+                     int* top_drift_blocks, int* top_path_offsets) {
+  int grid_size = (num_freqs + CUDA_MAX_THREADS - 1) / CUDA_MAX_THREADS;
+  findTopPathSumsKernel<<<grid_size, CUDA_MAX_THREADS>>>
+    (path_sums, num_timesteps, num_freqs, drift_block, top_path_sums,
+     top_drift_blocks, top_path_offsets);
+  checkCuda("findTopPathSums");
+}
+
+/*
+  The last round of the Taylor tree, fused with findTopPathSumsKernel.
+
+  halves contains the sums of paths of length num_timesteps / 2, in two time
+  blocks. Instead of writing out each full-length path sum, we compare it against
+  the top path sum for its frequency right away. The paths are checked in the same
+  order as findTopPathSumsKernel, so the results are identical.
+ */
+__global__ void taylorTopPathsKernel(const float* halves, int num_timesteps,
+                                     int num_freqs, int drift_block,
+                                     float* top_path_sums, int* top_drift_blocks,
+                                     int* top_path_offsets) {
+  int freq = blockIdx.x * blockDim.x + threadIdx.x;
+  if (freq < 0 || freq >= num_freqs) {
+    return;
+  }
+
+  int half_length = num_timesteps / 2;
+  float top_path_sum = top_path_sums[freq];
+  int top_drift_block = top_drift_blocks[freq];
+  int top_path_offset = top_path_offsets[freq];
+
+  for (int path_offset = 0; path_offset < num_timesteps; ++path_offset) {
+    int last_freq = (num_timesteps - 1) * drift_block + path_offset + freq;
+    if (last_freq < 0 || last_freq >= num_freqs) {
+      break;
+    }
+
+    // See taylorOneStepOneChannel for an explanation of these quantities
+    int half_offset = path_offset / 2;
+    int chan_shift = (path_offset + 1) / 2 + drift_block * half_length;
+    float path_sum = halves[index2d(half_offset, freq, num_freqs)] +
+      halves[index2d(half_offset + half_length, freq + chan_shift, num_freqs)];
+    if (path_sum > top_path_sum) {
+      top_path_sum = path_sum;
+      top_drift_block = drift_block;
+      top_path_offset = path_offset;
+    }
+  }
+
+  top_path_sums[freq] = top_path_sum;
+  top_drift_blocks[freq] = top_drift_block;
+  top_path_offsets[freq] = top_path_offset;
+}
+
+/*
+  Runs the Taylor tree for one drift block and updates top_path_sums and friends,
+  with the same results as optimizedTaylorTree followed by findTopPathSums.
+  The last round is fused with finding the top paths, so the full-length path
+  sums are never written to GPU memory.
+ */
+void taylorTreeTopPaths(const float* input, float* buffer1, float* buffer2,
+                        int num_timesteps, int num_channels, int drift_block,
+                        float* top_path_sums, int* top_drift_blocks,
+                        int* top_path_offsets) {
+  assert(num_timesteps >= 2);
+  const float* halves = partialTaylorTree(input, buffer1, buffer2, num_timesteps,
+                                          num_channels, drift_block,
+                                          num_timesteps / 2);
+
+  int grid_size = (num_channels + CUDA_MAX_THREADS - 1) / CUDA_MAX_THREADS;
+  taylorTopPathsKernel<<<grid_size, CUDA_MAX_THREADS>>>
+    (halves, num_timesteps, num_channels, drift_block, top_path_sums,
+     top_drift_blocks, top_path_offsets);
+  checkCuda("taylorTopPathsKernel");
+}
@@ -1,7 +1,5 @@
 #pragma once
 
-#include <cuda.h>
-
 #include "cuda_util.h"
 
 using namespace std;
@@ -117,6 +115,65 @@ unmapDrift(const float* source_buffer, float* target_buffer, int num_timesteps,
   }
 }
 
+/*
+  Calculates a single path sum of the Taylor tree directly from its input,
+  without running the whole tree.
+  This is the value that a Taylor tree over num_paths timesteps would have at
+    output[path_offset][start_chan]
+  for the given drift block, and the path must be in range, in the sense
+  described for taylorOneStepOneChannel.
+
+  The input only needs num_timesteps rows. Any rows up to num_paths after that
+  are treated as zero padding.
+
+  The tree adds up path sums in pairs, so we add up the path's cells in the same
+  pairs, with a stack of partial sums. That makes the result bit-for-bit the same
+  as the tree's. Since x + 0 = x, we can skip the padding by folding the stack
+  at the end.
+ */
+__host__ __device__ inline float
+taylorPathSum(const float* input, int num_timesteps, int num_channels, int num_paths,
+              int drift_block, int path_offset, int start_chan) {
+  // partial_sums[i] is the sum of a power-of-two block of timesteps, of size
+  // 2^levels[i]. The blocks get smaller going up the stack.
+  float partial_sums[32];
+  int levels[32];
+  int stack_size = 0;
+
+  int last_time = (num_timesteps < num_paths) ? num_timesteps : num_paths;
+  for (int time = 0; time < last_time; ++time) {
+    // Follow the recursion of taylorOneStepOneChannel down to this timestep
+    int chan = start_chan;
+    int offset = path_offset;
+    int time_in_block = time;
+    for (int path_length = num_paths; path_length > 1; path_length /= 2) {
+      int half_length = path_length / 2;
+      if (time_in_block >= half_length) {
+        chan += (offset + 1) / 2 + drift_block * half_length;
+        time_in_block -= half_length;
+      }
+      offset /= 2;
+    }
+
+    partial_sums[stack_size] = input[index2d(time, chan, num_channels)];
+    levels[stack_size] = 0;
+    ++stack_size;
+
+    // Merge blocks of equal size, the first half on the left
+    while (stack_size >= 2 && levels[stack_size - 2] == levels[stack_size - 1]) {
+      partial_sums[stack_size - 2] += partial_sums[stack_size - 1];
+      ++levels[stack_size - 2];
+      --stack_size;
+    }
+  }
+
+  float sum = partial_sums[stack_size - 1];
+  for (int i = stack_size - 2; i >= 0; --i) {
+    sum = partial_sums[i] + sum;
+  }
+  return sum;
+}
+
 const float* basicTaylorTree(const float* source_buffer, float* buffer1, float* buffer2,
                              int num_timesteps, int num_freqs, int drift_block);
 
@@ -129,3 +186,16 @@ const float* twoStageTaylorTree(const float* input, float* buffer, float* output
 const float* optimizedTaylorTree(const float* source_buffer,
                                  float* buffer1, float* buffer2,
                                  int num_timesteps, int num_channels, int drift_block);
+
+const float* partialTaylorTree(const float* input, float* buffer1, float* buffer2,
+                               int num_timesteps, int num_channels, int drift_block,
+                               int max_path_length);
+
+void findTopPathSums(const float* path_sums, int num_timesteps, int num_freqs,
+                     int drift_block, float* top_path_sums,
+                     int* top_drift_blocks, int* top_path_offsets);
+
+void taylorTreeTopPaths(const float* input, float* buffer1, float* buffer2,
+                        int num_timesteps, int num_channels, int drift_block,
+                        float* top_path_sums, int* top_drift_blocks,
+                        int* top_path_offsets);
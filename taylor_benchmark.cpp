@@ -0,0 +1,102 @@
+#include <assert.h>
+#include <fmt/core.h>
+#include <iostream>
+#include <math.h>
+
+#include "cpu_taylor.h"
+#include "filterbank_buffer.h"
+#include "simd.h"
+#include "taylor.h"
+#include "util.h"
+
+/*
+  Reports throughput for a Taylor tree run as the effective memory bandwidth.
+  Each round reads two floats and writes one for every cell of the buffer.
+ */
+void printThroughput(const string& name, long elapsed_ms, int num_timesteps,
+                     int num_channels) {
+  double rounds = log2(num_timesteps);
+  double bytes = rounds * num_timesteps * num_channels * 3 * sizeof(float);
+  double seconds = elapsed_ms / 1000.0;
+  cout << fmt::format("{}: elapsed time {:.3f}s, {:.2f} GB/s\n", name, seconds,
+                      bytes / seconds / 1e9);
+}
+
+/*
+  Performance testing the taylor tree inner loops.
+  Then it compares the tiled CPU tree with and without the kernels specialized for
+  each tile height.
+ */
+int main(int argc, char* argv[]) {
+  const int num_timesteps = 256;
+  int num_channels = 1 << 20;
+  FilterbankBuffer input(makeNoisyBuffer(num_timesteps, num_channels));
+
+  FilterbankBuffer buffer1(num_timesteps, num_channels);
+  FilterbankBuffer buffer2(num_timesteps, num_channels);
+
+  int tile_height, tile_width;
+  cpuTileShape(num_timesteps, &tile_height, &tile_width);
+  cout << "cpu simd level: " << simdLevelName(simdLevel()) << endl;
+  cout << fmt::format("cpu tile shape: {} x {}\n", tile_height, tile_width);
+
+  for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+    cout << "\ndrift block " << drift_block << endl;
+
+#ifndef SETICORE_CPU_ONLY
+    long start = timeInMS();
+    basicTaylorTree(input.data, buffer1.data, buffer2.data,
+                    num_timesteps, num_channels, drift_block);
+    cudaDeviceSynchronize();
+    long end = timeInMS();
+    cout << fmt::format("the basic algorithm: elapsed time {:.3f}s\n",
+                        (end - start) / 1000.0);
+
+    start = timeInMS();
+    optimizedTaylorTree(input.data, buffer1.data, buffer2.data,
+                        num_timesteps, num_channels, drift_block);
+
+    cudaDeviceSynchronize();
+    end = timeInMS();
+    cout << fmt::format("optimized algorithm: elapsed time {:.3f}s\n",
+                        (end - start) / 1000.0);
+#endif
+
+    long cpu_start = timeInMS();
+    simdTaylorTree(input.data, buffer1.data, buffer2.data,
+                   num_timesteps, num_channels, drift_block);
+    long cpu_end = timeInMS();
+    printThroughput("cpu simd algorithm", cpu_end - cpu_start,
+                    num_timesteps, num_channels);
+
+    cpu_start = timeInMS();
+    tiledCpuTaylorTree(input.data, buffer1.data, buffer2.data, num_timesteps,
+                       num_channels, drift_block, tile_height, tile_width);
+    cpu_end = timeInMS();
+    printThroughput("cpu tiled algorithm", cpu_end - cpu_start,
+                    num_timesteps, num_channels);
+  }
+
+  // The tiled tree at each timestep count with a specialized kernel, with and
+  // without the specialization. These reuse the buffers above, with the same
+  // number of cells.
+  for (int timesteps = 8; timesteps <= num_timesteps; timesteps *= 2) {
+    int channels = num_timesteps / timesteps * num_channels;
+    int height, width;
+    cpuTileShape(timesteps, &height, &width);
+    cout << fmt::format("\n{} timesteps, tile shape {} x {}\n", timesteps, height,
+                        width);
+    for (bool specialized : {false, true}) {
+      setSpecializedTaylorKernels(specialized);
+      long cpu_start = timeInMS();
+      for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+        tiledCpuTaylorTree(input.data, buffer1.data, buffer2.data, timesteps,
+                           channels, drift_block, height, width);
+      }
+      long cpu_end = timeInMS();
+      printThroughput(specialized ? "specialized kernel" : "generic kernel",
+                      (cpu_end - cpu_start) / 5, timesteps, channels);
+    }
+  }
+  setSpecializedTaylorKernels(true);
+}
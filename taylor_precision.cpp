@@ -0,0 +1,151 @@
+#include <assert.h>
+#include <fmt/core.h>
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <string.h>
+#include <vector>
+
+#include "cpu_taylor.h"
+#include "dedoppler.h"
+#include "filterbank_buffer.h"
+#include "filterbank_file_reader.h"
+#include "noise_estimator.h"
+#include "simd.h"
+#include "util.h"
+
+using namespace std;
+
+/*
+  Compares the reduced-precision Taylor engines against the fp32 engine.
+
+  For each frequency, we find the top path sum over a range of drift blocks, and
+  convert it to an SNR the way the Dedopplerer does. We report the largest SNR
+  difference from fp32, and how many frequencies picked a different top path.
+ */
+class PrecisionReport {
+public:
+  StorageFormat format;
+  double max_snr_deviation = 0.0;
+  long different_paths = 0;
+  long num_frequencies = 0;
+
+  PrecisionReport(StorageFormat format) : format(format) {}
+
+  void print() const {
+    cout << fmt::format("{}: max snr deviation {:.5f}, {} of {} top paths differ\n",
+                        storageFormatName(format), max_snr_deviation,
+                        different_paths, num_frequencies);
+  }
+};
+
+static void findTopPaths(const FilterbankBuffer& input, int min_drift_block,
+                         int max_drift_block, StorageFormat format,
+                         vector<float>* top_path_sums, vector<int>* top_drift_blocks,
+                         vector<int>* top_path_offsets) {
+  int num_channels = input.num_channels;
+  top_path_sums->assign(num_channels, 0.0);
+  top_drift_blocks->assign(num_channels, 0);
+  top_path_offsets->assign(num_channels, 0);
+  vector<float> buffer1((long) input.num_timesteps * num_channels);
+  vector<float> buffer2((long) input.num_timesteps * num_channels);
+  vector<TopPathScratch> scratch;
+  parallelCpuTaylorTreeTopPaths(input.data, buffer1.data(), buffer2.data(),
+                                input.num_timesteps, num_channels, min_drift_block,
+                                max_drift_block, top_path_sums->data(),
+                                top_drift_blocks->data(), top_path_offsets->data(),
+                                format, 1, &scratch);
+}
+
+static void compare(const FilterbankBuffer& input, vector<PrecisionReport>* reports) {
+  int min_drift_block = -2;
+  int max_drift_block = 2;
+
+  vector<float> column_sums(input.num_channels, 0.0);
+  for (int time = 0; time < input.num_timesteps; ++time) {
+    for (int chan = 0; chan < input.num_channels; ++chan) {
+      column_sums[chan] += input.get(time, chan);
+    }
+  }
+  float median, std_dev;
+  NoiseEstimator noise_estimator;
+  noise_estimator.estimate(column_sums.data(), input.num_channels, &median, &std_dev);
+
+  vector<float> expected_sums;
+  vector<int> expected_drift_blocks, expected_path_offsets;
+  findTopPaths(input, min_drift_block, max_drift_block, STORAGE_FP32, &expected_sums,
+               &expected_drift_blocks, &expected_path_offsets);
+
+  for (PrecisionReport& report : *reports) {
+    vector<float> sums;
+    vector<int> drift_blocks, path_offsets;
+    findTopPaths(input, min_drift_block, max_drift_block, report.format, &sums,
+                 &drift_blocks, &path_offsets);
+    for (int chan = 0; chan < input.num_channels; ++chan) {
+      double deviation = abs(sums[chan] - expected_sums[chan]) / std_dev;
+      report.max_snr_deviation = max(report.max_snr_deviation, deviation);
+      if (drift_blocks[chan] != expected_drift_blocks[chan] ||
+          path_offsets[chan] != expected_path_offsets[chan]) {
+        ++report.different_paths;
+      }
+    }
+    report.num_frequencies += input.num_channels;
+  }
+}
+
+static vector<PrecisionReport> makeReports() {
+  return {PrecisionReport(STORAGE_FP16), PrecisionReport(STORAGE_BF16)};
+}
+
+/*
+  Usage:
+    taylor_precision [filename] [num_coarse_channels]
+
+  Without a filename, this just tests synthetic data.
+ */
+int main(int argc, char* argv[]) {
+  cout << "synthetic data:\n";
+  int num_timesteps = 256;
+  int num_channels = 1 << 16;
+  FilterbankBuffer buffer(makeNoisyBuffer(num_timesteps, num_channels));
+
+  // Add some noise and a few drifting signals, so there is something to round
+  mt19937 rng(0);
+  exponential_distribution<float> noise(1.0);
+  for (int time = 0; time < num_timesteps; ++time) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      buffer.set(time, chan, buffer.get(time, chan) + noise(rng));
+    }
+    for (int signal = 1; signal <= 8; ++signal) {
+      int chan = signal * num_channels / 10 + time * (signal - 4) / 3;
+      buffer.set(time, chan, buffer.get(time, chan) + signal);
+    }
+  }
+  auto reports = makeReports();
+  compare(buffer, &reports);
+  for (const auto& report : reports) {
+    report.print();
+  }
+
+  if (argc < 2) {
+    return 0;
+  }
+
+  string filename(argv[1]);
+  auto file = loadFilterbankFile(filename);
+  int num_coarse_channels = file->num_coarse_channels;
+  if (argc >= 3) {
+    num_coarse_channels = min(num_coarse_channels, atoi(argv[2]));
+  }
+  cout << fmt::format("\n{} coarse channels of {}:\n", num_coarse_channels, filename);
+  FilterbankBuffer file_buffer(roundUpToPowerOfTwo(file->num_timesteps),
+                               file->coarse_channel_size);
+  reports = makeReports();
+  for (int coarse_channel = 0; coarse_channel < num_coarse_channels; ++coarse_channel) {
+    file->loadCoarseChannel(coarse_channel, &file_buffer);
+    compare(file_buffer, &reports);
+  }
+  for (const auto& report : reports) {
+    report.print();
+  }
+}
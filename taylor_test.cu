@@ -1,7 +1,9 @@
 #include "catch/catch.hpp"
 #include <fmt/core.h>
 #include <iostream>
+#include <vector>
 
+#include "cpu_taylor.h"
 #include "filterbank_buffer.h"
 #include "taylor.h"
 
@@ -50,3 +52,97 @@ TEST_CASE("optimized taylor outputs match basic algorithm", "[taylor]") {
   }
 }
 
+
+TEST_CASE("cpu taylor outputs match gpu algorithm", "[taylor]") {
+  for (int num_timesteps = 2; num_timesteps <= 64; num_timesteps *= 2) {
+    int num_channels = 500;
+    FilterbankBuffer input(num_timesteps, num_channels);
+    for (int time = 0; time < num_timesteps; ++time) {
+      for (int chan = 0; chan < num_channels; ++chan) {
+        input.set(time, chan, 1.0 * (1 + time * chan % 17));
+      }
+    }
+
+    FilterbankBuffer gpu_buffer1(num_timesteps, num_channels);
+    FilterbankBuffer gpu_buffer2(num_timesteps, num_channels);
+    vector<float> cpu_buffer1(num_timesteps * num_channels);
+    vector<float> cpu_buffer2(num_timesteps * num_channels);
+
+    for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+      const float* gpu_ptr = basicTaylorTree(input.data,
+                                             gpu_buffer1.data, gpu_buffer2.data,
+                                             num_timesteps, num_channels, drift_block);
+      const FilterbankBuffer& gpu = (gpu_ptr == gpu_buffer1.data)
+        ? gpu_buffer1 : gpu_buffer2;
+      cudaDeviceSynchronize();
+
+      const float* cpu_ptr = basicCpuTaylorTree(input.data,
+                                                cpu_buffer1.data(), cpu_buffer2.data(),
+                                                num_timesteps, num_channels,
+                                                drift_block);
+      FilterbankBuffer cpu(num_timesteps, num_channels, (float*) cpu_ptr);
+      gpu.assertEqual(cpu, drift_block);
+
+      const float* simd_ptr = simdTaylorTree(input.data,
+                                             cpu_buffer1.data(), cpu_buffer2.data(),
+                                             num_timesteps, num_channels, drift_block);
+      FilterbankBuffer simd(num_timesteps, num_channels, (float*) simd_ptr);
+      gpu.assertEqual(simd, drift_block);
+    }
+  }
+}
+
+TEST_CASE("fused gpu top paths match cpu two-pass search", "[taylor]") {
+  for (int num_timesteps = 2; num_timesteps <= 128; num_timesteps *= 2) {
+    int num_channels = 1000;
+    FilterbankBuffer input(num_timesteps, num_channels);
+    for (int time = 0; time < num_timesteps; ++time) {
+      for (int chan = 0; chan < num_channels; ++chan) {
+        input.set(time, chan, 1.0 * (1 + time * chan % 17));
+      }
+    }
+
+    FilterbankBuffer gpu_buffer1(num_timesteps, num_channels);
+    FilterbankBuffer gpu_buffer2(num_timesteps, num_channels);
+    vector<float> cpu_buffer1(num_timesteps * num_channels);
+    vector<float> cpu_buffer2(num_timesteps * num_channels);
+
+    float* gpu_sums;
+    int *gpu_drift_blocks, *gpu_path_offsets;
+    cudaMallocManaged(&gpu_sums, num_channels * sizeof(float));
+    cudaMallocManaged(&gpu_drift_blocks, num_channels * sizeof(int));
+    cudaMallocManaged(&gpu_path_offsets, num_channels * sizeof(int));
+    cudaMemset(gpu_sums, 0, num_channels * sizeof(float));
+    cudaMemset(gpu_drift_blocks, 0, num_channels * sizeof(int));
+    cudaMemset(gpu_path_offsets, 0, num_channels * sizeof(int));
+
+    vector<float> cpu_sums(num_channels, 0.0);
+    vector<int> cpu_drift_blocks(num_channels, 0);
+    vector<int> cpu_path_offsets(num_channels, 0);
+
+    for (int drift_block = -2; drift_block <= 2; ++drift_block) {
+      taylorTreeTopPaths(input.data, gpu_buffer1.data, gpu_buffer2.data,
+                         num_timesteps, num_channels, drift_block,
+                         gpu_sums, gpu_drift_blocks, gpu_path_offsets);
+      // The host can't touch managed memory while kernels are running
+      cudaDeviceSynchronize();
+
+      const float* path_sums = basicCpuTaylorTree(input.data, cpu_buffer1.data(),
+                                                  cpu_buffer2.data(), num_timesteps,
+                                                  num_channels, drift_block);
+      cpuFindTopPathSums(path_sums, num_timesteps, num_channels, drift_block,
+                         cpu_sums.data(), cpu_drift_blocks.data(),
+                         cpu_path_offsets.data());
+    }
+
+    for (int chan = 0; chan < num_channels; ++chan) {
+      REQUIRE(gpu_sums[chan] == cpu_sums[chan]);
+      REQUIRE(gpu_drift_blocks[chan] == cpu_drift_blocks[chan]);
+      REQUIRE(gpu_path_offsets[chan] == cpu_path_offsets[chan]);
+    }
+
+    cudaFree(gpu_sums);
+    cudaFree(gpu_drift_blocks);
+    cudaFree(gpu_path_offsets);
+  }
+}
@@ -0,0 +1,50 @@
+#include "test_util.h"
+
+#include <boost/filesystem.hpp>
+
+#include "h5_writer.h"
+#include "util.h"
+
+using namespace std;
+
+FilterbankMetadata testMetadata(int num_timesteps, int num_coarse_channels,
+                                int coarse_channel_size) {
+  FilterbankMetadata m;
+  m.source_name = "bob";
+  m.fch1 = 1.0;
+  m.foff = 2.0;
+  m.tstart = 3.0;
+  m.tsamp = 4.0;
+  m.src_dej = 5.0;
+  m.src_raj = 6.0;
+  m.num_timesteps = num_timesteps;
+  m.num_channels = num_coarse_channels * coarse_channel_size;
+  m.coarse_channel_size = coarse_channel_size;
+  m.num_coarse_channels = num_coarse_channels;
+  m.telescope_id = MEERKAT;
+  return m;
+}
+
+vector<float> testData(int num_timesteps, int num_channels) {
+  vector<float> data;
+  for (int time = 0; time < num_timesteps; ++time) {
+    for (int chan = 0; chan < num_channels; ++chan) {
+      data.push_back(100.0 * time + 1.0 * chan);
+    }
+  }
+  return data;
+}
+
+string testFilename(const string& name) {
+  string dir = boost::filesystem::temp_directory_path().c_str();
+  string filename = dir + "/" + name;
+  boost::filesystem::remove(filename);
+  return filename;
+}
+
+void writeTestH5(const string& filename, const FilterbankMetadata& metadata) {
+  vector<float> data = testData(metadata.num_timesteps, metadata.num_channels);
+  H5Writer writer(filename, metadata);
+  writer.setData(data.data());
+  writer.close();
+}
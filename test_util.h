@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "filterbank_metadata.h"
+
+using namespace std;
+
+/*
+  Helpers for tests that need a small filterbank file.
+ */
+
+// Metadata for a test file with the given shape, and arbitrary values for the
+// rest of it
+FilterbankMetadata testMetadata(int num_timesteps, int num_coarse_channels,
+                                int coarse_channel_size);
+
+// Data with 100 * time + chan at each time and channel, formatted as row-major:
+//   data[time][freq]
+vector<float> testData(int num_timesteps, int num_channels);
+
+// A path for the named file in the temporary directory, with any old file there
+// removed
+string testFilename(const string& name);
+
+// Writes testData for the metadata to an h5 file
+void writeTestH5(const string& filename, const FilterbankMetadata& metadata);
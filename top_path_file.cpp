@@ -0,0 +1,152 @@
+#include <assert.h>
+#include <fmt/core.h>
+#include <limits>
+#include <stdint.h>
+#include <string.h>
+
+#include "top_path_file.h"
+#include "util.h"
+
+using namespace std;
+
+const char TOP_PATH_MAGIC[8] = {'S', 'E', 'T', 'I', 'T', 'O', 'P', 'P'};
+const uint32_t TOP_PATH_VERSION = 1;
+
+// The bytes in one coarse channel's record
+static long recordSize(int coarse_channel_size) {
+  return 2 * sizeof(float) + (long) coarse_channel_size *
+    (sizeof(float) + sizeof(int16_t) + sizeof(uint16_t));
+}
+
+template <class T> static void writeBasic(ofstream& file, T value) {
+  file.write((const char*) &value, sizeof(value));
+}
+
+template <class T> static T readBasic(ifstream& file) {
+  T answer;
+  file.read((char*) &answer, sizeof(answer));
+  return answer;
+}
+
+TopPathFileWriter::TopPathFileWriter(const string& filename,
+                                     const TopPathFileHeader& header)
+  : file(filename, ofstream::binary), header(header), num_written(0) {
+  if (!file) {
+    fatal("could not open top path file for writing:", filename);
+  }
+  file.write(TOP_PATH_MAGIC, sizeof(TOP_PATH_MAGIC));
+  writeBasic<uint32_t>(file, TOP_PATH_VERSION);
+  writeBasic<int32_t>(file, header.num_timesteps);
+  writeBasic<int32_t>(file, header.coarse_channel_size);
+  writeBasic<int32_t>(file, header.num_coarse_channels);
+  writeBasic<double>(file, header.max_drift);
+  writeBasic<double>(file, header.min_snr);
+}
+
+TopPathFileWriter::~TopPathFileWriter() {
+  file.close();
+}
+
+void TopPathFileWriter::write(const TopPaths& top_paths) {
+  int n = header.coarse_channel_size;
+  assert((int) top_paths.path_sums.size() == n);
+  assert((int) top_paths.drift_blocks.size() == n);
+  assert((int) top_paths.path_offsets.size() == n);
+  if (num_written >= header.num_coarse_channels) {
+    fatal(fmt::format("top path file only has room for {} coarse channels",
+                      header.num_coarse_channels));
+  }
+
+  // Convert the whole record first, so it goes out in one write
+  vector<char> record(recordSize(n));
+  char* p = record.data();
+  memcpy(p, &top_paths.median, sizeof(float));
+  p += sizeof(float);
+  memcpy(p, &top_paths.std_dev, sizeof(float));
+  p += sizeof(float);
+  memcpy(p, top_paths.path_sums.data(), n * sizeof(float));
+  p += n * sizeof(float);
+  int16_t* drift_blocks = (int16_t*) p;
+  uint16_t* path_offsets = (uint16_t*) (p + n * sizeof(int16_t));
+  for (int i = 0; i < n; ++i) {
+    int drift_block = top_paths.drift_blocks[i];
+    int path_offset = top_paths.path_offsets[i];
+    if (drift_block < numeric_limits<int16_t>::min() ||
+        drift_block > numeric_limits<int16_t>::max() ||
+        path_offset < 0 || path_offset > numeric_limits<uint16_t>::max()) {
+      fatal(fmt::format("drift block {} path offset {} does not fit in a top path file",
+                        drift_block, path_offset));
+    }
+    drift_blocks[i] = drift_block;
+    path_offsets[i] = path_offset;
+  }
+
+  file.write(record.data(), record.size());
+  if (!file) {
+    fatal("error writing top path file");
+  }
+  ++num_written;
+}
+
+TopPathFileReader::TopPathFileReader(const string& filename)
+  : file(filename, ifstream::binary) {
+  if (!file) {
+    fatal("could not open top path file:", filename);
+  }
+  char magic[sizeof(TOP_PATH_MAGIC)];
+  file.read(magic, sizeof(magic));
+  if (!file || memcmp(magic, TOP_PATH_MAGIC, sizeof(magic)) != 0) {
+    fatal("not a top path file:", filename);
+  }
+  uint32_t version = readBasic<uint32_t>(file);
+  if (version != TOP_PATH_VERSION) {
+    fatal(fmt::format("{} has top path file version {} but we only read version {}",
+                      filename, version, TOP_PATH_VERSION));
+  }
+  header.num_timesteps = readBasic<int32_t>(file);
+  header.coarse_channel_size = readBasic<int32_t>(file);
+  header.num_coarse_channels = readBasic<int32_t>(file);
+  header.max_drift = readBasic<double>(file);
+  header.min_snr = readBasic<double>(file);
+  if (!file) {
+    fatal("truncated top path file header:", filename);
+  }
+  data_start = file.tellg();
+
+  file.seekg(0, file.end);
+  long num_data_bytes = file.tellg() - data_start;
+  long expected = header.num_coarse_channels * recordSize(header.coarse_channel_size);
+  if (num_data_bytes != expected) {
+    fatal(fmt::format("{} has {} bytes of top paths but its header implies {}",
+                      filename, num_data_bytes, expected));
+  }
+}
+
+TopPathFileReader::~TopPathFileReader() {
+  file.close();
+}
+
+void TopPathFileReader::read(int coarse_channel, TopPaths* output) {
+  assert(0 <= coarse_channel && coarse_channel < header.num_coarse_channels);
+  int n = header.coarse_channel_size;
+  vector<char> record(recordSize(n));
+  file.seekg(data_start + (streamoff) (coarse_channel * recordSize(n)));
+  file.read(record.data(), record.size());
+  if (!file) {
+    fatal(fmt::format("error reading coarse channel {} of top path file",
+                      coarse_channel));
+  }
+
+  const char* p = record.data();
+  memcpy(&output->median, p, sizeof(float));
+  p += sizeof(float);
+  memcpy(&output->std_dev, p, sizeof(float));
+  p += sizeof(float);
+  output->path_sums.resize(n);
+  memcpy(output->path_sums.data(), p, n * sizeof(float));
+  p += n * sizeof(float);
+  const int16_t* drift_blocks = (const int16_t*) p;
+  const uint16_t* path_offsets = (const uint16_t*) (p + n * sizeof(int16_t));
+  output->drift_blocks.assign(drift_blocks, drift_blocks + n);
+  output->path_offsets.assign(path_offsets, path_offsets + n);
+}
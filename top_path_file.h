@@ -0,0 +1,76 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+  What a search found for one coarse channel before applying the SNR threshold.
+  For each frequency, the largest path sum and which path it came from, plus the
+  noise level that the path sums are measured against.
+ */
+struct TopPaths {
+  float median;
+  float std_dev;
+  vector<float> path_sums;
+  vector<int> drift_blocks;
+  vector<int> path_offsets;
+};
+
+/*
+  The settings of the search that a top path file came from.
+  min_snr is the smallest SNR threshold that the top paths are valid for. Pruning
+  and hierarchical search skip paths that can't reach the threshold they were run
+  with, so the top paths they save can't be rethresholded any lower. It's
+  -infinity for a full search.
+ */
+struct TopPathFileHeader {
+  int num_timesteps;
+  int coarse_channel_size;
+  int num_coarse_channels;
+  double max_drift;
+  double min_snr;
+};
+
+/*
+  A top path file stores the TopPaths of every coarse channel in a search, so that
+  the hits for a different SNR threshold, min drift, or max hits can be found
+  without running the Taylor tree again.
+
+  The format is a header, then one fixed-size record per coarse channel, in order:
+    float median, float std_dev,
+    float[coarse_channel_size] path sums,
+    int16[coarse_channel_size] drift blocks,
+    uint16[coarse_channel_size] path offsets
+  All values are little-endian.
+ */
+class TopPathFileWriter {
+ private:
+  ofstream file;
+  const TopPathFileHeader header;
+  int num_written;
+
+ public:
+  TopPathFileWriter(const string& filename, const TopPathFileHeader& header);
+  ~TopPathFileWriter();
+
+  // Coarse channels must be written in order
+  void write(const TopPaths& top_paths);
+};
+
+// This class is not threadsafe.
+class TopPathFileReader {
+ private:
+  ifstream file;
+  streampos data_start;
+
+ public:
+  TopPathFileHeader header;
+
+  TopPathFileReader(const string& filename);
+  ~TopPathFileReader();
+
+  void read(int coarse_channel, TopPaths* output);
+};
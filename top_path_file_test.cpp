@@ -0,0 +1,99 @@
+#include "catch/catch.hpp"
+
+#include <boost/filesystem.hpp>
+#include <math.h>
+#include <vector>
+
+#include "dedoppler.h"
+#include "filterbank_buffer.h"
+#include "filterbank_metadata.h"
+#include "top_path_file.h"
+#include "util.h"
+
+TEST_CASE("rethresholding saved top paths matches searching again", "[top_paths]") {
+  string dir = boost::filesystem::temp_directory_path().c_str();
+  string filename = dir + "/testing.toppaths";
+  boost::filesystem::remove(filename);
+
+  int num_timesteps = 16;
+  int num_channels = 10000;
+  int num_coarse_channels = 3;
+  double max_drift = 0.4;
+  FilterbankMetadata metadata = FilterbankMetadata();
+  Dedopplerer dedopplerer(num_timesteps, num_channels, 1e-6, 1.0, false);
+
+  vector<FilterbankBuffer*> inputs;
+  {
+    TopPathFileHeader header;
+    header.num_timesteps = num_timesteps;
+    header.coarse_channel_size = num_channels;
+    header.num_coarse_channels = num_coarse_channels;
+    header.max_drift = max_drift;
+    header.min_snr = -INFINITY;
+    TopPathFileWriter writer(filename, header);
+    vector<DedopplerHit> hits;
+    TopPaths top_paths;
+    for (int i = 0; i < num_coarse_channels; ++i) {
+      inputs.push_back(new FilterbankBuffer(makeNoisyBuffer(num_timesteps,
+                                                            num_channels)));
+
+      // Signals of a range of brightness, so each threshold finds different hits
+      for (int j = 1; j < 10; ++j) {
+        for (int time = 0; time < num_timesteps; ++time) {
+          int chan = 1000 * j + time * (j % 3) / 2;
+          inputs[i]->set(time, chan, inputs[i]->get(time, chan) + 0.1 * j);
+        }
+      }
+      dedopplerer.search(*inputs[i], metadata, NO_BEAM, i, max_drift, 0.0, 3.0,
+                         &hits);
+      dedopplerer.topPaths(&top_paths);
+      writer.write(top_paths);
+    }
+  }
+
+  TopPathFileReader reader(filename);
+  REQUIRE(reader.header.num_timesteps == num_timesteps);
+  REQUIRE(reader.header.coarse_channel_size == num_channels);
+  REQUIRE(reader.header.num_coarse_channels == num_coarse_channels);
+  REQUIRE(reader.header.max_drift == max_drift);
+  REQUIRE(reader.header.min_snr == -INFINITY);
+
+  int drift_timesteps = num_timesteps - 1;
+  double drift_rate_resolution = 1.0 / drift_timesteps;
+  TopPaths top_paths;
+  vector<int> total_hits;
+  for (double snr : {5.0, 100.0, 400.0}) {
+    total_hits.push_back(0);
+    for (double min_drift : {0.0, 0.1}) {
+      // Read the coarse channels out of order, to check seeking
+      for (int i = num_coarse_channels - 1; i >= 0; --i) {
+        vector<DedopplerHit> expected, hits;
+        dedopplerer.search(*inputs[i], metadata, NO_BEAM, i, max_drift, min_drift,
+                           snr, &expected);
+        reader.read(i, &top_paths);
+        findHits(metadata, NO_BEAM, i, num_timesteps, drift_rate_resolution,
+                 max_drift, min_drift, snr, num_channels, top_paths.median,
+                 top_paths.std_dev, top_paths.path_sums.data(),
+                 top_paths.drift_blocks.data(), top_paths.path_offsets.data(), 0,
+                 false, &hits);
+        REQUIRE(hits.size() == expected.size());
+        for (int j = 0; j < (int) hits.size(); ++j) {
+          REQUIRE(hits[j].index == expected[j].index);
+          REQUIRE(hits[j].drift_steps == expected[j].drift_steps);
+          REQUIRE(hits[j].power == expected[j].power);
+          REQUIRE(hits[j].snr == expected[j].snr);
+          REQUIRE(hits[j].coarse_channel == i);
+        }
+        total_hits.back() += hits.size();
+      }
+    }
+  }
+  REQUIRE(total_hits[0] > total_hits[1]);
+  REQUIRE(total_hits[1] > total_hits[2]);
+  REQUIRE(total_hits[2] > 0);
+
+  for (FilterbankBuffer* input : inputs) {
+    delete input;
+  }
+  boost::filesystem::remove(filename);
+}
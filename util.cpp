@@ -37,10 +37,6 @@ string zeroPad(int n, int size) {
   return fmt::format(formatter, n);
 }
 
-string cToS(thrust::complex<float> c) {
-  return fmt::format("{:.6f} + {:.6f} i", c.real(), c.imag());
-}
-
 string stripAnyTrailingSlash(const string& s) {
   if (s.empty()) {
     return s;
@@ -51,6 +47,12 @@ string stripAnyTrailingSlash(const string& s) {
   return s;
 }
 
+#ifndef SETICORE_CPU_ONLY
+
+string cToS(thrust::complex<float> c) {
+  return fmt::format("{:.6f} + {:.6f} i", c.real(), c.imag());
+}
+
 void assertComplexEq(thrust::complex<float> c, float real, float imag) {
   if (abs(c.real() - real) > 0.001) {
     cerr << "c.real() = " << c.real() << " but real = " << real << endl;
@@ -62,6 +64,8 @@ void assertComplexEq(thrust::complex<float> c, float real, float imag) {
   }
 }
 
+#endif
+
 void assertFloatEq(float a, float b) {
   assertFloatEq(a, b, "");
 }
@@ -1,7 +1,9 @@
 #pragma once
 
+#ifndef SETICORE_CPU_ONLY
 #include <cuda_runtime.h>
 #include <thrust/complex.h>
+#endif
 #include <string>
 
 using namespace std;
@@ -22,9 +24,11 @@ int roundUpToPowerOfTwo(int n);
 bool isPowerOfTwo(int n);
 int numDigits(int n);
 string zeroPad(int n, int size);
-string cToS(thrust::complex<float> c);
 string stripAnyTrailingSlash(const string& s);
+#ifndef SETICORE_CPU_ONLY
+string cToS(thrust::complex<float> c);
 void assertComplexEq(thrust::complex<float> c, float real, float imag);
+#endif
 void assertFloatEq(float a, float b);
 void assertFloatEq(float a, float b, const string& tag);
 void assertStringEq(const string& lhs, const string& rhs);